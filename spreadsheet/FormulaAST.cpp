@@ -4,13 +4,22 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstdlib>
+#include <iterator>
 #include <memory>
 #include <sstream>
+#include <string_view>
 
 namespace ASTImpl 
 {
+    // Точность, с которой поток по умолчанию выводит числа, и буфер для такого числа
+    constexpr int NUMBER_PRECISION = 6;
+    constexpr std::size_t NUMBER_BUFFER_SIZE = 32;
+
     enum ExprPrecedence 
     {
         EP_ADD,
@@ -73,14 +82,16 @@ namespace ASTImpl
         public:
 
             virtual ~Expr() = default;
-            virtual void Print(std::ostream& out) const = 0;
-            virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-            virtual double Evaluate(const SheetArgs& args) const = 0;
+            // Ссылки на ячейки хранятся относительно origin и печатаются абсолютными
+            virtual void Print(std::ostream& out, Position origin) const = 0;
+            virtual void DoPrintFormula(std::string& out, Position origin, ExprPrecedence precedence) const = 0;
+            // Дописывает в программу инструкции, вычисляющие выражение
+            virtual void Compile(Program& program) const = 0;
 
             // higher is tighter
             virtual ExprPrecedence GetPrecedence() const = 0;
 
-            void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, bool right_child = false) const 
+            void PrintFormula(std::string& out, Position origin, ExprPrecedence parent_precedence, bool right_child = false) const 
             {
                 auto precedence = GetPrecedence();
                 auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -88,20 +99,48 @@ namespace ASTImpl
 
                 if (parens_needed) 
                 {
-                    out << '(';
+                    out += '(';
                 }
 
-                DoPrintFormula(out, precedence);
+                DoPrintFormula(out, origin, precedence);
 
                 if (parens_needed) 
                 {
-                    out << ')';
+                    out += ')';
                 }
             }
     };
 
     namespace 
     {
+        // Глубина стека, достаточная для выполнения программы
+        std::size_t GetStackDepth(const std::vector<Instruction>& code) 
+        {
+            std::size_t depth = 0;
+            std::size_t max_depth = 0;
+
+            for (const auto& instruction : code) 
+            {
+                switch (instruction.op) 
+                {
+                    case OpCode::PushNumber:
+                    case OpCode::PushCell:
+                        max_depth = std::max(max_depth, ++depth);
+                        break;
+
+                    case OpCode::Negate:
+                    case OpCode::Plus:
+                        break;
+
+                    default:
+                        --depth;
+                        break;
+                }
+            }
+
+            return max_depth;
+        }
+
         class BinaryOpExpr final : public Expr 
         {
             public:
@@ -116,26 +155,26 @@ namespace ASTImpl
 
             public:
 
-                explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+                explicit BinaryOpExpr(Type type, const Expr* lhs, const Expr* rhs)
                     : type_(type)
-                    , lhs_(std::move(lhs))
-                    , rhs_(std::move(rhs)) 
+                    , lhs_(lhs)
+                    , rhs_(rhs) 
                     {}
 
-                void Print(std::ostream& out) const override 
+                void Print(std::ostream& out, Position origin) const override 
                 {
                     out << '(' << static_cast<char>(type_) << ' ';
-                    lhs_->Print(out);
+                    lhs_->Print(out, origin);
                     out << ' ';
-                    rhs_->Print(out);
+                    rhs_->Print(out, origin);
                     out << ')';
                 }
 
-                void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override 
+                void DoPrintFormula(std::string& out, Position origin, ExprPrecedence precedence) const override 
                 {
-                    lhs_->PrintFormula(out, precedence);
-                    out << static_cast<char>(type_);
-                    rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+                    lhs_->PrintFormula(out, origin, precedence);
+                    out += static_cast<char>(type_);
+                    rhs_->PrintFormula(out, origin, precedence, /* right_child = */ true);
                 }
 
                 ExprPrecedence GetPrecedence() const override 
@@ -161,43 +200,36 @@ namespace ASTImpl
                     }
                 }
 
-                double Evaluate(const SheetArgs& args) const override 
+                void Compile(Program& program) const override 
                 {
-                    // Скопируйте ваше решение из предыдущих уроков
-                    double val = 0.0;
+                    lhs_->Compile(program);
+                    rhs_->Compile(program);
 
                     switch (type_) 
                     {
                         case Add:
-                            val = lhs_->Evaluate(args) + rhs_->Evaluate(args);
+                            program.code.push_back({ OpCode::Add });
                             break;
 
                         case Subtract:
-                            val = lhs_->Evaluate(args) - rhs_->Evaluate(args);
+                            program.code.push_back({ OpCode::Subtract });
                             break;
 
                         case Multiply:
-                            val = lhs_->Evaluate(args) * rhs_->Evaluate(args);
+                            program.code.push_back({ OpCode::Multiply });
                             break;
 
                         case Divide:
-                            val = lhs_->Evaluate(args) / rhs_->Evaluate(args);
+                            program.code.push_back({ OpCode::Divide });
                             break;
                     }
-
-                    if (!std::isfinite(val)) 
-                    {
-                        throw FormulaError(FormulaError::Category::Arithmetic);
-                    }
-
-                    return val;
                 }
 
             private:
 
                 Type type_;
-                std::unique_ptr<Expr> lhs_;
-                std::unique_ptr<Expr> rhs_;
+                const Expr* lhs_;
+                const Expr* rhs_;
         };
 
         class UnaryOpExpr final : public Expr 
@@ -212,22 +244,22 @@ namespace ASTImpl
 
             public:
 
-                explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+                explicit UnaryOpExpr(Type type, const Expr* operand)
                     : type_(type)
-                    , operand_(std::move(operand)) 
+                    , operand_(operand) 
                     {}
 
-                void Print(std::ostream& out) const override 
+                void Print(std::ostream& out, Position origin) const override 
                 {
                     out << '(' << static_cast<char>(type_) << ' ';
-                    operand_->Print(out);
+                    operand_->Print(out, origin);
                     out << ')';
                 }
 
-                void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override 
+                void DoPrintFormula(std::string& out, Position origin, ExprPrecedence precedence) const override 
                 {
-                    out << static_cast<char>(type_);
-                    operand_->PrintFormula(out, precedence);
+                    out += static_cast<char>(type_);
+                    operand_->PrintFormula(out, origin, precedence);
                 }
 
                 ExprPrecedence GetPrecedence() const override 
@@ -235,24 +267,17 @@ namespace ASTImpl
                     return EP_UNARY;
                 }
 
-                // Реализуйте метод Evaluate() для унарных операций.
-                double Evaluate(const SheetArgs& args) const override 
+                void Compile(Program& program) const override 
                 {
-                    // Скопируйте ваше решение из предыдущих уроков
-                    switch (type_) 
-                    {
-                        case UnaryMinus:
-                            return -1 * operand_->Evaluate(args);
+                    operand_->Compile(program);
 
-                        default:
-                            return operand_->Evaluate(args);
-                    }
+                    program.code.push_back({ type_ == UnaryMinus ? OpCode::Negate : OpCode::Plus });
                 }
 
             private:
 
                 Type type_;
-                std::unique_ptr<Expr> operand_;
+                const Expr* operand_;
         };
 
         class NumberExpr final : public Expr 
@@ -263,14 +288,17 @@ namespace ASTImpl
                     : value_(value) 
                     {}
 
-                void Print(std::ostream& out) const override 
+                void Print(std::ostream& out, Position /* origin */) const override 
                 {
                     out << value_;
                 }
 
-                void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override 
+                void DoPrintFormula(std::string& out, Position /* origin */, ExprPrecedence /* precedence */) const override 
                 {
-                    out << value_;
+                    // Число выводится так же, как его выводит поток с настройками по умолчанию
+                    char chars[NUMBER_BUFFER_SIZE];
+                    const auto result = std::to_chars(chars, chars + sizeof(chars), value_, std::chars_format::general, NUMBER_PRECISION);
+                    out.append(chars, result.ptr);
                 }
 
                 ExprPrecedence GetPrecedence() const override 
@@ -278,10 +306,10 @@ namespace ASTImpl
                     return EP_ATOM;
                 }
 
-                // Для чисел метод возвращает значение числа
-                double Evaluate(const SheetArgs& args) const override 
+                void Compile(Program& program) const override 
                 {
-                    return value_;
+                    program.code.push_back({ OpCode::PushNumber, static_cast<std::uint32_t>(program.constants.size()) });
+                    program.constants.push_back(value_);
                 }
 
             private:
@@ -293,26 +321,39 @@ namespace ASTImpl
         {
             public:
 
-                explicit CellExpr(const Position* cell)
+                explicit CellExpr(Position cell)
                         : cell_(cell) 
                         {}
 
-                void Print(std::ostream& out) const override 
+                void Print(std::ostream& out, Position origin) const override 
                 {
-                    if (!cell_->IsValid()) 
+                    const Position cell{ cell_.row + origin.row, cell_.col + origin.col };
+
+                    if (!cell.IsValid()) 
                     {
                         out << FormulaError::Category::Ref;
                     } 
                     
                     else 
                     {
-                        out << cell_->ToString();
+                        out << cell.ToString();
                     }
                 }
 
-                void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override 
+                void DoPrintFormula(std::string& out, Position origin, ExprPrecedence /* precedence */) const override 
                 {
-                    Print(out);
+                    const Position cell{ cell_.row + origin.row, cell_.col + origin.col };
+
+                    if (!cell.IsValid()) 
+                    {
+                        out += FormulaError(FormulaError::Category::Ref).ToString();
+                    } 
+                    
+                    else 
+                    {
+                        char chars[Position::MAX_STRING_LENGTH];
+                        out.append(chars, cell.ToChars(chars));
+                    }
                 }
 
                 ExprPrecedence GetPrecedence() const override 
@@ -320,29 +361,65 @@ namespace ASTImpl
                     return EP_ATOM;
                 }
 
-                double Evaluate(const SheetArgs& args) const override 
+                // Ссылка компилируется в индекс позиции в отсортированном пуле ячеек
+                void Compile(Program& program) const override 
                 {
-                    return args(*cell_);
+                    auto it = std::lower_bound(program.cells.begin(), program.cells.end(), cell_);
+                    assert(it != program.cells.end() && *it == cell_);
+                    program.code.push_back({ OpCode::PushCell, static_cast<std::uint32_t>(it - program.cells.begin()) });
                 }
 
             private:
 
-                const Position* cell_;
+                Position cell_;
         };
 
+        // Переводит лексему NUMBER в число так же, как std::istream (через strtod).
+        // Бросает ParsingError, если число не помещается в double
+        double ParseNumber(std::string_view token) 
+        {
+            double value = 0;
+            const char* end = token.data() + token.size();
+            const auto result = std::from_chars(token.data(), end, value);
+
+            if (result.ec == std::errc() && result.ptr == end) 
+            {
+                return value;
+            }
+
+            // from_chars не отличает переполнение от потери значимости, а поток
+            // читает слишком малое число как денормализованное или ноль
+            if (result.ec == std::errc::result_out_of_range) 
+            {
+                value = std::strtod(std::string(token).c_str(), nullptr);
+
+                if (!std::isinf(value)) 
+                {
+                    return value;
+                }
+            }
+
+            throw ParsingError("Invalid number: " + std::string(token));
+        }
+
         class ParseASTListener final : public FormulaBaseListener 
         {
             public:
 
-                std::unique_ptr<Expr> MoveRoot() 
+                explicit ParseASTListener(Arena& arena, Position origin)
+                    : arena_(arena)
+                    , origin_(origin) 
+                    {}
+
+                const Expr* MoveRoot() 
                 {
                     assert(args_.size() == 1);
-                    auto root = std::move(args_.front());
+                    auto root = args_.front();
                     args_.clear();
                     return root;
                 }
 
-                std::forward_list<Position> MoveCells() 
+                std::vector<Position> MoveCells() 
                 {
                     return std::move(cells_);
                 }
@@ -353,7 +430,7 @@ namespace ASTImpl
                 {
                     assert(!args_.empty());
 
-                    auto operand = std::move(args_.back());
+                    auto operand = args_.back();
 
                     UnaryOpExpr::Type type;
 
@@ -368,34 +445,22 @@ namespace ASTImpl
                         type = UnaryOpExpr::UnaryPlus;
                     }
 
-                    auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-                    args_.back() = std::move(node);
+                    args_.back() = arena_.Make<UnaryOpExpr>(type, operand);
                 }
 
                 void exitLiteral(FormulaParser::LiteralContext* ctx) override 
                 {
-                    double value = 0;
-                    auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-                    std::istringstream in(valueStr);
-                    in >> value;
-
-                    if (!in) 
-                    {
-                        throw ParsingError("Invalid number: " + valueStr);
-                    }
-
-                    auto node = std::make_unique<NumberExpr>(value);
-                    args_.push_back(std::move(node));
+                    args_.push_back(arena_.Make<NumberExpr>(ParseNumber(ctx->NUMBER()->getSymbol()->getText())));
                 }
 
                 void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override 
                 {
                     assert(args_.size() >= 2);
 
-                    auto rhs = std::move(args_.back());
+                    auto rhs = args_.back();
                     args_.pop_back();
 
-                    auto lhs = std::move(args_.back());
+                    auto lhs = args_.back();
 
                     BinaryOpExpr::Type type;
 
@@ -420,8 +485,7 @@ namespace ASTImpl
                         type = BinaryOpExpr::Divide;
                     }
 
-                    auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-                    args_.back() = std::move(node);
+                    args_.back() = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
                 }
 
                 void exitCell(FormulaParser::CellContext* ctx) override 
@@ -434,9 +498,9 @@ namespace ASTImpl
                         throw FormulaException("Invalid position: " + value_str);
                     }
 
-                    cells_.push_front(value);
-                    auto node = std::make_unique<CellExpr>(&cells_.front());
-                    args_.push_back(std::move(node));
+                    value = { value.row - origin_.row, value.col - origin_.col };
+                    cells_.push_back(value);
+                    args_.push_back(arena_.Make<CellExpr>(value));
                 }
 
                 void visitErrorNode(antlr4::tree::ErrorNode* node) override 
@@ -446,8 +510,327 @@ namespace ASTImpl
 
             private:
 
-                std::vector<std::unique_ptr<Expr>> args_;
-                std::forward_list<Position> cells_;
+                Arena& arena_;
+                Position origin_;
+                std::vector<const Expr*> args_;
+                std::vector<Position> cells_;
+        };
+
+        // Лексический анализатор по правилам лексем Formula.g4
+        class Lexer 
+        {
+            public:
+
+                enum class Token 
+                {
+                    Number,
+                    Cell,
+                    Add,
+                    Subtract,
+                    Multiply,
+                    Divide,
+                    LeftParen,
+                    RightParen,
+                    End,
+                };
+
+                explicit Lexer(std::string_view text)
+                    : text_(text) 
+                    {}
+
+                Token GetToken() const 
+                {
+                    return token_;
+                }
+
+                // Текст лексемы-числа или ячейки
+                std::string_view GetText() const 
+                {
+                    return token_text_;
+                }
+
+                // Читает следующую лексему. Бросает ParsingError, если символы
+                // не складываются в лексему
+                void Next() 
+                {
+                    while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) 
+                    {
+                        ++pos_;
+                    }
+
+                    if (pos_ == text_.size()) 
+                    {
+                        token_ = Token::End;
+                        return;
+                    }
+
+                    const std::size_t begin = pos_;
+                    const char c = text_[pos_];
+
+                    switch (c) 
+                    {
+                        case '+':
+                            token_ = Token::Add;
+                            ++pos_;
+                            return;
+
+                        case '-':
+                            token_ = Token::Subtract;
+                            ++pos_;
+                            return;
+
+                        case '*':
+                            token_ = Token::Multiply;
+                            ++pos_;
+                            return;
+
+                        case '/':
+                            token_ = Token::Divide;
+                            ++pos_;
+                            return;
+
+                        case '(':
+                            token_ = Token::LeftParen;
+                            ++pos_;
+                            return;
+
+                        case ')':
+                            token_ = Token::RightParen;
+                            ++pos_;
+                            return;
+                    }
+
+                    if (IsLetter(c)) 
+                    {
+                        // CELL: [A-Z]+[0-9]+
+                        std::size_t letters_end = begin;
+
+                        while (letters_end < text_.size() && IsLetter(text_[letters_end])) 
+                        {
+                            ++letters_end;
+                        }
+
+                        pos_ = SkipDigits(letters_end);
+
+                        if (pos_ == letters_end) 
+                        {
+                            throw ParsingError("Invalid token");
+                        }
+
+                        token_ = Token::Cell;
+                    }
+
+                    else if (IsDigit(c) || c == '.') 
+                    {
+                        // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+                        pos_ = SkipDigits(begin);
+
+                        if (pos_ < text_.size() && text_[pos_] == '.' && SkipDigits(pos_ + 1) > pos_ + 1) 
+                        {
+                            pos_ = SkipDigits(pos_ + 1);
+                        }
+
+                        if (pos_ == begin) 
+                        {
+                            throw ParsingError("Invalid token");
+                        }
+
+                        // Экспонента входит в число, только если в ней есть цифры
+                        if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) 
+                        {
+                            std::size_t exponent = pos_ + 1;
+
+                            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) 
+                            {
+                                ++exponent;
+                            }
+
+                            if (SkipDigits(exponent) > exponent) 
+                            {
+                                pos_ = SkipDigits(exponent);
+                            }
+                        }
+
+                        token_ = Token::Number;
+                    }
+
+                    else 
+                    {
+                        throw ParsingError("Invalid token");
+                    }
+
+                    token_text_ = text_.substr(begin, pos_ - begin);
+                }
+
+            private:
+
+                static bool IsDigit(char c) 
+                {
+                    return c >= '0' && c <= '9';
+                }
+
+                static bool IsLetter(char c) 
+                {
+                    return c >= 'A' && c <= 'Z';
+                }
+
+                // Возвращает позицию первого символа после цифр, начиная с pos
+                std::size_t SkipDigits(std::size_t pos) const 
+                {
+                    while (pos < text_.size() && IsDigit(text_[pos])) 
+                    {
+                        ++pos;
+                    }
+
+                    return pos;
+                }
+
+                std::string_view text_;
+                std::size_t pos_ = 0;
+                Token token_ = Token::End;
+                std::string_view token_text_;
+        };
+
+        // Рукописный парсер грамматики Formula.g4 (разбор по приоритетам операций).
+        // Строит те же деревья, что и ParseASTListener. Унарные операции связывают
+        // сильнее бинарных, бинарные операции левоассоциативны.
+        // При любой ошибке бросает ParsingError
+        class ExpressionParser 
+        {
+            public:
+
+                explicit ExpressionParser(std::string_view text, Arena& arena, Position origin)
+                    : lexer_(text)
+                    , arena_(arena)
+                    , origin_(origin) 
+                    {}
+
+                const Expr* ParseMain() 
+                {
+                    lexer_.Next();
+                    auto root = ParseExpr(0);
+
+                    if (lexer_.GetToken() != Token::End) 
+                    {
+                        throw ParsingError("Unexpected token");
+                    }
+
+                    return root;
+                }
+
+                std::vector<Position> MoveCells() 
+                {
+                    return std::move(cells_);
+                }
+
+            private:
+
+                using Token = Lexer::Token;
+
+                // Уровень связывания бинарной операции; 0 - лексема не бинарная операция
+                static int GetBindingLevel(Token token) 
+                {
+                    switch (token) 
+                    {
+                        case Token::Add:
+                        case Token::Subtract:
+                            return 1;
+
+                        case Token::Multiply:
+                        case Token::Divide:
+                            return 2;
+
+                        default:
+                            return 0;
+                    }
+                }
+
+                // Разбирает выражение из бинарных операций с уровнем больше min_level
+                const Expr* ParseExpr(int min_level) 
+                {
+                    auto lhs = ParseUnary();
+
+                    for (int level = GetBindingLevel(lexer_.GetToken()); level > min_level; level = GetBindingLevel(lexer_.GetToken())) 
+                    {
+                        const Token token = lexer_.GetToken();
+                        BinaryOpExpr::Type type = token == Token::Add ? BinaryOpExpr::Add 
+                                                : token == Token::Subtract ? BinaryOpExpr::Subtract 
+                                                : token == Token::Multiply ? BinaryOpExpr::Multiply 
+                                                : BinaryOpExpr::Divide;
+                        lexer_.Next();
+                        // Правый операнд не захватывает операции того же уровня
+                        auto rhs = ParseExpr(level);
+                        lhs = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+                    }
+
+                    return lhs;
+                }
+
+                const Expr* ParseUnary() 
+                {
+                    const Token token = lexer_.GetToken();
+
+                    if (token == Token::Add || token == Token::Subtract) 
+                    {
+                        auto type = token == Token::Add ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+                        lexer_.Next();
+
+                        return arena_.Make<UnaryOpExpr>(type, ParseUnary());
+                    }
+
+                    return ParseAtom();
+                }
+
+                const Expr* ParseAtom() 
+                {
+                    const Expr* node = nullptr;
+
+                    switch (lexer_.GetToken()) 
+                    {
+                        case Token::LeftParen:
+                            lexer_.Next();
+                            node = ParseExpr(0);
+
+                            if (lexer_.GetToken() != Token::RightParen) 
+                            {
+                                throw ParsingError("Expected ')'");
+                            }
+
+                            break;
+
+                        case Token::Number:
+                            node = arena_.Make<NumberExpr>(ParseNumber(lexer_.GetText()));
+                            break;
+
+                        case Token::Cell: 
+                        {
+                            auto value = Position::FromString(lexer_.GetText());
+
+                            if (!value.IsValid()) 
+                            {
+                                throw ParsingError("Invalid position");
+                            }
+
+                            value = { value.row - origin_.row, value.col - origin_.col };
+                            cells_.push_back(value);
+                            node = arena_.Make<CellExpr>(value);
+                            break;
+                        }
+
+                        default:
+                            throw ParsingError("Unexpected token");
+                    }
+
+                    lexer_.Next();
+
+                    return node;
+                }
+
+                Lexer lexer_;
+                Arena& arena_;
+                // Ссылки на ячейки сохраняются относительно этой позиции
+                Position origin_;
+                std::vector<Position> cells_;
         };
 
         class BailErrorListener : public antlr4::BaseErrorListener 
@@ -462,9 +845,19 @@ namespace ASTImpl
                 }
         };
     }  // end of namespace
+
+    // Наибольший объём узлов на символ формулы. Самая плотная запись - цепочки
+    // вида "1+2+3" и "1+-2", где на каждые два символа приходится бинарная
+    // операция и операнд, а на унарный минус - один символ
+    constexpr std::size_t NODE_BYTES_PER_CHAR = std::max({ 
+        (sizeof(BinaryOpExpr) + std::max(sizeof(NumberExpr), sizeof(CellExpr)) + 1) / 2, 
+        sizeof(UnaryOpExpr) });
+    // Наибольший размер узла дерева, восстанавливаемого по инструкции программы
+    constexpr std::size_t NODE_BYTES_PER_INSTRUCTION = std::max({ 
+        sizeof(BinaryOpExpr), sizeof(UnaryOpExpr), sizeof(NumberExpr), sizeof(CellExpr) });
 }  // end of namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) 
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in, Position origin) 
 {
     using namespace antlr4;
 
@@ -483,19 +876,21 @@ FormulaAST ParseFormulaAST(std::istream& in)
     parser.removeErrorListeners();
 
     tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
+    ASTImpl::Arena arena;
+    ASTImpl::ParseASTListener listener(arena, origin);
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+    auto root = listener.MoveRoot();
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(std::move(arena), root, listener.MoveCells());
 }
 
-FormulaAST ParseFormulaAST(const std::string& str) 
+FormulaAST ParseFormulaASTWithAntlr(const std::string& str, Position origin) 
 {
     std::istringstream iss(str);
 
     try 
     {
-        return ParseFormulaAST(iss);
+        return ParseFormulaASTWithAntlr(iss, origin);
     } 
     
     catch (const std::exception& e) 
@@ -504,43 +899,316 @@ FormulaAST ParseFormulaAST(const std::string& str)
     }
 }
 
-void FormulaAST::Print(std::ostream& out) const 
+FormulaAST ParseFormulaAST(std::istream& in, Position origin) 
 {
-    root_expr_->Print(out);
+    std::string str(std::istreambuf_iterator<char>(in), {});
+
+    return ParseFormulaAST(str, origin);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const 
+FormulaAST ParseFormulaAST(const std::string& str, Position origin) 
 {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+    ASTImpl::Arena arena(ASTImpl::NODE_BYTES_PER_CHAR * str.size());
+    ASTImpl::ExpressionParser parser(str, arena, origin);
+    const ASTImpl::Expr* root = nullptr;
+
+    try 
+    {
+        root = parser.ParseMain();
+    } 
+    
+    catch (const ParsingError&) 
+    {
+        // Некорректную формулу разбирает ANTLR: он бросает исключение с
+        // подробным сообщением об ошибке
+        return ParseFormulaASTWithAntlr(str, origin);
+    }
+
+    return FormulaAST(std::move(arena), root, parser.MoveCells());
 }
 
-void FormulaAST::PrintCells(std::ostream& out) const 
+bool WriteRelativeForm(std::string_view formula, Position origin, std::string& out) 
 {
-    for (auto cell : cells_) 
+    using Token = ASTImpl::Lexer::Token;
+
+    ASTImpl::Lexer lexer(formula);
+    out.clear();
+
+    try 
+    {
+        for (lexer.Next(); lexer.GetToken() != Token::End; lexer.Next()) 
+        {
+            switch (lexer.GetToken()) 
+            {
+                case Token::Number:
+                    out += lexer.GetText();
+                    // Разделитель, чтобы соседние лексемы не слились
+                    out += ' ';
+                    break;
+
+                case Token::Cell: 
+                {
+                    const auto cell = Position::FromString(lexer.GetText());
+
+                    if (!cell.IsValid()) 
+                    {
+                        return false;
+                    }
+
+                    out += 'R';
+                    out += std::to_string(cell.row - origin.row);
+                    out += 'C';
+                    out += std::to_string(cell.col - origin.col);
+                    out += ' ';
+                    break;
+                }
+
+                case Token::Add:
+                    out += '+';
+                    break;
+
+                case Token::Subtract:
+                    out += '-';
+                    break;
+
+                case Token::Multiply:
+                    out += '*';
+                    break;
+
+                case Token::Divide:
+                    out += '/';
+                    break;
+
+                case Token::LeftParen:
+                    out += '(';
+                    break;
+
+                case Token::RightParen:
+                    out += ')';
+                    break;
+
+                case Token::End:
+                    break;
+            }
+        }
+    } 
+    
+    catch (const ParsingError&) 
     {
-        out << cell.ToString() << ' ';
+        return false;
     }
+
+    return true;
 }
 
-std::forward_list<Position>& FormulaAST::GetCells() 
+void FormulaAST::Print(std::ostream& out, Position origin) const 
 {
-    return cells_;
+    root_expr_->Print(out, origin);
 }
 
-const std::forward_list<Position>& FormulaAST::GetCells() const 
+void FormulaAST::PrintFormula(std::ostream& out, Position origin) const 
 {
-    return cells_;
+    std::string formula;
+    PrintFormula(formula, origin);
+    out << formula;
+}
+
+void FormulaAST::PrintFormula(std::string& out, Position origin) const 
+{
+    root_expr_->PrintFormula(out, origin, ASTImpl::EP_ATOM);
+}
+
+void FormulaAST::PrintCells(std::ostream& out, Position origin) const 
+{
+    for (auto cell : program_.cells) 
+    {
+        out << Position{ cell.row + origin.row, cell.col + origin.col }.ToString() << ' ';
+    }
 }
 
-double FormulaAST::Execute(const SheetArgs& args) const 
+const std::vector<Position>& FormulaAST::GetCells() const 
 {
-    return root_expr_->Evaluate(args);
+    return program_.cells;
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells) 
-    : root_expr_(std::move(root_expr)), cells_(std::move(cells)) 
+const ASTImpl::Program& FormulaAST::GetProgram() const 
+{
+    return program_;
+}
+
+FormulaAST::FormulaAST(ASTImpl::Arena arena, const ASTImpl::Expr* root_expr, std::vector<Position> cells) 
+    : arena_(std::move(arena))
+    , root_expr_(root_expr) 
+    {
+        // Пул ячеек программы служит и списком ссылок формулы
+        std::sort(cells.begin(), cells.end());
+        cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+
+        // Компилируем дерево в программу для стековой машины. Программа собирается
+        // в буфере потока и копируется в массивы точного размера
+        thread_local ASTImpl::Program scratch;
+        scratch.code.clear();
+        scratch.constants.clear();
+        scratch.cells = std::move(cells);
+        root_expr_->Compile(scratch);
+
+        program_.code.assign(scratch.code.begin(), scratch.code.end());
+        program_.constants.assign(scratch.constants.begin(), scratch.constants.end());
+        program_.cells.assign(scratch.cells.begin(), scratch.cells.end());
+        program_.max_stack_depth = ASTImpl::GetStackDepth(program_.code);
+    }
+
+FormulaAST::FormulaAST(ASTImpl::Program program) 
+    : arena_(ASTImpl::NODE_BYTES_PER_INSTRUCTION * program.code.size())
+    , root_expr_(nullptr)
+    , program_(std::move(program)) 
+    {
+        using namespace ASTImpl;
+
+        // Программа записана в обратной польской записи: операнды узла
+        // лежат на вершине стека уже построенных поддеревьев
+        std::vector<const Expr*> stack;
+
+        auto pop = [&stack]() 
+        {
+            if (stack.empty()) 
+            {
+                throw ParsingError("Malformed program");
+            }
+
+            const Expr* expr = stack.back();
+            stack.pop_back();
+
+            return expr;
+        };
+
+        for (const auto& instruction : program_.code) 
+        {
+            switch (instruction.op) 
+            {
+                case OpCode::PushNumber:
+                    if (instruction.arg >= program_.constants.size()) 
+                    {
+                        throw ParsingError("Malformed program");
+                    }
+
+                    stack.push_back(arena_.Make<NumberExpr>(program_.constants[instruction.arg]));
+                    break;
+
+                case OpCode::PushCell:
+                    if (instruction.arg >= program_.cells.size()) 
+                    {
+                        throw ParsingError("Malformed program");
+                    }
+
+                    stack.push_back(arena_.Make<CellExpr>(program_.cells[instruction.arg]));
+                    break;
+
+                case OpCode::Negate:
+                case OpCode::Plus:
+                {
+                    auto type = instruction.op == OpCode::Negate ? UnaryOpExpr::UnaryMinus : UnaryOpExpr::UnaryPlus;
+                    stack.push_back(arena_.Make<UnaryOpExpr>(type, pop()));
+                    break;
+                }
+
+                case OpCode::Add:
+                case OpCode::Subtract:
+                case OpCode::Multiply:
+                case OpCode::Divide:
+                {
+                    static constexpr BinaryOpExpr::Type TYPES[] = { BinaryOpExpr::Add, BinaryOpExpr::Subtract, 
+                                                                    BinaryOpExpr::Multiply, BinaryOpExpr::Divide };
+                    const Expr* rhs = pop();
+                    const Expr* lhs = pop();
+                    const auto type = TYPES[static_cast<int>(instruction.op) - static_cast<int>(OpCode::Add)];
+                    stack.push_back(arena_.Make<BinaryOpExpr>(type, lhs, rhs));
+                    break;
+                }
+
+                default:
+                    throw ParsingError("Malformed program");
+            }
+        }
+
+        if (stack.size() != 1) 
+        {
+            throw ParsingError("Malformed program");
+        }
+
+        root_expr_ = stack.back();
+        program_.max_stack_depth = GetStackDepth(program_.code);
+    }
+
+FormulaAST::~FormulaAST() = default;
+
+namespace ASTImpl 
+{
+    Arena::Arena(std::size_t first_block_size)
+        : block_size_(sizeof(Block) + first_block_size) 
+        {}
+
+    Arena::Arena(Arena&& other) noexcept
+        : head_(std::exchange(other.head_, nullptr))
+        , current_(std::exchange(other.current_, nullptr))
+        , end_(std::exchange(other.end_, nullptr))
+        , block_size_(std::exchange(other.block_size_, FIRST_BLOCK_SIZE)) 
+        {}
+
+    Arena& Arena::operator=(Arena&& other) noexcept 
     {
-        cells_.sort(); // to avoid sorting in GetReferencedCells
+        if (this != &other) 
+        {
+            Release();
+            head_ = std::exchange(other.head_, nullptr);
+            current_ = std::exchange(other.current_, nullptr);
+            end_ = std::exchange(other.end_, nullptr);
+            block_size_ = std::exchange(other.block_size_, FIRST_BLOCK_SIZE);
+        }
+
+        return *this;
+    }
+
+    Arena::~Arena() 
+    {
+        Release();
+    }
+
+    // Выделяет память в текущем блоке; если места нет, заводит блок вдвое больше
+    void* Arena::Allocate(std::size_t size, std::size_t alignment) 
+    {
+        auto aligned = [alignment](std::byte* ptr) 
+        {
+            auto address = reinterpret_cast<std::uintptr_t>(ptr);
+            return reinterpret_cast<std::byte*>((address + alignment - 1) & ~(alignment - 1));
+        };
+
+        std::byte* place = current_ ? aligned(current_) : nullptr;
+
+        if (!place || place + size > end_) 
+        {
+            const std::size_t block_size = std::max(block_size_, sizeof(Block) + size + alignment);
+            auto* block = static_cast<Block*>(::operator new(block_size));
+            block->next = head_;
+            head_ = block;
+            current_ = reinterpret_cast<std::byte*>(block + 1);
+            end_ = reinterpret_cast<std::byte*>(block) + block_size;
+            block_size_ = block_size * 2;
+            place = aligned(current_);
+        }
+
+        current_ = place + size;
+
+        return place;
     }
 
-FormulaAST::~FormulaAST() = default;
\ No newline at end of file
+    void Arena::Release() 
+    {
+        while (head_) 
+        {
+            ::operator delete(std::exchange(head_, head_->next));
+        }
+
+        current_ = end_ = nullptr;
+    }
+}  // end of namespace ASTImpl
\ No newline at end of file
@@ -3,14 +3,91 @@
 #include "common.h"
 #include "FormulaLexer.h"
 
-#include <forward_list>
-#include <functional>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <new>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace ASTImpl 
 {
     class Expr;
+
+    // Код операции стековой машины
+    enum class OpCode : std::uint8_t
+    {
+        PushNumber,  // кладёт на стек константу constants[arg]
+        PushCell,    // кладёт на стек значение ячейки cells[arg]
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+        Plus,        // унарный плюс: значение не меняется, но дерево восстанавливается точно
+    };
+
+    struct Instruction
+    {
+        OpCode op;
+        std::uint32_t arg = 0;
+    };
+
+    // Скомпилированное выражение: непрерывный массив инструкций в обратной
+    // польской записи и пулы операндов
+    struct Program
+    {
+        std::vector<Instruction> code;
+        std::vector<double> constants;
+        // Позиции ячеек без повторов, в порядке возрастания
+        std::vector<Position> cells;
+        // Глубина стека, достаточная для выполнения программы
+        std::size_t max_stack_depth = 0;
+    };
+
+    // Арена узлов дерева выражения. Узлы размещаются подряд в блоках памяти
+    // и освобождаются вместе с ареной. Узлы не владеют ресурсами, поэтому
+    // их деструкторы не вызываются
+    class Arena
+    {
+        public:
+
+            Arena() = default;
+            // first_block_size - ожидаемый объём узлов, чтобы обойтись одним блоком
+            explicit Arena(std::size_t first_block_size);
+            Arena(Arena&& other) noexcept;
+            Arena& operator=(Arena&& other) noexcept;
+            ~Arena();
+
+            template <typename T, typename... Args>
+            T* Make(Args&&... args) 
+            {
+                return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            }
+
+        private:
+
+            // Заголовок блока, за которым следует память под узлы
+            struct Block 
+            {
+                Block* next;
+            };
+
+            static constexpr std::size_t FIRST_BLOCK_SIZE = 256;
+
+            void* Allocate(std::size_t size, std::size_t alignment);
+            void Release();
+
+            Block* head_ = nullptr;
+            std::byte* current_ = nullptr;
+            std::byte* end_ = nullptr;
+            std::size_t block_size_ = FIRST_BLOCK_SIZE;
+    };
 }
 
 class ParsingError : public std::runtime_error 
@@ -18,31 +95,142 @@ class ParsingError : public std::runtime_error
     using std::runtime_error::runtime_error;
 };
 
-// добавьте нужные аргументы
-using SheetArgs = std::function<double(Position)>;
-
 class FormulaAST 
 {
     public:
 
-        explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells);
+        // Узлы дерева root_expr размещены в arena. cells - ссылки на ячейки в любом порядке.
+        // Ссылки хранятся относительно позиции, переданной при разборе: методы печати
+        // принимают эту позицию и выводят абсолютные ссылки
+        explicit FormulaAST(ASTImpl::Arena arena, const ASTImpl::Expr* root_expr, std::vector<Position> cells);
+        // Восстанавливает дерево по скомпилированной программе без разбора текста.
+        // Бросает ParsingError, если программа некорректна
+        explicit FormulaAST(ASTImpl::Program program);
         FormulaAST(FormulaAST&&) = default;
         FormulaAST& operator=(FormulaAST&&) = default;
         ~FormulaAST();
 
-        double Execute(/*добавьте нужные аргументы*/ const SheetArgs& args) const;
-        void PrintCells(std::ostream& out) const;
-        void Print(std::ostream& out) const;
-        void PrintFormula(std::ostream& out) const;
+        // Вычисляет выражение. args - вызываемый объект вида double(Position),
+        // возвращающий значение ячейки. Тип не стирается, поэтому обращение
+        // к ячейке встраивается в цикл интерпретатора
+        template <typename Args>
+        double Execute(const Args& args) const;
+        // Вычисляет выражение, получая значение ячейки по её номеру в GetCells():
+        // cell_value - вызываемый объект вида double(std::size_t). Позволяет
+        // читать ячейки, найденные заранее, без поиска по позиции
+        template <typename CellValue>
+        double ExecuteByIndex(const CellValue& cell_value) const;
+        void PrintCells(std::ostream& out, Position origin = {}) const;
+        void Print(std::ostream& out, Position origin = {}) const;
+        void PrintFormula(std::ostream& out, Position origin = {}) const;
+        // Дописывает выражение формулы в конец out
+        void PrintFormula(std::string& out, Position origin = {}) const;
 
-        std::forward_list<Position>& GetCells();
-        const std::forward_list<Position>& GetCells() const;
+        // Ячейки, на которые ссылается формула (относительно позиции разбора),
+        // без повторов и в порядке возрастания
+        const std::vector<Position>& GetCells() const;
+        const ASTImpl::Program& GetProgram() const;
 
     private:
 
-        std::unique_ptr<ASTImpl::Expr> root_expr_;
-        std::forward_list<Position> cells_;
+        ASTImpl::Arena arena_;
+        const ASTImpl::Expr* root_expr_;
+        // Дерево используется для печати, вычисление идёт по программе
+        ASTImpl::Program program_;
 };
 
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+// Разбирает формулу рукописным парсером. Если формула некорректна,
+// разбор повторяется парсером ANTLR, который и бросает исключение.
+// Ссылки на ячейки сохраняются относительно origin
+FormulaAST ParseFormulaAST(std::istream& in, Position origin = {});
+FormulaAST ParseFormulaAST(const std::string& in_str, Position origin = {});
+// Разбирает формулу парсером, сгенерированным ANTLR по Formula.g4
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in, Position origin = {});
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str, Position origin = {});
+
+// Записывает в out каноническую запись формулы: лексемы без пробелов, ссылки
+// на ячейки в виде смещений R<строки>C<столбцы> от origin (как в стиле R1C1).
+// Формулы с одинаковой записью разбираются в одинаковые деревья с одинаковыми
+// относительными ссылками. Возвращает false, если формула не разбивается на
+// лексемы или ссылается на некорректную позицию
+bool WriteRelativeForm(std::string_view formula, Position origin, std::string& out);
+
+template <typename Args>
+double FormulaAST::Execute(const Args& args) const 
+{
+    return ExecuteByIndex([this, &args](std::size_t index) 
+    { 
+        return args(program_.cells[index]); 
+    });
+}
+
+// Выполняет программу на стековой машине
+template <typename CellValue>
+double FormulaAST::ExecuteByIndex(const CellValue& cell_value) const 
+{
+    using ASTImpl::OpCode;
+
+    // Для типичных формул стек помещается в локальный буфер
+    constexpr std::size_t INLINE_STACK_SIZE = 32;
+    double inline_stack[INLINE_STACK_SIZE];
+    std::unique_ptr<double[]> heap_stack;
+    double* stack = inline_stack;
+
+    if (program_.max_stack_depth > INLINE_STACK_SIZE) 
+    {
+        heap_stack = std::make_unique<double[]>(program_.max_stack_depth);
+        stack = heap_stack.get();
+    }
+
+    // Указывает на первый свободный элемент стека
+    double* top = stack;
+
+    for (const auto& instruction : program_.code) 
+    {
+        switch (instruction.op) 
+        {
+            case OpCode::PushNumber:
+                *top++ = program_.constants[instruction.arg];
+                continue;
+
+            case OpCode::PushCell:
+                *top++ = cell_value(instruction.arg);
+                continue;
+
+            case OpCode::Negate:
+                top[-1] = -top[-1];
+                continue;
+
+            case OpCode::Plus:
+                continue;
+
+            case OpCode::Add:
+                top[-2] += top[-1];
+                break;
+
+            case OpCode::Subtract:
+                top[-2] -= top[-1];
+                break;
+
+            case OpCode::Multiply:
+                top[-2] *= top[-1];
+                break;
+
+            case OpCode::Divide:
+                top[-2] /= top[-1];
+                break;
+        }
+
+        // Сюда попадают только бинарные операции
+        --top;
+
+        if (!std::isfinite(top[-1])) 
+        {
+            throw FormulaError(FormulaError::Category::Arithmetic);
+        }
+    }
+
+    assert(top == stack + 1);
+
+    return stack[0];
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+namespace BenchRunnerPrivate 
+{
+    // Счётчики выделений памяти, которые ведёт замещённый operator new в bench/main.cpp
+    struct AllocationCounters 
+    {
+        std::atomic<std::size_t> allocations = 0;
+        std::atomic<std::size_t> live_bytes = 0;
+        std::atomic<std::size_t> peak_bytes = 0;
+    };
+
+    AllocationCounters& GetAllocationCounters();
+
+    inline const void* volatile sink = nullptr;
+} // end of namespace BenchRunnerPrivate
+
+// Снимок счётчиков памяти на момент создания объекта
+class AllocationScope 
+{
+    public:
+
+        AllocationScope()
+            : start_allocations_(BenchRunnerPrivate::GetAllocationCounters().allocations)
+            , start_live_bytes_(BenchRunnerPrivate::GetAllocationCounters().live_bytes)
+            {
+                BenchRunnerPrivate::GetAllocationCounters().peak_bytes = start_live_bytes_;
+            }
+
+        // Количество выделений памяти с момента создания
+        std::size_t Allocations() const 
+        {
+            return BenchRunnerPrivate::GetAllocationCounters().allocations - start_allocations_;
+        }
+
+        // Прирост занятой памяти с момента создания
+        std::ptrdiff_t LiveBytes() const 
+        {
+            return static_cast<std::ptrdiff_t>(BenchRunnerPrivate::GetAllocationCounters().live_bytes) 
+                 - static_cast<std::ptrdiff_t>(start_live_bytes_);
+        }
+
+        // Пиковый прирост занятой памяти с момента создания
+        std::size_t PeakBytes() const 
+        {
+            return BenchRunnerPrivate::GetAllocationCounters().peak_bytes - start_live_bytes_;
+        }
+
+    private:
+
+        std::size_t start_allocations_;
+        std::size_t start_live_bytes_;
+};
+
+// Не даёт компилятору выбросить вычисление значения
+template <typename T>
+void DoNotOptimize(const T& value) 
+{
+    BenchRunnerPrivate::sink = &value;
+}
+
+// Возвращает время выполнения func в наносекундах
+template <typename Func>
+double MeasureNs(Func func) 
+{
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto finish = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::nano>(finish - start).count();
+}
+
+// Печатает строку результата: имя замера, значение и единицы измерения
+inline void Report(const std::string& name, double value, const std::string& unit) 
+{
+    std::cout << "  " << std::left << std::setw(48) << name 
+              << std::right << std::setw(14) << std::fixed << std::setprecision(2) << value 
+              << ' ' << unit << std::endl;
+}
+
+class BenchRunner 
+{
+    public:
+
+        explicit BenchRunner(std::string filter)
+            : filter_(std::move(filter)) 
+            {}
+
+        template <class BenchFunc>
+        void RunBench(BenchFunc func, const std::string& bench_name) 
+        {
+            if (!filter_.empty() && bench_name.find(filter_) == std::string::npos) 
+            {
+                return;
+            }
+
+            std::cout << bench_name << std::endl;
+            func();
+        }
+
+    private:
+
+        std::string filter_;
+};
+
+#define RUN_BENCH(br, func) br.RunBench(func, #func)
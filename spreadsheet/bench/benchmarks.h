@@ -0,0 +1,20 @@
+#pragma once
+
+// Замеры производительности. Каждая функция печатает свои результаты в std::cout
+void BenchFormulaCellAccess();
+void BenchChainRecalculation();
+void BenchFormulaParsing();
+void BenchCellStorage();
+void BenchRecalculateAll();
+void BenchParallelRecalculation();
+void BenchBulkLoad();
+void BenchFillDown();
+void BenchParallelParsing();
+void BenchTableLoadAndSave();
+void BenchPrint();
+void BenchSnapshot();
+void BenchNumericColumns();
+void BenchHotInput();
+void BenchDeepChain();
+void BenchDependencyGraph();
+void BenchPositionConversion();
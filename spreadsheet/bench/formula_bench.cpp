@@ -0,0 +1,255 @@
+#include "bench_runner_p.h"
+#include "benchmarks.h"
+
+#include "FormulaAST.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// Стоимость одного обращения к ячейке из формулы при разных способах передачи
+// функции получения значения в FormulaAST::Execute
+void BenchFormulaCellAccess() 
+{
+    const int refs = 64;
+    const int iterations = 100000;
+
+    std::string expression = "A1";
+
+    for (int row = 2; row <= refs; ++row) 
+    {
+        expression += "+A" + std::to_string(row);
+    }
+
+    const auto ast = ParseFormulaAST(expression);
+    std::vector<double> values(refs, 1.5);
+
+    auto lookup = [&values](Position pos) 
+    { 
+        return values[pos.row]; 
+    };
+
+    auto per_reference = [&](double ns) 
+    { 
+        return ns / (static_cast<double>(iterations) * refs); 
+    };
+
+    // Так было до: std::function создаётся на каждое вычисление
+    double ns = MeasureNs([&] 
+    {
+        for (int i = 0; i < iterations; ++i) 
+        {
+            const std::function<double(Position)> args = lookup;
+            DoNotOptimize(ast.Execute(args));
+        }
+    });
+    Report("std::function per evaluation", per_reference(ns), "ns/ref");
+
+    ns = MeasureNs([&] 
+    {
+        for (int i = 0; i < iterations; ++i) 
+        {
+            DoNotOptimize(ast.Execute(lookup));
+        }
+    });
+    Report("inlined accessor", per_reference(ns), "ns/ref");
+
+    // Полный путь через таблицу: поиск ячейки и чтение её значения
+    Sheet sheet;
+
+    for (int row = 0; row < refs; ++row) 
+    {
+        sheet.SetCell(Position{ row, 0 }, "1.5");
+    }
+
+    const auto formula = ParseFormula(expression);
+
+    ns = MeasureNs([&] 
+    {
+        for (int i = 0; i < iterations; ++i) 
+        {
+            DoNotOptimize(formula->Evaluate(sheet));
+        }
+    });
+    Report("Formula::Evaluate on Sheet", per_reference(ns), "ns/ref");
+
+    // Ячейка-формула читает входы по адресам, найденным при установке. Чтобы
+    // формула вычислялась заново, меняется A1; время правок без чтения вычитается
+    sheet.SetCell(Position{ 0, 1 }, "=" + expression);
+    const Cell* cell = sheet.GetCell(Position{ 0, 1 });
+
+    const double edits_ns = MeasureNs([&] 
+    {
+        for (int i = 0; i < iterations; ++i) 
+        {
+            sheet.SetCell(Position{ 0, 0 }, i % 2 ? "1.5" : "2.5");
+        }
+    });
+
+    ns = MeasureNs([&] 
+    {
+        for (int i = 0; i < iterations; ++i) 
+        {
+            sheet.SetCell(Position{ 0, 0 }, i % 2 ? "1.5" : "2.5");
+            DoNotOptimize(cell->GetValue());
+        }
+    });
+    Report("formula cell with bound inputs", per_reference(ns - edits_ns), "ns/ref");
+}
+
+// Пересчёт цепочки из 20 формул, каждая из которых ссылается на предыдущую
+// ячейку: исходная ячейка меняется, затем читается конец цепочки
+void BenchChainRecalculation() 
+{
+    const int depth = 20;
+    const int iterations = 20000;
+
+    Sheet sheet;
+    sheet.SetCell(Position{ 0, 0 }, "1");
+
+    for (int row = 1; row < depth; ++row) 
+    {
+        sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "*2-A" + std::to_string(row));
+    }
+
+    const Position last{ depth - 1, 0 };
+    sheet.ResetCacheStatistics();
+
+    double ns = MeasureNs([&] 
+    {
+        for (int i = 0; i < iterations; ++i) 
+        {
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(i % 2));
+            DoNotOptimize(sheet.GetCell(last)->GetValue());
+        }
+    });
+
+    const auto& statistics = sheet.GetCacheStatistics();
+    Report("recalculation of 20-deep chain", ns / iterations, "ns");
+    Report("formula value reads per recalculation", 
+           static_cast<double>(statistics.hits + statistics.misses) / iterations, "reads");
+}
+
+// Скорость разбора типичных формул рукописным парсером и парсером ANTLR
+void BenchFormulaParsing() 
+{
+    const int count = 100000;
+    std::vector<std::string> formulas;
+    formulas.reserve(count);
+    std::size_t bytes = 0;
+
+    for (int i = 0; i < count; ++i) 
+    {
+        Position lhs{ i % 1000, i % 26 };
+        Position rhs{ i % 777, (i + 3) % 26 };
+        formulas.push_back("(" + lhs.ToString() + "+" + rhs.ToString() + ")*1.5-" + std::to_string(i % 97) + "/" + lhs.ToString());
+        bytes += formulas.back().size();
+    }
+
+    for (bool antlr : { false, true }) 
+    {
+        double ns = MeasureNs([&] 
+        {
+            for (const auto& formula : formulas) 
+            {
+                DoNotOptimize(antlr ? ParseFormulaASTWithAntlr(formula) : ParseFormulaAST(formula));
+            }
+        });
+
+        const std::string name = antlr ? "ANTLR" : "hand-written";
+        Report(name + ", per formula", ns / count, "ns");
+        Report(name + ", throughput", bytes / ns * 1e3, "MB/s");
+    }
+
+    // Память, которую занимают разобранные формулы вместе с объектом Formula
+    std::vector<std::unique_ptr<FormulaInterface>> parsed;
+    parsed.reserve(count);
+    AllocationScope scope;
+
+    for (const auto& formula : formulas) 
+    {
+        parsed.push_back(ParseFormula(formula));
+    }
+
+    Report("allocations per parse", static_cast<double>(scope.Allocations()) / count, "allocs");
+    Report("memory per formula", static_cast<double>(scope.LiveBytes()) / count, "bytes");
+}
+
+// Перевод позиций в строки и обратно и разбор чисел в формулах: эти
+// преобразования выполняются при каждом разборе, печати и выгрузке формулы
+void BenchPositionConversion() 
+{
+    const int count = 100000;
+    std::vector<Position> positions;
+    std::vector<std::string> names;
+    positions.reserve(count);
+    names.reserve(count);
+    std::mt19937 generator(7);
+    std::uniform_int_distribution<int> row(0, Position::MAX_ROWS - 1);
+    std::uniform_int_distribution<int> col(0, Position::MAX_COLS - 1);
+
+    for (int i = 0; i < count; ++i) 
+    {
+        positions.push_back({ row(generator), col(generator) });
+        names.push_back(positions.back().ToString());
+    }
+
+    // Встроенные преобразования не выбрасываются, пока их результат входит в сумму
+    std::size_t checksum = 0;
+    AllocationScope scope;
+    double ns = MeasureNs([&] 
+    {
+        for (const auto& name : names) 
+        {
+            const Position pos = Position::FromString(name);
+            checksum += pos.row + pos.col;
+        }
+    });
+    Report("Position::FromString", ns / count, "ns");
+    Report("allocations per FromString", static_cast<double>(scope.Allocations()) / count, "allocs");
+
+    ns = MeasureNs([&] 
+    {
+        for (const auto pos : positions) 
+        {
+            DoNotOptimize(pos.ToString());
+        }
+    });
+    Report("Position::ToString", ns / count, "ns");
+
+    char buffer[Position::MAX_STRING_LENGTH];
+    ns = MeasureNs([&] 
+    {
+        for (const auto pos : positions) 
+        {
+            checksum += pos.ToChars(buffer) - buffer + buffer[0];
+        }
+    });
+    Report("Position::ToChars", ns / count, "ns");
+    DoNotOptimize(checksum);
+
+    // Формулы из одних чисел: разбор упирается в перевод лексем в числа
+    std::vector<std::string> formulas;
+    formulas.reserve(count / 10);
+
+    for (int i = 0; i < count / 10; ++i) 
+    {
+        formulas.push_back(std::to_string(i) + ".25*1.5e3-" + std::to_string(i % 97) + "/0.125+7");
+    }
+
+    for (bool antlr : { false, true }) 
+    {
+        ns = MeasureNs([&] 
+        {
+            for (const auto& formula : formulas) 
+            {
+                DoNotOptimize(antlr ? ParseFormulaASTWithAntlr(formula) : ParseFormulaAST(formula));
+            }
+        });
+        Report(std::string(antlr ? "ANTLR" : "hand-written") + ", numeric formula", ns / formulas.size(), "ns");
+    }
+}
@@ -0,0 +1,81 @@
+#include "bench_runner_p.h"
+#include "benchmarks.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace 
+{
+    // Размер заголовка перед каждым блоком; сохраняет выравнивание max_align_t
+    constexpr std::size_t HEADER_SIZE = alignof(std::max_align_t);
+} // end of namespace
+
+BenchRunnerPrivate::AllocationCounters& BenchRunnerPrivate::GetAllocationCounters() 
+{
+    static AllocationCounters counters;
+    return counters;
+}
+
+// Замещённые операторы ведут учёт выделенной памяти для замеров AllocationScope
+void* operator new(std::size_t size) 
+{
+    auto* block = static_cast<char*>(std::malloc(size + HEADER_SIZE));
+
+    if (!block) 
+    {
+        throw std::bad_alloc();
+    }
+
+    *reinterpret_cast<std::size_t*>(block) = size;
+
+    auto& counters = BenchRunnerPrivate::GetAllocationCounters();
+    ++counters.allocations;
+    std::size_t live_bytes = counters.live_bytes += size;
+    std::size_t peak_bytes = counters.peak_bytes;
+
+    while (live_bytes > peak_bytes && !counters.peak_bytes.compare_exchange_weak(peak_bytes, live_bytes)) {}
+
+    return block + HEADER_SIZE;
+}
+
+void operator delete(void* ptr) noexcept 
+{
+    if (!ptr) 
+    {
+        return;
+    }
+
+    auto* block = static_cast<char*>(ptr) - HEADER_SIZE;
+    BenchRunnerPrivate::GetAllocationCounters().live_bytes -= *reinterpret_cast<std::size_t*>(block);
+    std::free(block);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept 
+{
+    operator delete(ptr);
+}
+
+// Запуск: spreadsheet_bench [подстрока имени замера]
+int main(int argc, char* argv[]) 
+{
+    BenchRunner br(argc > 1 ? argv[1] : "");
+    RUN_BENCH(br, BenchFormulaCellAccess);
+    RUN_BENCH(br, BenchChainRecalculation);
+    RUN_BENCH(br, BenchFormulaParsing);
+    RUN_BENCH(br, BenchCellStorage);
+    RUN_BENCH(br, BenchRecalculateAll);
+    RUN_BENCH(br, BenchParallelRecalculation);
+    RUN_BENCH(br, BenchBulkLoad);
+    RUN_BENCH(br, BenchFillDown);
+    RUN_BENCH(br, BenchParallelParsing);
+    RUN_BENCH(br, BenchTableLoadAndSave);
+    RUN_BENCH(br, BenchPrint);
+    RUN_BENCH(br, BenchSnapshot);
+    RUN_BENCH(br, BenchNumericColumns);
+    RUN_BENCH(br, BenchHotInput);
+    RUN_BENCH(br, BenchDeepChain);
+    RUN_BENCH(br, BenchDependencyGraph);
+    RUN_BENCH(br, BenchPositionConversion);
+
+    return 0;
+}
@@ -0,0 +1,985 @@
+#include "bench_runner_p.h"
+#include "benchmarks.h"
+
+#include "cell_storage.h"
+#include "sheet.h"
+#include "sheet_io.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace 
+{
+    // Прежняя раскладка Sheet: строки переменной длины с отдельной ячейкой на каждую позицию
+    class JaggedStorage 
+    {
+        public:
+
+            void Emplace(Position pos, Sheet& sheet) 
+            {
+                if (pos.row >= static_cast<int>(cells_.size())) 
+                {
+                    cells_.resize(pos.row + 1);
+                }
+
+                auto& row = cells_[pos.row];
+
+                if (pos.col >= static_cast<int>(row.size())) 
+                {
+                    row.resize(pos.col + 1);
+                }
+
+                row[pos.col] = std::make_unique<Cell>(sheet, pos);
+            }
+
+            const Cell* Get(Position pos) const 
+            {
+                if (pos.row < static_cast<int>(cells_.size()) && pos.col < static_cast<int>(cells_[pos.row].size())) 
+                {
+                    return cells_[pos.row][pos.col].get();
+                }
+
+                return nullptr;
+            }
+
+            // Размер индекса строк без учёта самих ячеек
+            static std::size_t EstimateIndexBytes(const std::vector<Position>& positions) 
+            {
+                std::vector<int> widths;
+
+                for (auto pos : positions) 
+                {
+                    if (pos.row >= static_cast<int>(widths.size())) 
+                    {
+                        widths.resize(pos.row + 1);
+                    }
+
+                    widths[pos.row] = std::max(widths[pos.row], pos.col + 1);
+                }
+
+                std::size_t bytes = widths.size() * sizeof(std::vector<std::unique_ptr<Cell>>);
+
+                for (int width : widths) 
+                {
+                    bytes += width * sizeof(std::unique_ptr<Cell>);
+                }
+
+                return bytes;
+            }
+
+        private:
+
+            std::vector<std::vector<std::unique_ptr<Cell>>> cells_;
+    };
+
+    struct FillPattern 
+    {
+        std::string name;
+        std::vector<Position> positions;
+    };
+
+    std::vector<FillPattern> MakeFillPatterns() 
+    {
+        std::vector<FillPattern> patterns;
+
+        // Плотный прямоугольник 512x512 в начале таблицы
+        FillPattern dense { "dense 512x512", {} };
+
+        for (int row = 0; row < 512; ++row) 
+        {
+            for (int col = 0; col < 512; ++col) 
+            {
+                dense.positions.push_back({ row, col });
+            }
+        }
+
+        patterns.push_back(std::move(dense));
+
+        // Случайные ячейки по всей таблице MAX_ROWS x MAX_COLS
+        FillPattern sparse { "sparse 65536 random", {} };
+        std::mt19937 generator(42);
+        std::uniform_int_distribution<int> rows(0, Position::MAX_ROWS - 1);
+        std::uniform_int_distribution<int> cols(0, Position::MAX_COLS - 1);
+
+        for (int i = 0; i < 65536; ++i) 
+        {
+            sparse.positions.push_back({ rows(generator), cols(generator) });
+        }
+
+        std::sort(sparse.positions.begin(), sparse.positions.end());
+        sparse.positions.erase(std::unique(sparse.positions.begin(), sparse.positions.end()), sparse.positions.end());
+        std::shuffle(sparse.positions.begin(), sparse.positions.end(), generator);
+        patterns.push_back(std::move(sparse));
+
+        // Главная диагональ до XFD16384
+        FillPattern diagonal { "diagonal 16384", {} };
+
+        for (int i = 0; i < Position::MAX_ROWS; ++i) 
+        {
+            diagonal.positions.push_back({ i, i });
+        }
+
+        patterns.push_back(std::move(diagonal));
+
+        return patterns;
+    }
+
+    // Среднее время поиска по всем позициям шаблона и по тем же позициям со сдвигом (промахи)
+    template <typename Storage>
+    void ReportLookups(const std::string& prefix, const Storage& storage, const std::vector<Position>& positions) 
+    {
+        const int rounds = 20;
+        std::size_t found = 0;
+
+        double ns = MeasureNs([&] 
+        {
+            for (int round = 0; round < rounds; ++round) 
+            {
+                for (auto pos : positions) 
+                {
+                    found += storage.Get(pos) != nullptr;
+                }
+            }
+        });
+        DoNotOptimize(found);
+        Report(prefix + " hit lookup", ns / (rounds * positions.size()), "ns");
+
+        ns = MeasureNs([&] 
+        {
+            for (int round = 0; round < rounds; ++round) 
+            {
+                for (auto pos : positions) 
+                {
+                    Position miss { (pos.row + 7) % Position::MAX_ROWS, (pos.col + 13) % Position::MAX_COLS };
+                    found += storage.Get(miss) != nullptr;
+                }
+            }
+        });
+        DoNotOptimize(found);
+        Report(prefix + " miss lookup", ns / (rounds * positions.size()), "ns");
+    }
+} // end of namespace
+
+// Память и время поиска в хранилище ячеек при плотном, разреженном и диагональном заполнении
+void BenchCellStorage() 
+{
+    // Прежняя раскладка строится, только если её индекс помещается в разумный объём
+    const std::size_t max_jagged_bytes = 256u << 20;
+    Sheet sheet;
+
+    for (const auto& pattern : MakeFillPatterns()) 
+    {
+        const double cells = static_cast<double>(pattern.positions.size());
+
+        {
+            AllocationScope scope;
+            CellStorage storage;
+
+            for (auto pos : pattern.positions) 
+            {
+                storage.Emplace(pos, sheet);
+            }
+
+            Report(pattern.name + ": blocks, bytes/cell", scope.LiveBytes() / cells, "B");
+            Report(pattern.name + ": blocks, allocations/cell", scope.Allocations() / cells, "");
+            ReportLookups(pattern.name + ": blocks,", storage, pattern.positions);
+        }
+
+        std::size_t index_bytes = JaggedStorage::EstimateIndexBytes(pattern.positions);
+
+        if (index_bytes > max_jagged_bytes) 
+        {
+            Report(pattern.name + ": jagged, bytes/cell (estimated)", index_bytes / cells + sizeof(Cell), "B");
+            continue;
+        }
+
+        AllocationScope scope;
+        JaggedStorage storage;
+
+        for (auto pos : pattern.positions) 
+        {
+            storage.Emplace(pos, sheet);
+        }
+
+        Report(pattern.name + ": jagged, bytes/cell", scope.LiveBytes() / cells, "B");
+        Report(pattern.name + ": jagged, allocations/cell", scope.Allocations() / cells, "");
+        ReportLookups(pattern.name + ": jagged,", storage, pattern.positions);
+    }
+}
+
+namespace 
+{
+    // Сетка формул rows x cols: каждая ячейка ссылается на соседей слева и сверху
+    void FillFormulaGrid(Sheet& sheet, int rows, int cols) 
+    {
+        for (int row = 0; row < rows; ++row) 
+        {
+            for (int col = 0; col < cols; ++col) 
+            {
+                std::string text = "=1";
+
+                if (col > 0) 
+                {
+                    text += "+" + Position{ row, col - 1 }.ToString();
+                }
+
+                if (row > 0) 
+                {
+                    text += "+" + Position{ row - 1, col }.ToString();
+                }
+
+                sheet.SetCell({ row, col }, std::move(text));
+            }
+        }
+    }
+} // end of namespace
+
+// Полный пересчёт 100 тысяч формул: RecalculateAll против ленивого чтения
+void BenchRecalculateAll() 
+{
+    const int rows = 1000;
+    const int cols = 100;
+
+    Sheet sheet;
+    FillFormulaGrid(sheet, rows, cols);
+
+    double ns = MeasureNs([&] 
+    {
+        DoNotOptimize(sheet.RecalculateAll());
+    });
+    Report("RecalculateAll, 100k formulas", ns / 1e6, "ms");
+
+    // Ленивое чтение от конца сетки: значения вычисляются рекурсивно
+    sheet.SetCell({ 0, 0 }, "=2");
+    ns = MeasureNs([&] 
+    {
+        for (int row = rows - 1; row >= 0; --row) 
+        {
+            for (int col = cols - 1; col >= 0; --col) 
+            {
+                DoNotOptimize(sheet.GetCell({ row, col })->GetValue());
+            }
+        }
+    });
+    Report("lazy GetValue from the end, 100k formulas", ns / 1e6, "ms");
+
+    sheet.SetCell({ 0, 0 }, "=3");
+    ns = MeasureNs([&] 
+    {
+        DoNotOptimize(sheet.RecalculateAll());
+    });
+    Report("RecalculateAll after editing the source", ns / 1e6, "ms");
+}
+
+// Параллельный пересчёт независимых строк формул при разном числе потоков
+void BenchParallelRecalculation() 
+{
+    const int rows = 10000;
+    const int cols = 10;
+    const unsigned max_threads = std::max(4u, std::thread::hardware_concurrency());
+
+    Sheet sheet;
+
+    for (int row = 0; row < rows; ++row) 
+    {
+        sheet.SetCell({ row, 0 }, std::to_string(row));
+
+        for (int col = 1; col < cols; ++col) 
+        {
+            sheet.SetCell({ row, col }, "=" + Position{ row, col - 1 }.ToString() + "*1.01+" + Position{ row, 0 }.ToString() + "/7");
+        }
+    }
+
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) 
+    {
+        sheet.SetThreadCount(threads);
+        // Изменение первого столбца делает устаревшими все формулы
+        for (int row = 0; row < rows; ++row) 
+        {
+            sheet.SetCell({ row, 0 }, std::to_string(row + threads));
+        }
+
+        double ns = MeasureNs([&] 
+        {
+            DoNotOptimize(sheet.RecalculateAll());
+        });
+        Report("RecalculateAll, 90k formulas, " + std::to_string(threads) + " threads", ns / 1e6, "ms");
+    }
+}
+
+// Загрузка формул, при которой каждая установка проверяет граф на циклы
+void BenchBulkLoad() 
+{
+    const int chain_length = 10000;
+    const int dependents = 10000;
+    const int hub_rewrites = 1000;
+
+    double ns = MeasureNs([&] 
+    {
+        Sheet sheet;
+        sheet.SetCell({ 0, 0 }, "1");
+
+        for (int row = 1; row < chain_length; ++row) 
+        {
+            sheet.SetCell({ row, 0 }, "=" + Position{ row - 1, 0 }.ToString() + "+1");
+        }
+    });
+    Report("chain of " + std::to_string(chain_length) + ", top-down", ns / 1e6, "ms");
+
+    ns = MeasureNs([&] 
+    {
+        Sheet sheet;
+
+        for (int row = chain_length - 1; row > 0; --row) 
+        {
+            sheet.SetCell({ row, 0 }, "=" + Position{ row - 1, 0 }.ToString() + "+1");
+        }
+
+        sheet.SetCell({ 0, 0 }, "1");
+    });
+    Report("chain of " + std::to_string(chain_length) + ", bottom-up", ns / 1e6, "ms");
+
+    // Одна ячейка, на которую ссылаются все формулы, многократно меняет свои входы
+    Sheet sheet;
+    sheet.SetCell({ 0, 0 }, "1");
+
+    for (int row = 0; row < dependents; ++row) 
+    {
+        sheet.SetCell({ row, 1 }, "=A1+" + std::to_string(row));
+    }
+
+    ns = MeasureNs([&] 
+    {
+        for (int i = 0; i < hub_rewrites; ++i) 
+        {
+            sheet.SetCell({ 0, 0 }, "=" + Position{ i, 2 }.ToString() + "*2");
+        }
+    });
+    Report("hub with " + std::to_string(dependents) + " dependents, per rewrite", ns / 1e3 / hub_rewrites, "us");
+
+    // Книга из чисел и формул: поячеечная установка против пакетной
+    const int rows = Position::MAX_ROWS;
+    const int cols = 16;
+    std::vector<std::pair<Position, std::string>> workbook;
+    workbook.reserve(rows * cols);
+
+    for (int row = rows - 1; row >= 0; --row) 
+    {
+        for (int col = 0; col < cols; ++col) 
+        {
+            if (col % 2 == 0 || row == 0) 
+            {
+                workbook.emplace_back(Position{ row, col }, std::to_string(row * col));
+            } 
+            
+            else 
+            {
+                const std::string above = Position{ row - 1, col }.ToString();
+                workbook.emplace_back(Position{ row, col }, "=" + above + "+" + Position{ row, col - 1 }.ToString() + "/2");
+            }
+        }
+    }
+
+    // Снизу вверх входы формул ещё не существуют, в случайном порядке
+    // поячеечной установке приходится переупорядочивать метки
+    for (const std::string order : { "bottom-up", "shuffled" }) 
+    {
+        if (order == "shuffled") 
+        {
+            std::shuffle(workbook.begin(), workbook.end(), std::mt19937(42));
+        }
+
+        ns = MeasureNs([&] 
+        {
+            Sheet sheet;
+
+            for (const auto& [pos, text] : workbook) 
+            {
+                sheet.SetCell(pos, text);
+            }
+        });
+        Report(std::to_string(workbook.size()) + " cells " + order + ", SetCell", ns / 1e6, "ms");
+
+        ns = MeasureNs([&] 
+        {
+            Sheet sheet;
+            DoNotOptimize(sheet.SetCells(workbook));
+        });
+        Report(std::to_string(workbook.size()) + " cells " + order + ", SetCells", ns / 1e6, "ms");
+    }
+}
+
+// Заполнение столбца однотипными формулами вида =A1*B1, =A2*B2, ...
+void BenchFillDown() 
+{
+    const int rows = Position::MAX_ROWS;
+
+    Sheet sheet;
+
+    for (int row = 0; row < rows; ++row) 
+    {
+        sheet.SetCell({ row, 0 }, std::to_string(row));
+        sheet.SetCell({ row, 1 }, "2");
+    }
+
+    AllocationScope scope;
+    double ns = MeasureNs([&] 
+    {
+        for (int row = 0; row < rows; ++row) 
+        {
+            const std::string number = std::to_string(row + 1);
+            sheet.SetCell({ row, 2 }, "=(A" + number + "*B" + number + "+1)/2");
+        }
+    });
+
+    Report("fill-down of " + std::to_string(rows) + " formulas, per cell", ns / rows, "ns");
+    Report("memory per formula cell", static_cast<double>(scope.LiveBytes()) / rows, "bytes");
+    Report("allocations per formula cell", static_cast<double>(scope.Allocations()) / rows, "allocs");
+    DoNotOptimize(sheet.RecalculateAll());
+}
+
+// Пакетная загрузка около 500 тысяч формул с различной относительной записью:
+// разбор выполняется в пуле, связи создаются в одном потоке
+void BenchParallelParsing() 
+{
+    const int rows = Position::MAX_ROWS;
+    const int cols = 31;
+    const unsigned max_threads = std::max(4u, std::thread::hardware_concurrency());
+
+    std::vector<std::pair<Position, std::string>> formulas;
+    formulas.reserve(rows * cols);
+
+    for (int row = 0; row < rows; ++row) 
+    {
+        for (int col = 0; col < cols; ++col) 
+        {
+            const std::string left = col > 0 ? Position{ row, col - 1 }.ToString() : "1";
+            formulas.emplace_back(Position{ row, col }, "=(" + left + "*" + std::to_string(row * cols + col) + "+2.5)/3");
+        }
+    }
+
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) 
+    {
+        double ns = MeasureNs([&] 
+        {
+            Sheet sheet;
+            sheet.SetThreadCount(threads);
+            DoNotOptimize(sheet.SetCells(formulas));
+        });
+        Report("SetCells, " + std::to_string(formulas.size()) + " formulas, " + std::to_string(threads) + " threads", ns / 1e6, "ms");
+    }
+}
+
+// Загрузка листа из TSV и выгрузка обратно: пропускная способность и память,
+// которую загрузчик занимает сверх самого листа
+void BenchTableLoadAndSave() 
+{
+    const int rows = Position::MAX_ROWS;
+    const int cols = 16;
+    std::string tsv;
+
+    for (int row = 0; row < rows; ++row) 
+    {
+        for (int col = 0; col < cols; ++col) 
+        {
+            if (col > 0) 
+            {
+                tsv += '\t';
+            }
+
+            tsv += col % 2 == 0 ? std::to_string(row * 0.25 + col) : "=" + Position{ row, col - 1 }.ToString() + "*3-" + std::to_string(col);
+        }
+
+        tsv += '\n';
+    }
+
+    const double megabytes = tsv.size() / 1e6;
+    Sheet sheet;
+    std::istringstream input(tsv);
+    AllocationScope scope;
+
+    double ns = MeasureNs([&] 
+    {
+        DoNotOptimize(LoadTable(sheet, input, TableFormat::Tsv));
+    });
+    Report("LoadTable, " + std::to_string(rows * cols) + " cells", megabytes / ns * 1e9, "MB/s");
+    Report("loader memory beyond the sheet", static_cast<double>(scope.PeakBytes() - scope.LiveBytes()) / 1e6, "MB");
+    DoNotOptimize(sheet.RecalculateAll());
+
+    for (bool value : { false, true }) 
+    {
+        std::ostringstream printed;
+        ns = MeasureNs([&] 
+        {
+            value ? sheet.PrintValues(printed) : sheet.PrintTexts(printed);
+        });
+        Report("Print" + std::string(value ? "Values" : "Texts"), printed.str().size() / ns * 1e3, "MB/s");
+
+        std::ostringstream saved;
+        ns = MeasureNs([&] 
+        {
+            value ? SaveValues(sheet, saved, TableFormat::Tsv) : SaveTexts(sheet, saved, TableFormat::Tsv);
+        });
+        Report("Save" + std::string(value ? "Values" : "Texts") + ", TSV", saved.str().size() / ns * 1e3, "MB/s");
+    }
+}
+
+namespace 
+{
+    // Поток, который только считает записанные байты
+    class CountingBuffer : public std::streambuf 
+    {
+        public:
+
+            std::size_t Size() const 
+            {
+                return size_;
+            }
+
+        protected:
+
+            std::streamsize xsputn(const char*, std::streamsize count) override 
+            {
+                size_ += static_cast<std::size_t>(count);
+                return count;
+            }
+
+            int_type overflow(int_type c) override 
+            {
+                ++size_;
+                return traits_type::not_eof(c);
+            }
+
+        private:
+
+            std::size_t size_ = 0;
+    };
+} // end of namespace
+
+// Печать листа из 1M ячеек: числа, тексты и формулы, в том числе с ошибками
+void BenchPrint() 
+{
+    const int rows = Position::MAX_ROWS;
+    const int cols = 64;
+    std::vector<std::pair<Position, std::string>> texts;
+    texts.reserve(rows * cols);
+
+    for (int row = 0; row < rows; ++row) 
+    {
+        for (int col = 0; col < cols; ++col) 
+        {
+            const Position left{ row, col - 1 };
+
+            switch (col % 4) 
+            {
+                case 0:
+                    texts.emplace_back(Position{ row, col }, std::to_string(row * 0.37 + col));
+                    break;
+                case 1:
+                    texts.emplace_back(Position{ row, col }, "=" + left.ToString() + "/7+" + std::to_string(col));
+                    break;
+                case 2:
+                    texts.emplace_back(Position{ row, col }, "=(" + left.ToString() + "-" + std::to_string(row) + ")*1.5");
+                    break;
+                default:
+                    texts.emplace_back(Position{ row, col }, row % 8 == 0 ? "=1/0" : "label " + std::to_string(row));
+                    break;
+            }
+        }
+    }
+
+    Sheet sheet;
+    sheet.SetCells(std::move(texts));
+    DoNotOptimize(sheet.RecalculateAll());
+
+    for (bool value : { false, true }) 
+    {
+        // Первый проход также считывает значения из кэшей, второй - повторная печать
+        for (const char* pass : { "first", "second" }) 
+        {
+            CountingBuffer buffer;
+            std::ostream output(&buffer);
+            AllocationScope scope;
+
+            const double ns = MeasureNs([&] 
+            {
+                value ? sheet.PrintValues(output) : sheet.PrintTexts(output);
+            });
+            const std::string name = "Print" + std::string(value ? "Values" : "Texts") + ", 1M cells, " + pass + " pass";
+            Report(name, buffer.Size() / ns * 1e3, "MB/s");
+            Report(name + ", allocations", static_cast<double>(scope.Allocations()), "");
+        }
+    }
+}
+
+// Холодный старт листа: загрузка текстов с разбором и проверкой на циклы
+// против загрузки двоичного снимка
+void BenchSnapshot() 
+{
+    const int rows = Position::MAX_ROWS;
+    const int cols = 16;
+    std::vector<std::pair<Position, std::string>> texts;
+
+    for (int row = 0; row < rows; ++row) 
+    {
+        for (int col = 0; col < cols; ++col) 
+        {
+            if (col % 2 == 0) 
+            {
+                texts.emplace_back(Position{ row, col }, std::to_string(row + col));
+            } 
+            
+            else 
+            {
+                const std::string above = row > 0 ? Position{ row - 1, col }.ToString() : "0";
+                texts.emplace_back(Position{ row, col }, "=" + Position{ row, col - 1 }.ToString() + "*" + std::to_string(col) + "+" + above + "/4");
+            }
+        }
+    }
+
+    Sheet sheet;
+    sheet.SetCells(texts);
+    sheet.RecalculateAll();
+
+    std::ostringstream tsv;
+    SaveTexts(sheet, tsv, TableFormat::Tsv);
+    const std::string tsv_data = tsv.str();
+
+    std::ostringstream out;
+    double ns = MeasureNs([&] 
+    {
+        SheetSnapshot::Save(sheet, out);
+    });
+    const std::string snapshot = out.str();
+    Report("Save, " + std::to_string(texts.size()) + " cells", ns / 1e6, "ms");
+    Report("snapshot size", snapshot.size() / 1e6, "MB");
+
+    ns = MeasureNs([&] 
+    {
+        Sheet loaded;
+        DoNotOptimize(loaded.SetCells(texts));
+        DoNotOptimize(loaded.RecalculateAll());
+    });
+    Report("cold start: SetCells + RecalculateAll", ns / 1e6, "ms");
+
+    ns = MeasureNs([&] 
+    {
+        Sheet loaded;
+        std::istringstream input(tsv_data);
+        DoNotOptimize(LoadTable(loaded, input, TableFormat::Tsv));
+        DoNotOptimize(loaded.RecalculateAll());
+    });
+    Report("cold start: LoadTable + RecalculateAll", ns / 1e6, "ms");
+
+    ns = MeasureNs([&] 
+    {
+        Sheet loaded;
+        SheetSnapshot::Load(loaded, snapshot);
+        DoNotOptimize(loaded.RecalculateAll());
+    });
+    Report("cold start: SheetSnapshot::Load", ns / 1e6, "ms");
+}
+
+// Сумма по столбцам листа через ячейки и через столбцовое хранилище чисел,
+// а также цена поддержки хранилища при загрузке и пересчёте
+void BenchNumericColumns() 
+{
+    const int rows = Position::MAX_ROWS;
+    const int cols = 64;
+
+    auto make_texts = [rows, cols]() 
+    {
+        std::vector<std::pair<Position, std::string>> texts;
+        texts.reserve(rows * cols);
+
+        for (int row = 0; row < rows; ++row) 
+        {
+            for (int col = 0; col < cols; ++col) 
+            {
+                texts.emplace_back(Position{ row, col }, col % 2 == 0 ? std::to_string(row % 97 + col) 
+                                                                      : "=" + Position{ row, col - 1 }.ToString() + "*2");
+            }
+        }
+
+        return texts;
+    };
+
+    for (bool enabled : { false, true }) 
+    {
+        Sheet sheet;
+        sheet.SetNumericColumnsEnabled(enabled);
+        auto texts = make_texts();
+        const std::string suffix = enabled ? ", with numeric columns" : "";
+
+        double ns = MeasureNs([&] 
+        {
+            DoNotOptimize(sheet.SetCells(std::move(texts)));
+        });
+        Report("SetCells, 1M cells" + suffix, ns / 1e6, "ms");
+
+        ns = MeasureNs([&] 
+        {
+            DoNotOptimize(sheet.RecalculateAll());
+        });
+        Report("RecalculateAll, 512K formulas" + suffix, ns / 1e6, "ms");
+
+        if (!enabled) 
+        {
+            double sum = 0;
+            ns = MeasureNs([&] 
+            {
+                for (int col = 0; col < cols; ++col) 
+                {
+                    for (int row = 0; row < rows; ++row) 
+                    {
+                        if (const Cell* cell = sheet.GetCell({ row, col })) 
+                        {
+                            const auto value = cell->GetNumericValue();
+                            sum += std::holds_alternative<double>(value) ? std::get<double>(value) : 0.0;
+                        }
+                    }
+                }
+            });
+            DoNotOptimize(sum);
+            Report("sum of all columns through cells", ns / 1e6, "ms");
+            continue;
+        }
+
+        const NumericColumns& columns = *sheet.GetNumericColumns();
+        double sum = 0;
+        std::size_t count = 0;
+        ns = MeasureNs([&] 
+        {
+            for (int col = 0; col < cols; ++col) 
+            {
+                sum += columns.Sum(col, 0, rows);
+            }
+        });
+        DoNotOptimize(sum);
+        Report("sum of all columns through numeric columns", ns / 1e6, "ms");
+
+        ns = MeasureNs([&] 
+        {
+            for (int col = 0; col < cols; ++col) 
+            {
+                count += columns.Count(col, 0, rows);
+            }
+        });
+        DoNotOptimize(count);
+        Report("count of numbers in all columns", ns / 1e6, "ms");
+    }
+}
+
+// Часто изменяемая ячейка, от которой зависят 100000 формул, почти никогда
+// не читаемых: правка не должна обходить зависимые ячейки
+void BenchHotInput() 
+{
+    const int dependents = 100000;
+    const int edits = 1000;
+    std::vector<std::pair<Position, std::string>> texts;
+    texts.emplace_back(Position{ 0, 0 }, "1");
+
+    for (int i = 0; i < dependents; ++i) 
+    {
+        texts.emplace_back(Position{ i % Position::MAX_ROWS, 1 + i / Position::MAX_ROWS }, "=A1*" + std::to_string(i % 10 + 1));
+    }
+
+    Sheet sheet;
+    sheet.SetCells(std::move(texts));
+    DoNotOptimize(sheet.RecalculateAll());
+    const Position watched{ 0, 1 };
+    int value = 0;
+
+    double ns = MeasureNs([&] 
+    {
+        for (int i = 0; i < edits; ++i) 
+        {
+            sheet.SetCell({ 0, 0 }, std::to_string(++value));
+        }
+    });
+    Report("edit of the input, 100k dependents, per edit", ns / edits / 1e3, "us");
+
+    ns = MeasureNs([&] 
+    {
+        for (int i = 0; i < edits; ++i) 
+        {
+            sheet.SetCell({ 0, 0 }, std::to_string(++value));
+            DoNotOptimize(sheet.GetCell(watched)->GetValue());
+        }
+    });
+    Report("edit and read of one dependent, per edit", ns / edits / 1e3, "us");
+
+    ns = MeasureNs([&] 
+    {
+        sheet.SetCell({ 0, 0 }, std::to_string(++value));
+        DoNotOptimize(sheet.RecalculateAll());
+    });
+    Report("edit and RecalculateAll", ns / 1e6, "ms");
+
+    // Правка ячейки, от которой зависит одна формула: пересчёт не должен
+    // проверять 100000 формул, не связанных с ней
+    const Position unrelated{ 0, Position::MAX_COLS - 2 };
+    sheet.SetCell({ 0, Position::MAX_COLS - 1 }, "=" + unrelated.ToString() + "*2");
+    DoNotOptimize(sheet.RecalculateAll());
+
+    ns = MeasureNs([&] 
+    {
+        for (int i = 0; i < edits; ++i) 
+        {
+            sheet.SetCell(unrelated, std::to_string(++value));
+            DoNotOptimize(sheet.RecalculateAll());
+        }
+    });
+    Report("edit of an unrelated cell and RecalculateAll, per edit", ns / edits / 1e3, "us");
+}
+
+// Цепочка ссылок через всю высоту листа в нескольких столбцах (A2 = A1 + 1,
+// ..., B1 = A16384 + 1, ...): ленивое чтение конца цепочки и полный пересчёт
+void BenchDeepChain() 
+{
+    const int cols = 8;
+    const int length = Position::MAX_ROWS * cols;
+    std::vector<std::pair<Position, std::string>> texts;
+    texts.reserve(length);
+
+    for (int col = 0; col < cols; ++col) 
+    {
+        for (int row = 0; row < Position::MAX_ROWS; ++row) 
+        {
+            const Position previous = row > 0 ? Position{ row - 1, col } : Position{ Position::MAX_ROWS - 1, col - 1 };
+            texts.emplace_back(Position{ row, col }, col == 0 && row == 0 ? "1" : "=" + previous.ToString() + "+1");
+        }
+    }
+
+    Sheet sheet;
+    sheet.SetCells(std::move(texts));
+    const Position last{ Position::MAX_ROWS - 1, cols - 1 };
+    int value = 1;
+
+    double ns = MeasureNs([&] 
+    {
+        DoNotOptimize(sheet.GetCell(last)->GetValue());
+    });
+    Report("first read of the end of 131k-deep chain", ns / 1e6, "ms");
+
+    ns = MeasureNs([&] 
+    {
+        sheet.SetCell({ 0, 0 }, std::to_string(++value));
+        DoNotOptimize(sheet.GetCell(last)->GetValue());
+    });
+    Report("edit of the head and read of the end", ns / 1e6, "ms");
+
+    ns = MeasureNs([&] 
+    {
+        sheet.SetCell({ 0, 0 }, std::to_string(++value));
+        DoNotOptimize(sheet.RecalculateAll());
+    });
+    Report("edit of the head and RecalculateAll", ns / 1e6, "ms");
+}
+
+// Граф с большим числом связей: 100000 формул, каждая ссылается на три ячейки
+// предыдущей строки и на общую ячейку K1. Память графа на связь считается как
+// разница с листом из таких же формул над числами вместо ссылок. Числа у всех
+// формул разные, чтобы формулы не делили одно дерево
+void BenchDependencyGraph() 
+{
+    const int cols = 10;
+    const int rows = 10001;
+    const Position hub{ 0, cols };
+    const double edges = 4.0 * cols * (rows - 1);
+
+    auto make_texts = [&](bool references) 
+    {
+        std::vector<std::pair<Position, std::string>> texts;
+        texts.emplace_back(hub, "1");
+
+        for (int row = 0; row < rows; ++row) 
+        {
+            for (int col = 0; col < cols; ++col) 
+            {
+                if (row == 0) 
+                {
+                    texts.emplace_back(Position{ row, col }, std::to_string(col));
+                    continue;
+                }
+
+                std::string text = "=";
+
+                for (int offset = 0; offset < 3; ++offset) 
+                {
+                    text += references ? Position{ row - 1, (col + offset) % cols }.ToString() 
+                                       : std::to_string(row * cols + col + offset);
+                    text += '+';
+                }
+
+                texts.emplace_back(Position{ row, col }, text + (references ? hub.ToString() : "1"));
+            }
+        }
+
+        return texts;
+    };
+
+    std::ptrdiff_t constant_bytes = 0;
+
+    {
+        AllocationScope scope;
+        Sheet sheet;
+        sheet.SetCells(make_texts(false));
+        constant_bytes = scope.LiveBytes();
+    }
+
+    auto texts = make_texts(true);
+    AllocationScope scope;
+    Sheet sheet;
+    double ns = MeasureNs([&] 
+    {
+        sheet.SetCells(std::move(texts));
+    });
+    Report("SetCells, 400k edges", ns / 1e6, "ms");
+    Report("dependency graph memory per edge", (scope.LiveBytes() - constant_bytes) / edges, "B");
+    DoNotOptimize(sheet.RecalculateAll());
+
+    int value = 1;
+    ns = MeasureNs([&] 
+    {
+        sheet.SetCell(hub, std::to_string(++value));
+        DoNotOptimize(sheet.RecalculateAll());
+    });
+    Report("edit of K1 and RecalculateAll", ns / 1e6, "ms");
+
+    ns = MeasureNs([&] 
+    {
+        sheet.SetCell(hub, std::to_string(++value));
+
+        for (int col = 0; col < cols; ++col) 
+        {
+            DoNotOptimize(sheet.GetCell({ rows - 1, col })->GetValue());
+        }
+    });
+    Report("edit of K1 and lazy read of the last row", ns / 1e6, "ms");
+
+    // Ссылка K1 на последнюю строку замкнула бы цикл через все формулы
+    const int attempts = 10;
+    const std::string cycle = "=" + Position{ rows - 1, 0 }.ToString();
+    ns = MeasureNs([&] 
+    {
+        for (int i = 0; i < attempts; ++i) 
+        {
+            try 
+            {
+                sheet.SetCell(hub, cycle);
+            } 
+            
+            catch (const CircularDependencyException&) 
+            {
+            }
+        }
+    });
+    Report("rejected cycle through all formulas", ns / attempts / 1e6, "ms");
+}
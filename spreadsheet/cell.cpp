@@ -1,13 +1,108 @@
 #include "cell.h"
+#include "FormulaAST.h"
 #include "sheet.h"
+#include "thread_pool.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <cmath>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace 
+{
+    // Количество записей пакета, которые разбирает одна задача пула
+    constexpr std::size_t PARSE_BATCH_SIZE = 256;
+    // Буфер, в который помещается число в формате general или scientific при
+    // любой разумной точности. Длинные числа в формате fixed выводит поток
+    constexpr std::size_t NUMBER_BUFFER_SIZE = 128;
+
+    // Сравнивает значения формулы, различая 0 и -0, которые печатаются по-разному
+    bool IsSameValue(const Cell::NumericValue& lhs, const Cell::NumericValue& rhs) 
+    {
+        const double* lhs_number = std::get_if<double>(&lhs);
+        const double* rhs_number = std::get_if<double>(&rhs);
+
+        if (lhs_number && rhs_number) 
+        {
+            return *lhs_number == *rhs_number && std::signbit(*lhs_number) == std::signbit(*rhs_number);
+        }
+
+        return lhs == rhs;
+    }
+} // end of namespace
+
+void AppendNumber(std::string& output, double number, const std::ostream& format) 
+{
+    const std::ios_base::fmtflags flags = format.flags();
+    const std::ios_base::fmtflags floatfield = flags & std::ios_base::floatfield;
+    const int precision = static_cast<int>(format.precision());
+
+    // Флаги, которые std::to_chars не поддерживает, и шестнадцатеричный формат
+    // выводятся самим потоком
+    if (!(flags & (std::ios_base::showpoint | std::ios_base::showpos | std::ios_base::uppercase)) 
+        && floatfield != std::ios_base::floatfield) 
+    {
+        const std::chars_format chars_format = floatfield == std::ios_base::fixed ? std::chars_format::fixed 
+            : floatfield == std::ios_base::scientific ? std::chars_format::scientific 
+            : std::chars_format::general;
+
+        char chars[NUMBER_BUFFER_SIZE];
+        const auto [end, error] = std::to_chars(chars, chars + sizeof(chars), number, chars_format, precision);
+
+        if (error == std::errc()) 
+        {
+            output.append(chars, end);
+            return;
+        }
+    }
+
+    std::ostringstream stream;
+    stream.copyfmt(format);
+    stream << number;
+    output += stream.str();
+}
+
+CacheStatistics CacheCounters::Get() const 
+{
+    CacheStatistics statistics;
+
+    for (const auto& shard : shards_) 
+    {
+        statistics.hits += shard.hits.load(std::memory_order_relaxed);
+        statistics.misses += shard.misses.load(std::memory_order_relaxed);
+    }
+
+    return statistics;
+}
+
+void CacheCounters::Reset() 
+{
+    for (auto& shard : shards_) 
+    {
+        shard.hits = 0;
+        shard.misses = 0;
+    }
+}
+
+// Каждый поток при первом обращении получает свою часть счётчиков
+std::size_t CacheCounters::ShardIndex() 
+{
+    static std::atomic<std::size_t> next_index = 0;
+    thread_local const std::size_t index = next_index++ % SHARD_COUNT;
+
+    return index;
+}
 
 // Реализуйте следующие методы
-Cell::Cell(SheetInterface& sheet)
-    : sheet_(sheet) 
+Cell::Cell(Sheet& sheet, Position pos)
+    : sheet_(sheet)
+    , pos_(pos)
+    , order_(sheet.GetOrderLabels().Highest()) 
     {
         impl_ = std::make_unique<EmptyImpl>();
     }
@@ -16,137 +111,871 @@ Cell::~Cell() {}
 
 void Cell::Set(std::string text) 
 {   
-    // Сохраняем старый текст для отката в случае ошибки
-    std::string old_text = this->GetText();
-
-    // Если значение text отличается от установленного в ячейке ранее
-    if (text == old_text)
+    // Если значение text совпадает с установленным в ячейке ранее
+    if (text == impl_->GetText())
     {
         return;
     }
 
+    std::unique_ptr<Impl> impl = MakeImpl(std::move(text));
+
+    const std::vector<Position> referenced_cells = impl->GetReferencedCells();
+    // Новые ссылки на существующие ячейки. Несуществующая ячейка не имеет входов
+    // и не может замкнуть цикл, поэтому создаётся только после проверки
+    std::vector<Cell*> added;
+
+    for (const auto& cell_pos : referenced_cells) 
+    {
+        Cell* cell = sheet_.GetCell(cell_pos);
+
+        if (!cell || referenced_by_.Contains(cell)) 
+        {
+            continue;
+        }
+
+        if (!AddReference(cell)) 
+        {
+            // В случае циклической зависимости ячейка сохраняет старое содержимое
+            for (Cell* added_cell : added) 
+            {
+                RemoveReference(added_cell);
+            }
+
+            throw CircularDependencyException("Circular Dependency");
+        }
+
+        added.push_back(cell);
+    }
+
+    impl_ = std::move(impl);
+    // Зависимые ячейки не обходятся: они сравнят метку изменения с меткой своей
+    // проверки при чтении (см. Refresh)
+    changed_at_ = sheet_.AdvanceEpoch();
+    sheet_.AddChangedCell(pos_);
+    UpdateDependence(referenced_cells);
+    UpdateNumericColumns();
+}
+
+// Создаёт реализацию ячейки по тексту. Бросает FormulaException, если формула некорректна
+std::unique_ptr<Cell::Impl> Cell::MakeImpl(std::string text) const 
+{
     if (text.empty()) 
     {
         // Если текст пустой, устанавливаем пустую реализацию
-        impl_ = std::make_unique<EmptyImpl>();
+        return std::make_unique<EmptyImpl>();
     }
 
-    else if (text.size() > 1 && text[0] == FORMULA_SIGN)
+    if (text.size() > 1 && text[0] == FORMULA_SIGN)
     { 
         // Если текст начинается с символа формулы, создаем реализацию формулы
-        impl_ = std::make_unique<FormulaImpl>(std::move(text), sheet_);
+        return std::make_unique<FormulaImpl>(std::move(text), pos_, sheet_.GetFormulaTable(), sheet_.GetCacheCounters());
     }
 
+    // В противном случае создаем реализацию текста
+    return std::make_unique<TextImpl>(std::move(text));
+}
+
+// Пакетная установка: сначала разбираются все тексты, затем связи всех ячеек
+// меняются разом без проверок, и граф проверяется на циклы один раз.
+// Ячейки из найденных циклов возвращаются к прежнему содержимому
+std::vector<std::exception_ptr> Cell::SetBatch(std::vector<std::pair<Cell*, std::string>>& batch, ThreadPool* pool) 
+{
+    std::vector<std::exception_ptr> errors(batch.size());
+
+    // Ячейка с новым содержимым и всё, что нужно для отката
+    struct Staged 
+    {
+        Cell* cell;
+        std::size_t index;
+        std::unique_ptr<Impl> old_impl;
+        std::vector<Cell*> old_inputs;
+        std::vector<Position> referenced_cells;
+        bool reverted = false;
+    };
+
+    // Повторные записи ячейки: действует последняя
+    for (auto it = batch.rbegin(); it != batch.rend(); ++it) 
+    {
+        if (it->first->visited_) 
+        {
+            it->first = nullptr;
+        }
+
+        else 
+        {
+            it->first->visited_ = true;
+        }
+    }
+
+    for (auto& [cell, text] : batch) 
+    {
+        if (cell) 
+        {
+            cell->visited_ = false;
+        }
+    }
+
+    // Разбор не меняет граф, поэтому записи разбираются независимо, в том числе
+    // в пуле. Каждая задача сама перехватывает исключения своих записей
+    std::vector<std::unique_ptr<Impl>> impls(batch.size());
+
+    auto parse = [&batch, &impls, &errors](std::size_t begin, std::size_t end) 
+    {
+        for (std::size_t i = begin; i < end; ++i) 
+        {
+            auto& [cell, text] = batch[i];
+
+            if (!cell || text == cell->impl_->GetText()) 
+            {
+                continue;
+            }
+
+            try 
+            {
+                impls[i] = cell->MakeImpl(std::move(text));
+            } 
+
+            catch (...) 
+            {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+
+    if (pool && batch.size() > PARSE_BATCH_SIZE) 
+    {
+        for (std::size_t begin = 0; begin < batch.size(); begin += PARSE_BATCH_SIZE) 
+        {
+            const std::size_t end = std::min(batch.size(), begin + PARSE_BATCH_SIZE);
+            pool->Submit([&parse, begin, end] { parse(begin, end); });
+        }
+
+        pool->Wait();
+    } 
+    
     else 
     {
-        // В противном случае создаем реализацию текста
-        impl_ = std::make_unique<TextImpl>(std::move(text));
+        parse(0, batch.size());
     }
 
-    if (IsCircularDependency(*impl_)) 
+    // Дальше граф меняется в одном потоке, в порядке записей
+    std::vector<Staged> staged;
+    staged.reserve(batch.size());
+
+    for (std::size_t i = 0; i < batch.size(); ++i) 
     {
-        // В случае циклической зависимости возвращаем старый текст
-        this->Set(std::move(old_text));
+        if (impls[i]) 
+        {
+            staged.push_back({ batch[i].first, i, std::move(impls[i]), {}, {} });
+        }
+    }
 
-        throw CircularDependencyException("Circular Dependency");
+    // Меняем содержимое и связи. Несуществующие ячейки не могут замкнуть цикл
+    // и создаются после проверки
+    for (auto& entry : staged) 
+    {
+        Cell* cell = entry.cell;
+        std::swap(cell->impl_, entry.old_impl);
+        entry.old_inputs.assign(cell->referenced_by_.begin(), cell->referenced_by_.end());
+        cell->UnlinkInputs();
+        entry.referenced_cells = cell->impl_->GetReferencedCells();
+
+        for (const auto& cell_pos : entry.referenced_cells) 
+        {
+            if (Cell* input = cell->sheet_.GetCell(cell_pos)) 
+            {
+                Link(cell, input);
+            }
+        }
     }
-    
-    UpdateDependence();
-    InvalidateCache();
+
+    // Порядок могли нарушить только изменённые ячейки и ячейки, зависящие от них
+    std::vector<Cell*> region;
+
+    for (auto& entry : staged) 
+    {
+        if (!entry.cell->visited_) 
+        {
+            entry.cell->visited_ = true;
+            region.push_back(entry.cell);
+        }
+    }
+
+    for (std::size_t i = 0; i < region.size(); ++i) 
+    {
+        for (Cell* dependent : region[i]->referenced_to_) 
+        {
+            if (!dependent->visited_) 
+            {
+                dependent->visited_ = true;
+                region.push_back(dependent);
+            }
+        }
+    }
+
+    for (Cell* cell : region) 
+    {
+        cell->visited_ = false;
+    }
+
+    std::vector<Cell*> order;
+    // Номер записи изменённой ячейки, нужен только для отката циклов
+    std::unordered_map<Cell*, std::size_t> staged_index;
+
+    while (true) 
+    {
+        // Топологическая сортировка области (алгоритм Кана)
+        for (Cell* cell : region) 
+        {
+            for (Cell* dependent : cell->referenced_to_) 
+            {
+                ++dependent->pending_inputs_;
+            }
+        }
+
+        order.clear();
+
+        for (Cell* cell : region) 
+        {
+            if (cell->pending_inputs_ == 0) 
+            {
+                order.push_back(cell);
+            }
+        }
+
+        for (std::size_t i = 0; i < order.size(); ++i) 
+        {
+            for (Cell* dependent : order[i]->referenced_to_) 
+            {
+                if (--dependent->pending_inputs_ == 0) 
+                {
+                    order.push_back(dependent);
+                }
+            }
+        }
+
+        if (order.size() == region.size()) 
+        {
+            break;
+        }
+
+        // Не вошедшие в порядок ячейки лежат на циклах или после них
+        std::vector<Cell*> remaining;
+
+        for (Cell* cell : region) 
+        {
+            if (cell->pending_inputs_ > 0) 
+            {
+                cell->pending_inputs_ = 0;
+                remaining.push_back(cell);
+            }
+        }
+
+        if (staged_index.empty()) 
+        {
+            for (std::size_t i = 0; i < staged.size(); ++i) 
+            {
+                staged_index.emplace(staged[i].cell, i);
+            }
+        }
+
+        for (const auto& cycle : FindCycles(remaining)) 
+        {
+            for (Cell* cell : cycle) 
+            {
+                auto it = staged_index.find(cell);
+
+                if (it == staged_index.end() || staged[it->second].reverted) 
+                {
+                    continue;
+                }
+
+                Staged& entry = staged[it->second];
+                entry.reverted = true;
+
+                cell->UnlinkInputs();
+
+                for (Cell* input : entry.old_inputs) 
+                {
+                    Link(cell, input);
+                }
+
+                std::swap(cell->impl_, entry.old_impl);
+                errors[entry.index] = std::make_exception_ptr(CircularDependencyException("Circular Dependency"));
+            }
+        }
+    }
+
+    // Область получает метки выше всех существующих в топологическом порядке
+    for (Cell* cell : order) 
+    {
+        cell->order_ = cell->sheet_.GetOrderLabels().Highest();
+    }
+
+    // Все изменения пакета - одна правка листа
+    const std::uint64_t epoch = staged.empty() ? 0 : staged.front().cell->sheet_.AdvanceEpoch();
+
+    for (auto& entry : staged) 
+    {
+        if (!entry.reverted) 
+        {
+            entry.cell->changed_at_ = epoch;
+            entry.cell->sheet_.AddChangedCell(entry.cell->pos_);
+            entry.cell->UpdateDependence(entry.referenced_cells);
+        }
+
+        entry.cell->UpdateNumericColumns();
+    }
+
+    return errors;
 }
 
-// Проверяет наличие циклической зависимости в ячейках
-bool Cell::IsCircularDependency(const Impl& impl) const 
+// Обходит ячейки, достижимые от изменённых по ссылкам на них. Недостижимые
+// ячейки не зависят от правок, сделанных после полной проверки, поэтому
+// их значения действительны, даже если не проверены на текущей правке
+std::vector<Cell*> Cell::FindStale(const std::vector<Cell*>& changed) 
 {
-    if (impl.GetReferencedCells().empty()) 
+    std::vector<Cell*> reached;
+
+    for (Cell* cell : changed) 
     {
-        return false;
+        if (!cell->visited_) 
+        {
+            cell->visited_ = true;
+            reached.push_back(cell);
+        }
+    }
+
+    for (std::size_t i = 0; i < reached.size(); ++i) 
+    {
+        for (Cell* dependent : reached[i]->referenced_to_) 
+        {
+            if (!dependent->visited_) 
+            {
+                dependent->visited_ = true;
+                reached.push_back(dependent);
+            }
+        }
     }
 
-    std::unordered_set<const Cell*> referenced_cells;
+    std::vector<Cell*> stale;
+
+    for (Cell* cell : reached) 
+    {
+        if (cell->IsDirty()) 
+        {
+            stale.push_back(cell);
+        }
+    }
 
-    // Собираем все ячейки, на которые ссылается текущая ячейка
-    for (const auto& cell_pos : impl.GetReferencedCells()) 
+    // Пересчёт устаревшей формулы не поднимается к недостижимым входам
+    for (const Cell* cell : stale) 
     {
-        referenced_cells.insert(dynamic_cast<Cell*>(sheet_.GetCell(cell_pos)));
+        for (const Cell* input : cell->referenced_by_) 
+        {
+            if (!input->visited_ && !input->IsVerified()) 
+            {
+                input->verified_at_ = input->sheet_.GetEpoch();
+            }
+        }
+    }
+
+    for (Cell* cell : reached) 
+    {
+        cell->visited_ = false;
+    }
+
+    return stale;
+}
+
+// Находит циклы среди cells, учитывая только ссылки между ними (алгоритм Тарьяна).
+// Возвращает компоненты сильной связности, содержащие цикл
+std::vector<std::vector<Cell*>> Cell::FindCycles(const std::vector<Cell*>& cells) 
+{
+    struct Info 
+    {
+        std::size_t index;
+        std::size_t low_link;
+        bool on_stack;
+    };
+
+    struct Frame 
+    {
+        Cell* cell;
+        CellEdges::Iterator next;
+    };
+
+    std::unordered_set<Cell*> members(cells.begin(), cells.end());
+    std::unordered_map<Cell*, Info> info;
+    std::vector<Cell*> stack;
+    std::vector<Frame> frames;
+    std::vector<std::vector<Cell*>> cycles;
+
+    auto visit = [&](Cell* cell) 
+    {
+        const std::size_t index = info.size();
+        info[cell] = { index, index, true };
+        stack.push_back(cell);
+        frames.push_back({ cell, cell->referenced_to_.begin() });
+    };
+
+    for (Cell* root : cells) 
+    {
+        if (info.count(root)) 
+        {
+            continue;
+        }
+
+        visit(root);
+
+        while (!frames.empty()) 
+        {
+            Cell* cell = frames.back().cell;
+
+            if (frames.back().next != cell->referenced_to_.end()) 
+            {
+                Cell* dependent = *frames.back().next++;
+
+                if (!members.count(dependent)) 
+                {
+                    continue;
+                }
+
+                auto it = info.find(dependent);
+
+                if (it == info.end()) 
+                {
+                    visit(dependent);
+                } 
+                
+                else if (it->second.on_stack) 
+                {
+                    info[cell].low_link = std::min(info[cell].low_link, it->second.index);
+                }
+
+                continue;
+            }
+
+            frames.pop_back();
+            const Info cell_info = info[cell];
+
+            if (!frames.empty()) 
+            {
+                Info& parent = info[frames.back().cell];
+                parent.low_link = std::min(parent.low_link, cell_info.low_link);
+            }
+
+            if (cell_info.low_link != cell_info.index) 
+            {
+                continue;
+            }
+
+            // cell - корень компоненты сильной связности
+            std::vector<Cell*> component;
+
+            do 
+            {
+                component.push_back(stack.back());
+                info[stack.back()].on_stack = false;
+                stack.pop_back();
+            } 
+            while (component.back() != cell);
+
+            if (component.size() > 1 || cell->referenced_by_.Contains(cell)) 
+            {
+                cycles.push_back(std::move(component));
+            }
+        }
     }
 
-    // Проверяем на циклическую зависимость с помощью обхода в глубину
-    // Список для проверки начинается с текущей ячейки
-    std::vector<const Cell*> check_list;
-    check_list.push_back(this);
-    // Ячейки, которые уже проверены
-    std::unordered_set<const Cell*> checked_cells;
+    return cycles;
+}
+
+// Добавляет ссылку текущей ячейки на cell, сохраняя топологический порядок.
+// Возвращает false, если ссылка замкнула бы цикл
+bool Cell::AddReference(Cell* cell) 
+{
+    if (cell == this) 
+    {
+        return false;
+    }
 
-    while (!check_list.empty()) 
+    // Порядок уже верный - самый частый случай
+    if (cell->order_ >= order_) 
     {
-        const Cell* current_cell = check_list.back();
+        if (cell->referenced_by_.IsEmpty()) 
+        {
+            cell->order_ = sheet_.GetOrderLabels().Lowest();
+        }
+
+        else if (referenced_to_.IsEmpty()) 
+        {
+            order_ = sheet_.GetOrderLabels().Highest();
+        }
+
+        else if (!Reorder(cell)) 
+        {
+            return false;
+        }
+    }
+
+    Link(this, cell);
+
+    return true;
+}
+
+// Переупорядочивает метки так, чтобы cell оказалась раньше текущей ячейки
+// (алгоритм Пирса-Келли). Затрагиваются только ячейки с метками между
+// метками текущей ячейки и cell. Возвращает false, если cell зависит от текущей
+bool Cell::Reorder(Cell* cell) 
+{
+    const std::int64_t lower_bound = order_;
+    const std::int64_t upper_bound = cell->order_;
 
-        // Если текущая ячейка была найдена - есть циклическая зависимость
-        if (referenced_cells.find(current_cell) != referenced_cells.end()) 
+    // Обход зависимых ячеек: те, что должны остаться после текущей
+    std::vector<Cell*> forward{ this };
+    visited_ = true;
+    bool is_cycle = false;
+
+    for (std::size_t i = 0; i < forward.size() && !is_cycle; ++i) 
+    {
+        for (Cell* dependent : forward[i]->referenced_to_) 
         {
-            return true;
+            if (dependent == cell) 
+            {
+                is_cycle = true;
+                break;
+            }
+
+            if (!dependent->visited_ && dependent->order_ < upper_bound) 
+            {
+                dependent->visited_ = true;
+                forward.push_back(dependent);
+            }
         }
+    }
+
+    // Обход входов cell: те, что должны остаться перед ней
+    std::vector<Cell*> backward;
 
-        // Помечаем текущую ячейку как проверенную
-        checked_cells.insert(current_cell);
-        check_list.pop_back();
+    if (!is_cycle) 
+    {
+        backward.push_back(cell);
+        cell->visited_ = true;
 
-        // Цикл по ячейкам, на которые ссылается текущая, добавляем их в список
-        for (const Cell* cell : current_cell->referenced_to_) 
+        for (std::size_t i = 0; i < backward.size(); ++i) 
         {
-            if (checked_cells.find(cell) == checked_cells.end()) 
+            for (Cell* input : backward[i]->referenced_by_) 
             {
-                check_list.push_back(cell);
+                if (!input->visited_ && input->order_ > lower_bound) 
+                {
+                    input->visited_ = true;
+                    backward.push_back(input);
+                }
             }
         }
     }
 
-    return false;
+    auto by_order = [](const Cell* lhs, const Cell* rhs) 
+    { 
+        return lhs->order_ < rhs->order_; 
+    };
+
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::sort(backward.begin(), backward.end(), by_order);
+
+    // Освободившиеся метки раздаются сначала входам cell, затем зависимым текущей
+    std::vector<std::int64_t> labels;
+    labels.reserve(forward.size() + backward.size());
+
+    for (Cell* affected : backward) 
+    {
+        affected->visited_ = false;
+        labels.push_back(affected->order_);
+    }
+
+    for (Cell* affected : forward) 
+    {
+        affected->visited_ = false;
+        labels.push_back(affected->order_);
+    }
+
+    if (is_cycle) 
+    {
+        return false;
+    }
+
+    std::sort(labels.begin(), labels.end());
+    auto label = labels.begin();
+
+    for (Cell* affected : backward) 
+    {
+        affected->order_ = *label++;
+    }
+
+    for (Cell* affected : forward) 
+    {
+        affected->order_ = *label++;
+    }
+
+    return true;
 }
 
-// Обновляет зависимости текущей ячейки
-void Cell::UpdateDependence()
+// Связывает ячейку dependent с ячейкой input, на которую она ссылается
+void Cell::Link(Cell* dependent, Cell* input) 
 {
-    for (Cell* cells : referenced_by_) 
+    const auto input_index = static_cast<std::uint32_t>(dependent->referenced_by_.Size());
+    const auto dependent_index = static_cast<std::uint32_t>(input->referenced_to_.Size());
+    dependent->referenced_by_.PushBack({ input, dependent_index });
+    input->referenced_to_.PushBack({ dependent, input_index });
+}
+
+// Удаляет связь ячейки dependent с её входом номер index. Записи связи
+// в обоих списках заменяются последними записями, а парные записи
+// перенесённых связей получают новые номера
+void Cell::Unlink(Cell* dependent, std::size_t index) 
+{
+    const CellEdges::Edge edge = dependent->referenced_by_[index];
+    CellEdges& dependents = edge.cell->referenced_to_;
+
+    if (dependents.MoveBackTo(edge.mirror)) 
     {
-        // Удаляем текущую ячейку из зависимостей других ячеек
-        cells->referenced_to_.erase(this);
+        const CellEdges::Edge& moved = dependents[edge.mirror];
+        moved.cell->referenced_by_[moved.mirror].mirror = edge.mirror;
     }
 
-    // Очищаем список зависимых ячеек
-    referenced_by_.clear();
+    if (dependent->referenced_by_.MoveBackTo(index)) 
+    {
+        const CellEdges::Edge& moved = dependent->referenced_by_[index];
+        moved.cell->referenced_to_[moved.mirror].mirror = static_cast<std::uint32_t>(index);
+    }
+}
+
+// Удаляет все ссылки текущей ячейки
+void Cell::UnlinkInputs() 
+{
+    while (!referenced_by_.IsEmpty()) 
+    {
+        Unlink(this, referenced_by_.Size() - 1);
+    }
+}
 
-    for (const auto& cell_pos : impl_->GetReferencedCells()) 
+// Удаляет ссылку текущей ячейки на cell
+void Cell::RemoveReference(Cell* cell) 
+{
+    for (std::size_t i = 0; i < referenced_by_.Size(); ++i) 
     {
-        Cell* cell = dynamic_cast<Cell*>(sheet_.GetCell(cell_pos));
+        if (referenced_by_[i].cell == cell) 
+        {
+            Unlink(this, i);
+            return;
+        }
+    }
+}
+
+// Приводит ссылки текущей ячейки к списку referenced_cells.
+// Ссылки на ячейки, существовавшие при проверке на цикл, уже добавлены
+void Cell::UpdateDependence(const std::vector<Position>& referenced_cells)
+{
+    for (const auto& cell_pos : referenced_cells) 
+    {
+        Cell* cell = sheet_.GetCell(cell_pos);
     
         if (!cell) 
         {
             // Если целевая ячейка не существует, создаем пустую ячейку
             sheet_.SetCell(cell_pos, EMPTY);
-            cell = dynamic_cast<Cell*>(sheet_.GetCell(cell_pos));
+            cell = sheet_.GetCell(cell_pos);
         }
 
-        // Добавляем целевую ячейку в список зависимых
-        referenced_by_.insert(cell);
-        // Добавляем текущую ячейку в список зависимостей целевой ячейки
-        cell->referenced_to_.insert(this);
+        // Ссылки ещё нет только на ячейки, созданные после проверки. У них нет
+        // входов, поэтому они не могут замкнуть цикл
+        if (!referenced_by_.Contains(cell)) 
+        {
+            AddReference(cell);
+        }
+    }
+
+    // Удаляем ссылки старого содержимого. Список referenced_cells отсортирован.
+    // На место удалённой ссылки переносится последняя, уже проверенная
+    for (std::size_t i = referenced_by_.Size(); i-- > 0;) 
+    {
+        if (!std::binary_search(referenced_cells.begin(), referenced_cells.end(), referenced_by_[i].cell->pos_)) 
+        {
+            Unlink(this, i);
+        }
     }
+
+    // Все ячейки, на которые ссылается формула, уже существуют
+    [[maybe_unused]] const bool bound = impl_->BindInputs(sheet_);
+    assert(bound);
 } 
 
-// Инвалидирует кэш значений для текущей и зависимых ячеек
-void Cell::InvalidateCache() 
+// Находит ячейки, на которые ссылается формула. Ячейки, на которые есть
+// ссылка, не удаляются из таблицы и не меняют адрес, поэтому при вычислении
+// формула читает их напрямую
+bool Cell::FormulaImpl::BindInputs(const Sheet& sheet) 
 {
-    if (impl_->IsCacheValid()) 
+    const Position origin = formula_ptr_->GetOrigin();
+    inputs_.clear();
+    inputs_.reserve(ast_->GetCells().size());
+
+    for (const Position offset : ast_->GetCells()) 
     {
-        impl_->InvalidateCache();
+        const Position pos{ offset.row + origin.row, offset.col + origin.col };
+        const Cell* cell = pos.IsValid() ? sheet.GetCell(pos) : nullptr;
 
-        for (Cell* cells : referenced_to_) 
+        if (pos.IsValid() && !cell) 
         {
-            cells->InvalidateCache();
+            return false;
         }
+
+        inputs_.push_back(cell);
     }
+
+    return true;
+}
+
+// Возвращает значение формулы либо ошибку. Если вычисление какой-то из
+// указанных в формуле ячеек приводит к ошибке, возвращается именно эта ошибка.
+// Если таких ошибок несколько, возвращается любая
+FormulaInterface::Value Cell::FormulaImpl::Evaluate() const 
+{
+    const auto cell_value = [this](std::size_t index) -> double 
+    {
+        const Cell* cell = inputs_[index];
+
+        if (!cell) 
+        {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+
+        // Значение ячейки запрашивается ровно один раз
+        const NumericValue value = cell->GetNumericValue();
+
+        if (const double* number = std::get_if<double>(&value)) 
+        {
+            return *number;
+        }
+
+        throw std::get<FormulaError>(value);
+    };
+
+    try 
+    {
+        return ast_->ExecuteByIndex(cell_value);
+    }
+
+    catch (const FormulaError& e) 
+    {
+        return e;
+    }
+}
+
+// Проверяет, что значение ячейки соответствует последней правке листа.
+// Ячейка без входов со значением (текст, пустая ячейка, формула из чисел)
+// не устаревает. Проверка ничего не пишет, поэтому при параллельном пересчёте
+// её можно выполнять для ячеек, которые обрабатывают другие потоки
+bool Cell::IsVerified() const 
+{
+    return verified_at_ == sheet_.GetEpoch() || (referenced_by_.IsEmpty() && impl_->IsCacheValid());
+}
+
+// Приводит значение ячейки к последней правке листа. Сначала без рекурсии
+// проверяются устаревшие входы, поэтому вычисление формулы читает только
+// проверенные ячейки и глубина стека не зависит от длины цепочки ссылок.
+// Возвращает true, если формула была вычислена (промах кэша учтён)
+bool Cell::Refresh() const 
+{
+    if (IsVerified()) 
+    {
+        return false;
+    }
+
+    RefreshInputs();
+
+    return RefreshSelf();
+}
+
+// Проверяет устаревшие ячейки, от которых зависит текущая, начиная с истоков:
+// обход в глубину с явным стеком проверяет ячейку после всех её входов
+void Cell::RefreshInputs() const 
+{
+    std::vector<std::pair<const Cell*, CellEdges::Iterator>> stack;
+
+    for (const Cell* input : referenced_by_) 
+    {
+        if (input->IsVerified()) 
+        {
+            continue;
+        }
+
+        stack.emplace_back(input, input->referenced_by_.begin());
+
+        while (!stack.empty()) 
+        {
+            auto& [cell, next] = stack.back();
+
+            if (next == cell->referenced_by_.end()) 
+            {
+                cell->RefreshSelf();
+                stack.pop_back();
+                continue;
+            }
+
+            // Граф без циклов: ячейка, лежащая в стеке, не встретится повторно,
+            // а уже проверенная пропускается
+            const Cell* next_input = *next++;
+
+            if (!next_input->IsVerified()) 
+            {
+                stack.emplace_back(next_input, next_input->referenced_by_.begin());
+            }
+        }
+    }
+}
+
+// Проверяет ячейку, все входы которой уже проверены. Формула вычисляется
+// заново, только если у неё нет значения или какой-то вход изменился после
+// её прошлой проверки. Если новое значение совпадает со старым, метка
+// изменения не сдвигается и зависимые ячейки не пересчитываются
+bool Cell::RefreshSelf() const 
+{
+    bool inputs_changed = !impl_->IsCacheValid();
+
+    for (auto it = referenced_by_.begin(); !inputs_changed && it != referenced_by_.end(); ++it) 
+    {
+        inputs_changed = (*it)->changed_at_ > verified_at_;
+    }
+
+    const std::uint64_t epoch = sheet_.GetEpoch();
+    verified_at_ = epoch;
+
+    if (!inputs_changed) 
+    {
+        // Число в хранилище отмечается проверенным на текущей правке
+        UpdateNumericColumns();
+        return false;
+    }
+
+    std::optional<NumericValue> old_value;
+
+    if (const NumericValue* ready = impl_->GetReadyValue()) 
+    {
+        old_value = *ready;
+    }
+
+    impl_->InvalidateCache();
+    const NumericValue value = impl_->GetNumericValue();
+
+    if (!old_value || !IsSameValue(*old_value, value)) 
+    {
+        changed_at_ = epoch;
+    }
+
+    UpdateNumericColumns();
+
+    return true;
 }
 
 // Очищает содержимое ячейки
@@ -157,26 +986,122 @@ void Cell::Clear()
     Set(EMPTY);
 }
 
-// Возвращает значение текущей ячейки
+// Возвращает значение текущей ячейки. Значение, вычисленное при проверке,
+// берётся из кэша без повторного учёта в статистике
 Cell::Value Cell::GetValue() const 
 {
+    if (Refresh()) 
+    {
+        return std::visit([](const auto& value) -> Value { return value; }, *impl_->GetReadyValue());
+    }
+
     return impl_->GetValue();
 }
 
+// Возвращает значение текущей ячейки, трактуемое как число
+Cell::NumericValue Cell::GetNumericValue() const 
+{
+    if (Refresh()) 
+    {
+        return *impl_->GetReadyValue();
+    }
+
+    return impl_->GetNumericValue();
+}
+
+void Cell::UpdateNumericColumns() const 
+{
+    if (NumericColumns* columns = sheet_.GetNumericColumns()) 
+    {
+        const NumericValue* value = impl_->GetReadyValue();
+        const double* number = value ? std::get_if<double>(value) : nullptr;
+
+        // Число формулы со входами устаревает после следующей правки листа
+        if (number && !referenced_by_.IsEmpty()) 
+        {
+            columns->SetDependent(pos_, *number, verified_at_);
+        }
+
+        else if (number) 
+        {
+            columns->Set(pos_, *number);
+        }
+
+        else 
+        {
+            columns->Reset(pos_);
+        }
+    }
+}
+
 // Возвращает текстовое представление текущей ячейки
 std::string Cell::GetText() const 
 {
     return impl_->GetText();
 }
 
+void Cell::AppendText(std::string& output) const 
+{
+    impl_->AppendText(output);
+}
+
+void Cell::AppendValue(std::string& output, const std::ostream& format) const 
+{
+    if (Refresh()) 
+    {
+        AppendFormulaValue(output, *impl_->GetReadyValue(), format);
+        return;
+    }
+
+    impl_->AppendValue(output, format);
+}
+
+void Cell::AppendFormulaValue(std::string& output, const NumericValue& value, const std::ostream& format) 
+{
+    if (const double* number = std::get_if<double>(&value)) 
+    {
+        AppendNumber(output, *number, format);
+    }
+
+    else 
+    {
+        output += std::get<FormulaError>(value).ToString();
+    }
+}
+
 // Возвращает список ячеек, на которые ссылается текущая ячейка
 std::vector<Position> Cell::GetReferencedCells() const 
 {
     return impl_->GetReferencedCells();
 }
 
+// Проверяет, что текст ячейки пуст
+bool Cell::IsEmpty() const 
+{
+    return impl_->IsEmpty();
+}
+
+// Проверяет, что значение ячейки может быть устаревшим: у формулы нет значения
+// либо её входы ещё не проверены после последней правки листа
+bool Cell::IsDirty() const 
+{
+    return !impl_->IsCacheValid() || (verified_at_ != sheet_.GetEpoch() && !referenced_by_.IsEmpty());
+}
+
+// Проверяет значение ячейки и при необходимости вычисляет его заново
+bool Cell::Recalculate() 
+{
+    return Refresh();
+}
+
+// Возвращает ячейки, которые ссылаются на текущую
+const CellEdges& Cell::GetReferencingCells() const 
+{
+    return referenced_to_;
+}
+
 // Проверяет, ссылается ли текущая ячейка на другие
 bool Cell::IsReferenced() const 
 {
-    return !referenced_to_.empty();
+    return !referenced_to_.IsEmpty();
 }
\ No newline at end of file
@@ -1,41 +1,171 @@
 #pragma once
 
+#include "cell_edges.h"
 #include "common.h"
 #include "formula.h"
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <exception>
 #include <functional>
+#include <iosfwd>
 #include <optional>
-#include <unordered_set>
+#include <string>
+#include <utility>
+#include <vector>
 
 inline const std::string EMPTY = "";
 
-class Cell : public CellInterface 
+class FormulaAST;
+class Sheet;
+class SheetSnapshot;
+class ThreadPool;
+
+// Дописывает в output число так, как его вывел бы поток format: с его точностью
+// и форматом (general, fixed или scientific). Выделяет память, только если
+// формат нельзя передать std::to_chars
+void AppendNumber(std::string& output, double number, const std::ostream& format);
+
+// Счётчики обращений к кэшу значений формул
+struct CacheStatistics
+{
+    // Значение возвращено из кэша
+    std::size_t hits = 0;
+    // Значение пришлось вычислить заново
+    std::size_t misses = 0;
+};
+
+// Накопитель статистики кэша, безопасный при параллельном пересчёте.
+// Счётчики разбиты на части по потокам, чтобы потоки не делили одну линию кэша
+class CacheCounters
+{
+    public:
+
+        void CountHit() 
+        {
+            shards_[ShardIndex()].hits.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void CountMiss() 
+        {
+            shards_[ShardIndex()].misses.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        CacheStatistics Get() const;
+        void Reset();
+
+    private:
+
+        static constexpr std::size_t SHARD_COUNT = 16;
+
+        struct alignas(64) Shard 
+        {
+            std::atomic<std::size_t> hits = 0;
+            std::atomic<std::size_t> misses = 0;
+        };
+
+        static std::size_t ShardIndex();
+
+        std::array<Shard, SHARD_COUNT> shards_;
+};
+
+// Выдаёт метки топологического порядка ячеек: метка ячейки больше меток всех
+// ячеек, на которые она ссылается. Ячейку без входов можно поставить ниже всех,
+// ячейку без зависимых - выше всех
+class OrderLabels
+{
+    public:
+
+        std::int64_t Lowest() 
+        {
+            return --lowest_;
+        }
+
+        std::int64_t Highest() 
+        {
+            return ++highest_;
+        }
+
+    private:
+
+        friend class SheetSnapshot;
+
+        std::int64_t lowest_ = 0;
+        std::int64_t highest_ = 0;
+};
+
+class Cell final : public CellInterface 
 {
     public:
 
-        Cell(SheetInterface& sheet);
+        Cell(Sheet& sheet, Position pos);
         ~Cell();
 
         void Set(std::string text);
         void Clear();
         Value GetValue() const override;
+        NumericValue GetNumericValue() const override;
         std::string GetText() const override;
+        // Дописывают текст (значение) ячейки в output без промежуточных строк.
+        // Числа форматируются по настройкам потока format (см. AppendNumber)
+        void AppendText(std::string& output) const;
+        void AppendValue(std::string& output, const std::ostream& format) const;
+        bool IsEmpty() const;
         bool IsReferenced() const;
+
+        // Проверяет, что значение формулы может требовать пересчёта
+        bool IsDirty() const;
+        // Проверяет значение формулы и вычисляет его, если входы изменились.
+        // Ячейки, на которые она ссылается, должны быть уже проверены.
+        // Возвращает true, если формула была вычислена
+        bool Recalculate();
+        // Записывает значение ячейки в хранилище чисел листа, если оно включено.
+        // Формула без значения записывается как не число
+        void UpdateNumericColumns() const;
+        // Ячейки, которые ссылаются на данную
+        const CellEdges& GetReferencingCells() const;
         std::vector<Position> GetReferencedCells() const override;
 
+        // Устанавливает содержимое нескольких ячеек одной таблицы.
+        // Возвращает для каждой записи исключение, помешавшее установке
+        // (FormulaException или CircularDependencyException), либо nullptr.
+        // Ячейки с ошибкой сохраняют прежнее содержимое. Если ячейка встречается
+        // несколько раз, действует последний текст, а указатель ячейки в более
+        // ранних записях обнуляется. Если передан pool, тексты разбираются в нём
+        static std::vector<std::exception_ptr> SetBatch(std::vector<std::pair<Cell*, std::string>>& batch, 
+                                                        ThreadPool* pool = nullptr);
+        // Находит устаревшие формулы среди ячеек changed и зависящих от них.
+        // changed должен содержать все ячейки, изменённые после того, как
+        // значения всех формул были проверены: тогда входы найденных формул,
+        // не зависящие от changed, не устарели и отмечаются проверенными.
+        // Найденные формулы можно пересчитывать через Recalculate
+        static std::vector<Cell*> FindStale(const std::vector<Cell*>& changed);
+
     private:
 
+        // Снимок читает и восстанавливает содержимое, связи и метки ячеек напрямую
+        friend class SheetSnapshot;
+
         class Impl 
         {
             public:
             
                 virtual ~Impl() = default;
                 virtual Value GetValue() const = 0;
-                virtual std::string GetText() const = 0;
+                virtual NumericValue GetNumericValue() const = 0;
+                virtual const std::string& GetText() const = 0;
+                virtual void AppendText(std::string& output) const = 0;
+                virtual void AppendValue(std::string& output, const std::ostream& format) const = 0;
                 virtual std::vector<Position> GetReferencedCells() const 
                 { 
                     return {}; 
                 }
+
+                virtual bool IsEmpty() const 
+                { 
+                    return false; 
+                }
                 
                 virtual bool IsCacheValid() const 
                 { 
@@ -43,6 +173,19 @@ class Cell : public CellInterface
                 }
                 
                 virtual void InvalidateCache() {}
+
+                // Находит ячейки, на которые ссылается содержимое. Возвращает
+                // false, если какой-то корректной позиции нет ячейки
+                virtual bool BindInputs(const Sheet&) 
+                {
+                    return true;
+                }
+
+                // Значение, которое не требует вычисления, либо nullptr
+                virtual const NumericValue* GetReadyValue() const 
+                {
+                    return nullptr;
+                }
         };
 
         class EmptyImpl : public Impl 
@@ -53,11 +196,24 @@ class Cell : public CellInterface
                 { 
                     return EMPTY; 
                 }
+
+                NumericValue GetNumericValue() const override 
+                { 
+                    return 0.0; 
+                }
                 
-                std::string GetText() const override 
+                const std::string& GetText() const override 
                 { 
                     return EMPTY; 
                 }
+
+                void AppendText(std::string&) const override {}
+                void AppendValue(std::string&, const std::ostream&) const override {}
+
+                bool IsEmpty() const override 
+                { 
+                    return true; 
+                }
         };
 
         class TextImpl : public Impl 
@@ -71,9 +227,17 @@ class Cell : public CellInterface
                         throw std::logic_error("Empty"); 
                     }
 
-                    text_ = text;
+                    text_ = std::move(text);
+                    // Число разбирается один раз при установке текста
+                    number_ = ParseCellNumber(text_[0] == ESCAPE_SIGN ? text_.substr(1) : text_);
                 }
 
+                // Текст с уже разобранным числом
+                TextImpl(std::string text, NumericValue number)
+                    : text_(std::move(text))
+                    , number_(number) 
+                    {}
+
                 Value GetValue() const override 
                 {
                     if (text_[0] == ESCAPE_SIGN) 
@@ -84,39 +248,71 @@ class Cell : public CellInterface
                     return text_;
                 }
 
-                std::string GetText() const override 
+                NumericValue GetNumericValue() const override 
+                {
+                    return number_;
+                }
+
+                const NumericValue* GetReadyValue() const override 
+                {
+                    return &number_;
+                }
+
+                const std::string& GetText() const override 
                 {
                     return text_;
                 }
 
+                void AppendText(std::string& output) const override 
+                {
+                    output += text_;
+                }
+
+                void AppendValue(std::string& output, const std::ostream&) const override 
+                {
+                    output.append(text_, text_[0] == ESCAPE_SIGN ? 1 : 0);
+                }
+
             private:
             
                 std::string text_;
+                // Текст, трактуемый как число, либо ошибка #VALUE!
+                NumericValue number_ = 0.0;
         };
 
         class FormulaImpl : public Impl 
         {
             public:
             
-                explicit FormulaImpl(std::string expression, const SheetInterface& sheet)
-                    : sheet_(sheet) 
+                // Формула ячейки pos; разобранное выражение берётся из таблицы formulas
+                explicit FormulaImpl(std::string expression, Position pos, FormulaTable& formulas, 
+                                     CacheCounters& statistics)
+                    : statistics_(statistics)
                     {
                         if (expression.empty() || expression[0] != FORMULA_SIGN) 
                         {
                             throw std::logic_error("");
                         }
 
-                            formula_ptr_ = ParseFormula(expression.substr(1));
+                            formula_ptr_ = formulas.Parse(expression.substr(1), pos);
+                            ast_ = formula_ptr_->GetAST().get();
+                            // Канонический текст печатается один раз, при разборе
+                            text_ = FORMULA_SIGN + formula_ptr_->GetExpression();
                     }
 
+                // Готовая формула со значением из кэша, если оно есть
+                FormulaImpl(std::unique_ptr<FormulaInterface> formula, CacheCounters& statistics, 
+                            std::optional<FormulaInterface::Value> cache)
+                    : formula_ptr_(std::move(formula))
+                    , ast_(formula_ptr_->GetAST().get())
+                    , statistics_(statistics)
+                    , cache_(std::move(cache)) 
+                    , text_(FORMULA_SIGN + formula_ptr_->GetExpression()) 
+                    {}
+
                 Value GetValue() const override 
                 {
-                    auto value = formula_ptr_->Evaluate(sheet_);
-
-                    if (!cache_.has_value())
-                    {
-                        cache_ = value;
-                    }
+                    auto value = GetNumericValue();
 
                     if (std::holds_alternative<double>(value))
                     {
@@ -129,9 +325,36 @@ class Cell : public CellInterface
                     }
                 }
 
-                std::string GetText() const override 
+                NumericValue GetNumericValue() const override 
+                {
+                    // Пока кэш валиден, формула не пересчитывается
+                    if (cache_.has_value())
+                    {
+                        statistics_.CountHit();
+                    }
+
+                    else
+                    {
+                        statistics_.CountMiss();
+                        cache_ = Evaluate();
+                    }
+
+                    return *cache_;
+                }
+
+                const std::string& GetText() const override 
+                {
+                    return text_;
+                }
+
+                void AppendText(std::string& output) const override 
+                {
+                    output += text_;
+                }
+
+                void AppendValue(std::string& output, const std::ostream& format) const override 
                 {
-                    return FORMULA_SIGN + formula_ptr_->GetExpression();
+                    AppendFormulaValue(output, GetNumericValue(), format);
                 }
 
                 bool IsCacheValid() const override 
@@ -144,30 +367,80 @@ class Cell : public CellInterface
                     cache_.reset();
                 }
 
+                const NumericValue* GetReadyValue() const override 
+                {
+                    return cache_ ? &*cache_ : nullptr;
+                }
+
                 std::vector<Position> GetReferencedCells() const override
                 {
                     return formula_ptr_->GetReferencedCells();
                 }
 
+                bool BindInputs(const Sheet& sheet) override;
+
+                const FormulaInterface& GetFormula() const 
+                {
+                    return *formula_ptr_;
+                }
+
+                const std::optional<FormulaInterface::Value>& GetCache() const 
+                {
+                    return cache_;
+                }
+
             private:
+
+                FormulaInterface::Value Evaluate() const;
             
                 std::unique_ptr<FormulaInterface> formula_ptr_;
-                const SheetInterface& sheet_;
+                // Дерево формулы; им владеет formula_ptr_
+                const FormulaAST* ast_;
+                // Ячейки, на которые ссылается формула, в порядке FormulaAST::GetCells().
+                // nullptr - ссылка за пределы таблицы. Находятся один раз при связывании
+                // ячейки с её входами и не меняют адрес, пока на них есть ссылка
+                std::vector<const Cell*> inputs_;
+                CacheCounters& statistics_;
                 // Если кэш валидный, optional хранит Value
                 mutable std::optional<FormulaInterface::Value> cache_;
+                // Канонический текст формулы со знаком FORMULA_SIGN
+                std::string text_;
         };
  
         // Добавьте поля и методы для связи с таблицей, проверки циклических 
         // зависимостей, графа зависимостей и т. д.
-        bool IsCircularDependency(const Impl& impl) const;
-        void UpdateDependence();
-        void InvalidateCache();
+        std::unique_ptr<Impl> MakeImpl(std::string text) const;
+        static std::vector<std::vector<Cell*>> FindCycles(const std::vector<Cell*>& cells);
+        static void Link(Cell* dependent, Cell* input);
+        static void Unlink(Cell* dependent, std::size_t index);
+        void UnlinkInputs();
+        bool AddReference(Cell* cell);
+        bool Reorder(Cell* cell);
+        void RemoveReference(Cell* cell);
+        void UpdateDependence(const std::vector<Position>& referenced_cells);
+        bool IsVerified() const;
+        bool Refresh() const;
+        void RefreshInputs() const;
+        bool RefreshSelf() const;
+        static void AppendFormulaValue(std::string& output, const NumericValue& value, const std::ostream& format);
 
         std::unique_ptr<Impl> impl_;
-        SheetInterface& sheet_;
+        Sheet& sheet_;
+        // Позиция ячейки в таблице
+        Position pos_;
+        // Метка топологического порядка (см. OrderLabels)
+        std::int64_t order_;
+        // Отметка обхода графа при переупорядочивании
+        bool visited_ = false;
+        // Число ещё не упорядоченных входов при пакетной установке (см. SetBatch)
+        std::uint32_t pending_inputs_ = 0;
+        // Правка листа, после которой значение ячейки последний раз изменилось,
+        // и правка, при которой значение формулы последний раз проверено (см. Refresh)
+        mutable std::uint64_t changed_at_ = 0;
+        mutable std::uint64_t verified_at_ = 0;
 
-        // Контейнер указателей ячеек, на которые ссылается данная ячейка (поиск циклических зависимостей)
-        std::unordered_set<Cell*> referenced_to_;
-        // Контейнер указателей ячеек, которые ссылаются на данную ячейку (инвалидация кеша)
-        std::unordered_set<Cell*> referenced_by_;
+        // Ячейки, которые ссылаются на данную (зависимые)
+        CellEdges referenced_to_;
+        // Ячейки, на которые ссылается данная (входы)
+        CellEdges referenced_by_;
 };
\ No newline at end of file
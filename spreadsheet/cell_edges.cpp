@@ -0,0 +1,38 @@
+#include "cell_edges.h"
+
+#include <algorithm>
+#include <cstring>
+
+CellEdges::~CellEdges() 
+{
+    if (!IsInline()) 
+    {
+        delete[] heap_;
+    }
+}
+
+bool CellEdges::Contains(const Cell* cell) const 
+{
+    const Edge* data = Data();
+
+    return std::any_of(data, data + size_, [cell](const Edge& edge) { return edge.cell == cell; });
+}
+
+void CellEdges::Reserve(std::size_t capacity) 
+{
+    if (capacity <= capacity_) 
+    {
+        return;
+    }
+
+    Edge* grown = new Edge[capacity];
+    std::memcpy(grown, Data(), size_ * sizeof(Edge));
+
+    if (!IsInline()) 
+    {
+        delete[] heap_;
+    }
+
+    heap_ = grown;
+    capacity_ = static_cast<std::uint32_t>(capacity);
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+
+class Cell;
+
+// Список связей ячейки в графе зависимостей. Первые INLINE_CAPACITY связей
+// хранятся в самом списке, поэтому у большинства ячеек связи не занимают
+// отдельной памяти; остальные лежат в непрерывном массиве, растущем вдвое.
+// Каждая связь хранится у обеих ячеек и помнит номер парной записи в списке
+// другой ячейки, поэтому её удаление не ищет пару (см. Cell::Unlink)
+class CellEdges 
+{
+    public:
+
+        static constexpr std::uint32_t INLINE_CAPACITY = 2;
+
+        struct Edge 
+        {
+            Cell* cell;
+            // Номер парной записи в списке ячейки cell
+            std::uint32_t mirror;
+        };
+
+        // Итератор по ячейкам списка
+        class Iterator 
+        {
+            public:
+
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = Cell*;
+                using difference_type = std::ptrdiff_t;
+                using pointer = Cell* const*;
+                using reference = Cell* const&;
+
+                Iterator() = default;
+
+                explicit Iterator(const Edge* edge)
+                    : edge_(edge) 
+                    {
+                    }
+
+                reference operator*() const 
+                {
+                    return edge_->cell;
+                }
+
+                Iterator& operator++() 
+                {
+                    ++edge_;
+
+                    return *this;
+                }
+
+                Iterator operator++(int) 
+                {
+                    Iterator result = *this;
+                    ++edge_;
+
+                    return result;
+                }
+
+                bool operator==(const Iterator& other) const 
+                {
+                    return edge_ == other.edge_;
+                }
+
+                bool operator!=(const Iterator& other) const 
+                {
+                    return edge_ != other.edge_;
+                }
+
+            private:
+
+                const Edge* edge_ = nullptr;
+        };
+
+        CellEdges() = default;
+        CellEdges(const CellEdges&) = delete;
+        CellEdges& operator=(const CellEdges&) = delete;
+        ~CellEdges();
+
+        Iterator begin() const 
+        {
+            return Iterator(Data());
+        }
+
+        Iterator end() const 
+        {
+            return Iterator(Data() + size_);
+        }
+
+        std::size_t Size() const 
+        {
+            return size_;
+        }
+
+        bool IsEmpty() const 
+        {
+            return size_ == 0;
+        }
+
+        Edge& operator[](std::size_t index) 
+        {
+            return Data()[index];
+        }
+
+        const Edge& operator[](std::size_t index) const 
+        {
+            return Data()[index];
+        }
+
+        bool Contains(const Cell* cell) const;
+
+        void PushBack(Edge edge) 
+        {
+            if (size_ == capacity_) 
+            {
+                Reserve(2 * static_cast<std::size_t>(capacity_));
+            }
+
+            Data()[size_++] = edge;
+        }
+
+        // Переносит последнюю связь на место index. Возвращает false, если
+        // удалена сама последняя связь и переносить было нечего
+        bool MoveBackTo(std::size_t index) 
+        {
+            Edge* data = Data();
+            data[index] = data[--size_];
+
+            return index != size_;
+        }
+
+        void Reserve(std::size_t capacity);
+
+    private:
+
+        bool IsInline() const 
+        {
+            return capacity_ == INLINE_CAPACITY;
+        }
+
+        Edge* Data() 
+        {
+            return IsInline() ? inline_ : heap_;
+        }
+
+        const Edge* Data() const 
+        {
+            return IsInline() ? inline_ : heap_;
+        }
+
+        std::uint32_t size_ = 0;
+        std::uint32_t capacity_ = INLINE_CAPACITY;
+
+        union 
+        {
+            Edge inline_[INLINE_CAPACITY];
+            Edge* heap_;
+        };
+};
@@ -0,0 +1,222 @@
+#include "cell_storage.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace 
+{
+    // Количество значащих битов в номере ячейки
+    int BitWidth(unsigned value) 
+    {
+        int width = 0;
+
+        for (int shift = 8; shift > 0; shift /= 2) 
+        {
+            if (value >> shift) 
+            {
+                value >>= shift;
+                width += shift;
+            }
+        }
+
+        return width + static_cast<int>(value);
+    }
+
+    // Массив 0 хранит ячейку с номером 0, массив k > 0 - номера с 2^(k-1) по 2^k - 1,
+    // так что блок из 4096 ячеек занимает ровно 4096 элементов
+    std::pair<int, int> Locate(std::uint16_t index) 
+    {
+        int chunk = BitWidth(index);
+        return { chunk, chunk == 0 ? 0 : index - (1 << (chunk - 1)) };
+    }
+} // end of namespace
+
+auto CellStorage::Block::FindSparse(int slot) const -> SparseSlots::const_iterator 
+{
+    return std::lower_bound(sparse_slots_.begin(), sparse_slots_.end(), slot, [](const auto& entry, int value) 
+    { 
+        return entry.first < value; 
+    });
+}
+
+std::optional<Cell>* CellStorage::Block::Find(int slot) const 
+{
+    if (dense_slots_) 
+    {
+        return (*dense_slots_)[slot];
+    }
+
+    auto it = FindSparse(slot);
+
+    return it != sparse_slots_.end() && it->first == slot ? it->second : nullptr;
+}
+
+void CellStorage::Block::SetSlot(int slot, std::optional<Cell>* cell) 
+{
+    if (dense_slots_) 
+    {
+        (*dense_slots_)[slot] = cell;
+        return;
+    }
+
+    if (!cell) 
+    {
+        auto it = FindSparse(slot);
+        assert(it != sparse_slots_.end() && it->first == slot);
+        sparse_slots_.erase(it);
+    } 
+    
+    else if (sparse_slots_.size() < SPARSE_LIMIT) 
+    {
+        sparse_slots_.emplace(FindSparse(slot), static_cast<std::uint16_t>(slot), cell);
+    } 
+    
+    else 
+    {
+        // Блок заполнился: переходим на полную таблицу слотов
+        dense_slots_ = std::make_unique<std::array<std::optional<Cell>*, BLOCK_CELLS>>();
+        dense_slots_->fill(nullptr);
+
+        for (auto [sparse_slot, sparse_cell] : sparse_slots_) 
+        {
+            (*dense_slots_)[sparse_slot] = sparse_cell;
+        }
+
+        (*dense_slots_)[slot] = cell;
+        sparse_slots_ = {};
+    }
+}
+
+std::optional<Cell>& CellStorage::Block::Emplace(int slot) 
+{
+    assert(!Find(slot));
+
+    std::optional<Cell>* cell;
+
+    // Сначала используем освободившиеся ячейки
+    if (!free_.empty()) 
+    {
+        cell = free_.back();
+        free_.pop_back();
+    } 
+    
+    else 
+    {
+        auto [chunk, offset] = Locate(used_++);
+
+        if (chunk == static_cast<int>(chunks_.size())) 
+        {
+            chunks_.push_back(std::make_unique<std::optional<Cell>[]>(chunk == 0 ? 1 : std::size_t{1} << (chunk - 1)));
+        }
+
+        cell = &chunks_[chunk][offset];
+    }
+
+    SetSlot(slot, cell);
+
+    return *cell;
+}
+
+void CellStorage::Block::Erase(int slot) 
+{
+    std::optional<Cell>* cell = Find(slot);
+    assert(cell);
+
+    cell->reset();
+    free_.push_back(cell);
+    SetSlot(slot, nullptr);
+}
+
+int CellStorage::Block::Size() const 
+{
+    return used_ - static_cast<int>(free_.size());
+}
+
+int CellStorage::SlotIndex(Position pos) 
+{
+    return (pos.row % BLOCK_SIZE) * BLOCK_SIZE + pos.col % BLOCK_SIZE;
+}
+
+const Cell* CellStorage::Get(Position pos) const 
+{
+    assert(pos.IsValid());
+
+    const auto& block_row = directory_[pos.row / BLOCK_SIZE];
+
+    if (!block_row) 
+    {
+        return nullptr;
+    }
+
+    const auto& block = (*block_row)[pos.col / BLOCK_SIZE];
+
+    if (!block) 
+    {
+        return nullptr;
+    }
+
+    const std::optional<Cell>* cell = block->Find(SlotIndex(pos));
+
+    return cell ? &**cell : nullptr;
+}
+
+Cell* CellStorage::Get(Position pos) 
+{
+    return const_cast<Cell*>(std::as_const(*this).Get(pos));
+}
+
+Cell& CellStorage::Emplace(Position pos, Sheet& sheet) 
+{
+    assert(pos.IsValid() && !Get(pos));
+
+    auto& block_row = directory_[pos.row / BLOCK_SIZE];
+
+    if (!block_row) 
+    {
+        block_row = std::make_unique<BlockRow>();
+    }
+
+    auto& block = (*block_row)[pos.col / BLOCK_SIZE];
+
+    if (!block) 
+    {
+        block = std::make_unique<Block>();
+    }
+
+    ++size_;
+
+    return block->Emplace(SlotIndex(pos)).emplace(sheet, pos);
+}
+
+void CellStorage::Erase(Position pos) 
+{
+    assert(pos.IsValid());
+
+    auto& block_row = directory_[pos.row / BLOCK_SIZE];
+
+    if (!block_row) 
+    {
+        return;
+    }
+
+    auto& block = (*block_row)[pos.col / BLOCK_SIZE];
+
+    if (!block || !block->Find(SlotIndex(pos))) 
+    {
+        return;
+    }
+
+    block->Erase(SlotIndex(pos));
+    --size_;
+
+    // Блок без ячеек освобождаем целиком
+    if (block->Size() == 0) 
+    {
+        block.reset();
+    }
+}
+
+std::size_t CellStorage::Size() const 
+{
+    return size_;
+}
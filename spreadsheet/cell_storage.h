@@ -0,0 +1,147 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Разреженное хранилище ячеек таблицы.
+// Таблица разбита на блоки BLOCK_SIZE x BLOCK_SIZE, блок создаётся только при
+// появлении в нём первой ячейки. Блоки адресуются через двухуровневый каталог,
+// поэтому поиск ячейки выполняется за O(1), а занятая память пропорциональна
+// числу ячеек. Ячейки не меняют адрес до удаления.
+class CellStorage 
+{
+    public:
+
+        static constexpr int BLOCK_SIZE = 64;
+
+        // Возвращает ячейку по валидной позиции либо nullptr, если ячейки нет
+        const Cell* Get(Position pos) const;
+        Cell* Get(Position pos);
+        // Создаёт ячейку в позиции, где ячейки ещё нет
+        Cell& Emplace(Position pos, Sheet& sheet);
+        // Удаляет ячейку, если она есть
+        void Erase(Position pos);
+
+        // Возвращает количество ячеек
+        std::size_t Size() const;
+
+        // Вызывает func(Position, Cell&) для каждой ячейки
+        template <typename Func>
+        void ForEach(Func func) const;
+        template <typename Func>
+        void ForEach(Func func);
+
+    private:
+
+        static constexpr int BLOCK_ROWS = Position::MAX_ROWS / BLOCK_SIZE;
+        static constexpr int BLOCK_COLS = Position::MAX_COLS / BLOCK_SIZE;
+        static constexpr int BLOCK_CELLS = BLOCK_SIZE * BLOCK_SIZE;
+        // Число ячеек, после которого блок переходит на полную таблицу слотов
+        static constexpr std::size_t SPARSE_LIMIT = 128;
+
+        class Block 
+        {
+            public:
+
+                // Возвращает ячейку в слоте либо nullptr, если слот свободен
+                std::optional<Cell>* Find(int slot) const;
+
+                std::optional<Cell>& Emplace(int slot);
+                void Erase(int slot);
+
+                int Size() const;
+
+                template <typename Func>
+                void ForEach(Func func) const;
+
+            private:
+
+                using SparseSlots = std::vector<std::pair<std::uint16_t, std::optional<Cell>*>>;
+
+                SparseSlots::const_iterator FindSparse(int slot) const;
+                void SetSlot(int slot, std::optional<Cell>* cell);
+
+                // Пока ячеек мало, слоты хранятся списком пар (слот, ячейка), упорядоченным по слоту
+                SparseSlots sparse_slots_;
+                // Полная таблица слотов, создаётся при превышении SPARSE_LIMIT
+                std::unique_ptr<std::array<std::optional<Cell>*, BLOCK_CELLS>> dense_slots_;
+                // Ячейки лежат в массивах размером 1, 1, 2, 4, ... и не перемещаются при росте блока
+                std::vector<std::unique_ptr<std::optional<Cell>[]>> chunks_;
+                std::uint16_t used_ = 0;
+                // Освободившиеся ячейки для повторного использования
+                std::vector<std::optional<Cell>*> free_;
+        };
+
+        using BlockRow = std::array<std::unique_ptr<Block>, BLOCK_COLS>;
+
+        static int SlotIndex(Position pos);
+
+        std::array<std::unique_ptr<BlockRow>, BLOCK_ROWS> directory_;
+        std::size_t size_ = 0;
+};
+
+template <typename Func>
+void CellStorage::Block::ForEach(Func func) const 
+{
+    if (dense_slots_) 
+    {
+        for (int slot = 0; slot < BLOCK_CELLS; ++slot) 
+        {
+            if ((*dense_slots_)[slot]) 
+            {
+                func(slot, **(*dense_slots_)[slot]);
+            }
+        }
+    } 
+    
+    else 
+    {
+        for (auto [slot, cell] : sparse_slots_) 
+        {
+            func(slot, **cell);
+        }
+    }
+}
+
+template <typename Func>
+void CellStorage::ForEach(Func func) const 
+{
+    for (int block_row = 0; block_row < BLOCK_ROWS; ++block_row) 
+    {
+        if (!directory_[block_row]) 
+        {
+            continue;
+        }
+
+        for (int block_col = 0; block_col < BLOCK_COLS; ++block_col) 
+        {
+            const auto& block = (*directory_[block_row])[block_col];
+
+            if (!block) 
+            {
+                continue;
+            }
+
+            block->ForEach([&](int slot, const Cell& cell) 
+            {
+                func(Position{ block_row * BLOCK_SIZE + slot / BLOCK_SIZE, block_col * BLOCK_SIZE + slot % BLOCK_SIZE }, cell);
+            });
+        }
+    }
+}
+
+template <typename Func>
+void CellStorage::ForEach(Func func) 
+{
+    std::as_const(*this).ForEach([&func](Position pos, const Cell& cell) 
+    {
+        func(pos, const_cast<Cell&>(cell));
+    });
+}
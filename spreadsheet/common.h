@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstddef>
 #include <iosfwd>
+#include <limits>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -14,19 +16,135 @@ struct Position
     int row = 0;
     int col = 0;
 
-    bool operator==(Position rhs) const;
-    bool operator<(Position rhs) const;
+    constexpr bool operator==(Position rhs) const;
+    constexpr bool operator<(Position rhs) const;
 
-    bool IsValid() const;
+    constexpr bool IsValid() const;
     std::string ToString() const;
+    // Записывает позицию (A1, B2 и т. п.) в буфер out, в котором должно быть
+    // место для MAX_STRING_LENGTH символов. Возвращает указатель за последним
+    // записанным символом. Невалидная позиция не записывается
+    constexpr char* ToChars(char* out) const;
 
-    static Position FromString(std::string_view str);
+    // Разбирает позицию без выделения памяти. Возвращает NONE, если строка
+    // не имеет вида <буквы столбца><номер строки>
+    static constexpr Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    // Длина записи самой длинной валидной позиции (XFD16384)
+    static const std::size_t MAX_STRING_LENGTH = 8;
     static const Position NONE;
+
+    private:
+
+        static const int LETTERS = 26;
+        static const std::size_t MAX_LETTER_COUNT = 3;
 };
 
+inline constexpr Position Position::NONE = { -1, -1 };
+
+constexpr bool Position::operator==(const Position rhs) const 
+{
+    return row == rhs.row && col == rhs.col;
+}
+
+constexpr bool Position::operator<(const Position rhs) const 
+{
+    return row < rhs.row || (row == rhs.row && col < rhs.col);
+}
+
+// Проверяет, что ячейка (row, col) не выходит за ограничения таблицы
+// и что значения полей row и col неотрицательны. Position::NONE невалидна
+constexpr bool Position::IsValid() const 
+{
+    return row >= 0 && row < MAX_ROWS && col >= 0 && col < MAX_COLS;
+}
+
+// Цифры и буквы пишутся с конца: сначала считается длина записи
+constexpr char* Position::ToChars(char* out) const 
+{
+    if (!IsValid()) 
+    {
+        return out;
+    }
+
+    std::size_t letters = 0;
+
+    for (int columns = col; columns >= 0; columns = columns / LETTERS - 1) 
+    {
+        ++letters;
+    }
+
+    std::size_t digits = 0;
+
+    for (int rows = row + 1; rows > 0; rows /= 10) 
+    {
+        ++digits;
+    }
+
+    char* end = out + letters + digits;
+    char* next = end;
+
+    for (int rows = row + 1; rows > 0; rows /= 10) 
+    {
+        *--next = static_cast<char>('0' + rows % 10);
+    }
+
+    // Номер столбца в буквах (0 -> A, 25 -> Z, 26 -> AA и т. д.)
+    for (int columns = col; columns >= 0; columns = columns / LETTERS - 1) 
+    {
+        *--next = static_cast<char>('A' + columns % LETTERS);
+    }
+
+    return end;
+}
+
+constexpr Position Position::FromString(std::string_view str) 
+{
+    std::size_t letters = 0;
+
+    while (letters < str.size() && str[letters] >= 'A' && str[letters] <= 'Z') 
+    {
+        ++letters;
+    }
+
+    if (letters == 0 || letters > MAX_LETTER_COUNT || letters == str.size()) 
+    {
+        return NONE;
+    }
+
+    // Номер строки без знака; переполнение int делает позицию невалидной
+    int row = 0;
+
+    for (std::size_t i = letters; i < str.size(); ++i) 
+    {
+        if (str[i] < '0' || str[i] > '9') 
+        {
+            return NONE;
+        }
+
+        const int digit = str[i] - '0';
+
+        if (row > (std::numeric_limits<int>::max() - digit) / 10) 
+        {
+            return NONE;
+        }
+
+        row = row * 10 + digit;
+    }
+
+    int col = 0;
+
+    // Буквы - цифры столбца в 26-ричной записи без нуля (A -> 1, Z -> 26)
+    for (std::size_t i = 0; i < letters; ++i) 
+    {
+        col = col * LETTERS + (str[i] - 'A' + 1);
+    }
+
+    return { row - 1, col - 1 };
+}
+
 struct Size 
 {
     int rows = 0;
@@ -93,6 +211,8 @@ class CellInterface
     public:
         // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из формулы
         using Value = std::variant<std::string, double, FormulaError>;
+        // Значение ячейки, трактуемое как число: либо число, либо ошибка
+        using NumericValue = std::variant<double, FormulaError>;
 
         virtual ~CellInterface() = default;
 
@@ -105,6 +225,12 @@ class CellInterface
         // содержащий экранирующие символы). В случае формулы - её выражение.
         virtual std::string GetText() const = 0;
 
+        // Возвращает значение ячейки в том виде, в котором его использует формула,
+        // за одно обращение к ячейке. Текст, представляющий число, трактуется как
+        // число, пустой текст - как ноль, любой другой текст - как ошибка #VALUE!.
+        // Реализация по умолчанию разбирает результат GetValue().
+        virtual NumericValue GetNumericValue() const;
+
         // Возвращает список ячеек, которые непосредственно задействованы в данной
         // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
         // ячеек. В случае текстовой ячейки список пуст.
@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <iterator>
 #include <sstream>
 
 using namespace std::literals;
@@ -43,6 +44,40 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe)
     return output << fe.ToString();
 }
 
+FormulaInterface::Value ParseCellNumber(const std::string& text) 
+{
+    double result = 0;
+
+    if (!text.empty()) 
+    {
+        std::istringstream in(text);
+
+        if (!(in >> result) || !in.eof()) 
+        {
+            return FormulaError(FormulaError::Category::Value);
+        }
+    }
+
+    return result;
+}
+
+CellInterface::NumericValue CellInterface::GetNumericValue() const 
+{
+    auto value = GetValue();
+
+    if (std::holds_alternative<double>(value)) 
+    {
+        return std::get<double>(value);
+    }
+
+    if (std::holds_alternative<std::string>(value)) 
+    {
+        return ParseCellNumber(std::get<std::string>(value));
+    }
+
+    return std::get<FormulaError>(value);
+}
+
 namespace 
 {
     class Formula : public FormulaInterface 
@@ -50,7 +85,7 @@ namespace
         public:
 
             explicit Formula(std::string expression)
-                try : ast_(ParseFormulaAST(expression)) 
+                try : ast_(std::make_shared<const FormulaAST>(ParseFormulaAST(expression))) 
                     {}
 
                 catch (const std::exception& e) 
@@ -58,13 +93,21 @@ namespace
                     std::throw_with_nested(FormulaException(e.what()));
                 }
 
+            // Формула ячейки origin с разделяемым деревом, ссылки которого заданы относительно origin
+            Formula(std::shared_ptr<const FormulaAST> ast, Position origin)
+                : ast_(std::move(ast))
+                , origin_(origin) 
+                {}
+
             // Возвращает вычисленное значение формулы для переданного листа либо ошибку.
             // Если вычисление какой-то из указанных в формуле ячеек приводит к ошибке, то
             // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается любая.
             Value Evaluate(const SheetInterface& sheet) const override 
             {
-                const std::function<double(Position)> args = [&sheet](const Position p)->double 
+                const auto args = [&sheet, origin = origin_](const Position offset)->double 
                 {
+                    const Position p{ offset.row + origin.row, offset.col + origin.col };
+
                     if (!p.IsValid()) throw FormulaError(FormulaError::Category::Ref);
 
                     const auto* cell = sheet.GetCell(p);
@@ -74,35 +117,20 @@ namespace
                         return 0;
                     }
 
-                    if (std::holds_alternative<double>(cell->GetValue())) 
-                    {
-                        return std::get<double>(cell->GetValue());
-                    }
+                    // Значение ячейки запрашивается ровно один раз
+                    auto value = cell->GetNumericValue();
 
-                    if (std::holds_alternative<std::string>(cell->GetValue())) 
+                    if (std::holds_alternative<double>(value)) 
                     {
-                        auto value = std::get<std::string>(cell->GetValue());
-                        double result = 0;
-
-                        if (!value.empty()) 
-                        {
-                            std::istringstream in(value);
-
-                            if (!(in >> result) || !in.eof()) 
-                            {
-                                throw FormulaError(FormulaError::Category::Value);
-                            }
-                        }
-
-                        return result;
+                        return std::get<double>(value);
                     }
 
-                    throw FormulaError(std::get<FormulaError>(cell->GetValue()));
+                    throw std::get<FormulaError>(value);
                 };
 
                 try 
                 {
-                    return ast_.Execute(args);
+                    return ast_->Execute(args);
                 }
 
                 catch (FormulaError& e) 
@@ -117,32 +145,44 @@ namespace
             {
                 std::vector<Position> cells;
 
-                for (auto cell : ast_.GetCells()) 
+                for (auto offset : ast_->GetCells()) 
                 {
+                    const Position cell{ offset.row + origin_.row, offset.col + origin_.col };
+
                     if (cell.IsValid()) 
                     {
                         cells.push_back(cell);
                     }
                 }
 
-                cells.resize(std::unique(cells.begin(), cells.end()) - cells.begin());
-
                 return cells;
             }
 
             // Возвращает выражение, которое описывает формулу.
-            // Не содержит пробелов и лишних скобок.
+            // Не содержит пробелов и лишних скобок. Выражение печатается заново
+            // при каждом вызове, поэтому ячейка запрашивает его один раз, при разборе
             std::string GetExpression() const override 
             {
-                std::ostringstream out;
-                ast_.PrintFormula(out);
+                std::string expression;
+                ast_->PrintFormula(expression, origin_);
+
+                return expression;
+            }
+
+            const std::shared_ptr<const FormulaAST>& GetAST() const override 
+            {
+                return ast_;
+            }
 
-                return out.str();
+            Position GetOrigin() const override 
+            {
+                return origin_;
             }
 
         private:
 
-            const FormulaAST ast_;
+            std::shared_ptr<const FormulaAST> ast_;
+            Position origin_;
     };
 }  // end of namespace
 
@@ -159,4 +199,92 @@ std::unique_ptr<FormulaInterface> ParseFormula(std::string expression)
     {
         throw FormulaException("Formula exception");
     }
-}
\ No newline at end of file
+}
+
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position origin) 
+{
+    return std::make_unique<Formula>(std::move(ast), origin);
+}
+
+std::unique_ptr<FormulaInterface> FormulaTable::Parse(std::string expression, Position pos) 
+{
+    // Буфер для относительной записи формулы, свой у каждого потока
+    thread_local std::string key;
+
+    if (!WriteRelativeForm(expression, pos, key)) 
+    {
+        return ParseFormula(std::move(expression));
+    }
+
+    std::shared_ptr<const FormulaAST> ast;
+
+    {
+        std::lock_guard lock(mutex_);
+        auto it = formulas_.find(key);
+
+        if (it != formulas_.end()) 
+        {
+            ast = it->second.lock();
+        }
+    }
+
+    if (!ast) 
+    {
+        std::shared_ptr<const FormulaAST> parsed;
+
+        try 
+        {
+            parsed = std::make_shared<const FormulaAST>(ParseFormulaAST(expression, pos));
+        }
+
+        catch (...) 
+        {
+            throw FormulaException("Formula exception");
+        }
+
+        // Пока шёл разбор, ту же формулу мог добавить другой поток. Деревья
+        // совпадают, поэтому остаётся то, что попало в таблицу первым
+        std::lock_guard lock(mutex_);
+        auto& entry = formulas_[key];
+        ast = entry.lock();
+
+        if (!ast) 
+        {
+            entry = parsed;
+            ast = std::move(parsed);
+            ++parsed_;
+            RemoveExpired();
+        }
+    }
+
+    return std::make_unique<Formula>(std::move(ast), pos);
+}
+
+// Удаляет записи формул, которыми больше не пользуется ни одна ячейка.
+// Проверка выполняется, когда таблица вырастает вдвое
+void FormulaTable::RemoveExpired() 
+{
+    if (formulas_.size() < remove_expired_at_) 
+    {
+        return;
+    }
+
+    for (auto it = formulas_.begin(); it != formulas_.end();) 
+    {
+        it = it->second.expired() ? formulas_.erase(it) : std::next(it);
+    }
+
+    remove_expired_at_ = std::max(MIN_REMOVE_EXPIRED_AT, 2 * formulas_.size());
+}
+
+std::size_t FormulaTable::GetParsedCount() const 
+{
+    std::lock_guard lock(mutex_);
+    return parsed_;
+}
+
+std::size_t FormulaTable::Size() const 
+{
+    std::lock_guard lock(mutex_);
+    return formulas_.size();
+}
@@ -3,6 +3,11 @@
 #include "common.h"
 
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+class FormulaAST;
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
@@ -24,6 +29,47 @@ class FormulaInterface
         virtual Value Evaluate(const SheetInterface& sheet) const = 0;
         virtual std::string GetExpression() const = 0;
         virtual std::vector<Position> GetReferencedCells() const = 0;
+
+        // Возвращает дерево формулы, ссылки которого заданы относительно GetOrigin()
+        virtual const std::shared_ptr<const FormulaAST>& GetAST() const = 0;
+        virtual Position GetOrigin() const = 0;
+};
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Создаёт формулу ячейки origin по готовому дереву, ссылки которого заданы относительно origin
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position origin);
+
+// Таблица разобранных формул листа. Формулы, которые совпадают в относительной
+// записи ссылок (например, =A1*B1 в C1 и =A2*B2 в C2), разделяют одно дерево
+// и одну программу; каждая ячейка хранит только свою позицию
+class FormulaTable 
+{
+    public:
+
+        // Разбирает выражение формулы ячейки pos либо берёт готовое дерево из таблицы.
+        // Бросает FormulaException, как и ParseFormula. Может вызываться из
+        // нескольких потоков одновременно
+        std::unique_ptr<FormulaInterface> Parse(std::string expression, Position pos);
+
+        // Количество выполненных разборов
+        std::size_t GetParsedCount() const;
+        // Количество записей в таблице, включая ещё не удалённые неиспользуемые
+        std::size_t Size() const;
+
+    private:
+
+        static constexpr std::size_t MIN_REMOVE_EXPIRED_AT = 1024;
+
+        void RemoveExpired();
+
+        // Защищает таблицу и счётчики. Разбор выполняется без блокировки
+        mutable std::mutex mutex_;
+        std::unordered_map<std::string, std::weak_ptr<const FormulaAST>> formulas_;
+        std::size_t parsed_ = 0;
+        std::size_t remove_expired_at_ = MIN_REMOVE_EXPIRED_AT;
 };
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+// Трактует текст ячейки как число. Пустой текст считается нулём, текст,
+// не являющийся числом, - ошибкой #VALUE!
+FormulaInterface::Value ParseCellNumber(const std::string& text);
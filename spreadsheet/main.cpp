@@ -1,16 +1,28 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <functional>
 #include <limits>
+#include <map>
+#include <random>
+#include <set>
 #include "common.h"
 #include "formula.h"
+#include "FormulaAST.h"
+#include "sheet.h"
+#include "sheet_io.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
+#include "thread_pool.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) 
 {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
 
-inline Position operator"" _pos(const char* str, std::size_t) 
+constexpr Position operator"" _pos(const char* str, std::size_t size) 
 {
-    return Position::FromString(str);
+    return Position::FromString(std::string_view(str, size));
 }
 
 inline std::ostream& operator<<(std::ostream& output, Size size) 
@@ -54,6 +66,22 @@ namespace
         testSingle(Position{0, 702}, "AAA1");
         testSingle(Position{136, 2}, "C137");
         testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
+
+        // Преобразования выполняются при компиляции
+        static_assert("A1"_pos == Position{ 0, 0 });
+        static_assert("XFD16384"_pos == Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 });
+        static_assert(!"A0"_pos.IsValid() && !"a1"_pos.IsValid());
+
+        constexpr auto chars = [](Position pos) 
+        {
+            std::array<char, Position::MAX_STRING_LENGTH + 1> buffer{};
+            *pos.ToChars(buffer.data()) = '\0';
+
+            return buffer;
+        };
+
+        static_assert(std::string_view(chars("AB12"_pos).data()) == "AB12");
+        static_assert(std::string_view(chars(Position::NONE).data()).empty());
     }
 
     void TestPositionToStringInvalid() 
@@ -395,6 +423,1622 @@ namespace
         ASSERT(caught);
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
     }
+
+    void TestFormulaValueCache() 
+    {
+        Sheet sheet;
+        const int depth = 20;
+        sheet.SetCell("A1"_pos, "1");
+
+        for (int row = 1; row < depth; ++row) 
+        {
+            sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "+1");
+        }
+
+        const Position last{ depth - 1, 0 };
+
+        sheet.ResetCacheStatistics();
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(20.0));
+        ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 19u);
+        // Входы вычисляются раньше зависящих от них формул, поэтому каждая
+        // формула читает значение предыдущей формулы цепочки из кэша
+        ASSERT_EQUAL(sheet.GetCacheStatistics().hits, 18u);
+
+        // Повторное чтение и печать обслуживаются из кэша
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(20.0));
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 19u);
+        ASSERT_EQUAL(sheet.GetCacheStatistics().hits, 38u);
+
+        // Изменение исходной ячейки инвалидирует всю цепочку
+        sheet.SetCell("A1"_pos, "10");
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(29.0));
+        ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 38u);
+
+        // Замена формулы на формулу инвалидирует зависимые ячейки
+        sheet.SetCell("A10"_pos, "=A1");
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(20.0));
+    }
+
+    void TestCellNumericValue() 
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "3.5");
+        sheet->SetCell("A2"_pos, "'7");
+        sheet->SetCell("A3"_pos, "meow");
+        sheet->SetCell("A4"_pos, "=A1*2");
+        sheet->SetCell("A5"_pos, "=1/0");
+        sheet->SetCell("A6"_pos, "");
+
+        auto numeric = [&](Position pos) 
+        {
+            return sheet->GetCell(pos)->GetNumericValue();
+        };
+
+        using NumericValue = CellInterface::NumericValue;
+        ASSERT(numeric("A1"_pos) == NumericValue(3.5));
+        ASSERT(numeric("A2"_pos) == NumericValue(7.0));
+        ASSERT(numeric("A3"_pos) == NumericValue(FormulaError::Category::Value));
+        ASSERT(numeric("A4"_pos) == NumericValue(7.0));
+        ASSERT(numeric("A5"_pos) == NumericValue(FormulaError::Category::Arithmetic));
+        ASSERT(numeric("A6"_pos) == NumericValue(0.0));
+    }
+
+    void TestCellStorage() 
+    {
+        Sheet sheet;
+        CellStorage storage;
+
+        const std::vector<Position> positions = { "A1"_pos, "B1"_pos, "BM65"_pos, "XFD16384"_pos };
+
+        for (auto pos : positions) 
+        {
+            storage.Emplace(pos, sheet).Set("text");
+        }
+
+        ASSERT_EQUAL(storage.Size(), 4u);
+        ASSERT(storage.Get("C1"_pos) == nullptr);
+        ASSERT(storage.Get("XFD16383"_pos) == nullptr);
+        ASSERT_EQUAL(storage.Get("XFD16384"_pos)->GetText(), "text");
+
+        // Освободившийся элемент блока используется повторно, адреса остальных ячеек не меняются
+        const Cell* b1 = storage.Get("B1"_pos);
+        storage.Erase("A1"_pos);
+        ASSERT(storage.Get("A1"_pos) == nullptr);
+        storage.Emplace("A2"_pos, sheet);
+        ASSERT(storage.Get("B1"_pos) == b1);
+        ASSERT_EQUAL(storage.Size(), 4u);
+
+        std::vector<Position> visited;
+        storage.ForEach([&visited](Position pos, const Cell&) 
+        { 
+            visited.push_back(pos); 
+        });
+        std::sort(visited.begin(), visited.end());
+        ASSERT_EQUAL(visited, (std::vector{ "B1"_pos, "A2"_pos, "BM65"_pos, "XFD16384"_pos }));
+
+        // Заполненный блок переходит на полную таблицу слотов
+        CellStorage dense;
+        const int size = CellStorage::BLOCK_SIZE;
+
+        for (int i = 0; i < size * size; ++i) 
+        {
+            dense.Emplace({ i / size, i % size }, sheet).Set(std::to_string(i));
+        }
+
+        for (int i = 0; i < size * size; i += 2) 
+        {
+            dense.Erase({ i / size, i % size });
+        }
+
+        ASSERT_EQUAL(dense.Size(), static_cast<std::size_t>(size * size / 2));
+
+        for (int i = 0; i < size * size; ++i) 
+        {
+            const Cell* cell = dense.Get({ i / size, i % size });
+            ASSERT(i % 2 == 0 ? cell == nullptr : cell->GetText() == std::to_string(i));
+        }
+
+        // Дальняя ячейка не требует выделения промежуточных строк
+        sheet.SetCell("XFD16384"_pos, "far");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ Position::MAX_ROWS, Position::MAX_COLS }));
+        sheet.ClearCell("XFD16384"_pos);
+        ASSERT(sheet.GetCell("XFD16384"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+    }
+
+    void TestPrintableSizeUpdates() 
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("B3"_pos, "x");
+        sheet->SetCell("D2"_pos, "=B3");
+        sheet->SetCell("C5"_pos, "y");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 4}));
+
+        // Очистка внутренней ячейки не меняет границ
+        sheet->ClearCell("B3"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 4}));
+
+        // Пустой текст равносилен очистке
+        sheet->SetCell("C5"_pos, "");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 4}));
+
+        // Ячейки-заглушки для ссылок формул не попадают в область печати
+        sheet->SetCell("A1"_pos, "=Z100");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 4}));
+
+        // Неудачная установка формулы не меняет границ
+        try 
+        {
+            sheet->SetCell("Z100"_pos, "=A1");
+        } 
+        
+        catch (const CircularDependencyException&) {}
+
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 4}));
+
+        sheet->ClearCell("D2"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+        sheet->ClearCell("A1"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+    }
+
+    void TestRecalculateAll() 
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.SetCell("C1"_pos, "=A1*2");
+        sheet.SetCell("D1"_pos, "=B1+C1");
+        sheet.SetCell("E1"_pos, "=D1+Z1");
+        sheet.SetCell("A2"_pos, "=5");
+
+        sheet.ResetCacheStatistics();
+        ASSERT_EQUAL(sheet.RecalculateAll(), 5u);
+        ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 5u);
+        // Ссылки D1 -> B1, C1 и E1 -> D1 читают уже вычисленные значения
+        ASSERT_EQUAL(sheet.GetCacheStatistics().hits, 3u);
+        ASSERT_EQUAL(sheet.RecalculateAll(), 0u);
+
+        // Значения уже вычислены: чтение не требует пересчёта
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 5u);
+
+        // Пересчитываются только формулы, зависящие от изменённой ячейки
+        sheet.SetCell("C1"_pos, "=A1*3");
+        ASSERT_EQUAL(sheet.RecalculateAll(), 3u);
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(5.0));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        sheet.SetCell("A1"_pos, "meow");
+        ASSERT_EQUAL(sheet.RecalculateAll(), 4u);
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    }
+
+    void TestParallelRecalculation() 
+    {
+        const int rows = 300;
+        const int cols = 40;
+
+        auto fill = [&](Sheet& sheet) 
+        {
+            for (int row = 0; row < rows; ++row) 
+            {
+                sheet.SetCell({ row, 0 }, row % 17 == 0 ? "meow" : std::to_string(row));
+
+                for (int col = 1; col < cols; ++col) 
+                {
+                    std::string text = "=" + Position{ row, col - 1 }.ToString() + "*1.5-";
+                    text += row > 0 ? Position{ row - 1, col - 1 }.ToString() : "1";
+                    text += (row + col) % 13 == 0 ? "/0" : "/2";
+                    sheet.SetCell({ row, col }, std::move(text));
+                }
+            }
+        };
+
+        auto values = [](const Sheet& sheet) 
+        {
+            std::ostringstream out;
+            sheet.PrintValues(out);
+            return out.str();
+        };
+
+        Sheet serial;
+        Sheet parallel;
+        parallel.SetThreadCount(4);
+        fill(serial);
+        fill(parallel);
+
+        ASSERT_EQUAL(serial.RecalculateAll(), static_cast<std::size_t>(rows * (cols - 1)));
+        ASSERT_EQUAL(parallel.RecalculateAll(), static_cast<std::size_t>(rows * (cols - 1)));
+        ASSERT_EQUAL(serial.GetCacheStatistics().misses, parallel.GetCacheStatistics().misses);
+        ASSERT_EQUAL(values(serial), values(parallel));
+
+        for (auto* sheet : { &serial, &parallel }) 
+        {
+            sheet->SetCell("A5"_pos, "0.25");
+            sheet->SetCell("C100"_pos, "=A1+B2");
+        }
+
+        ASSERT_EQUAL(serial.RecalculateAll(), parallel.RecalculateAll());
+        ASSERT_EQUAL(values(serial), values(parallel));
+    }
+
+    void TestThreadPoolExceptions() 
+    {
+        ThreadPool pool(4);
+        std::atomic<int> done = 0;
+
+        for (int i = 0; i < 100; ++i) 
+        {
+            pool.Submit([&done, i] 
+            {
+                if (i % 10 == 3) 
+                {
+                    throw std::runtime_error("task failed");
+                }
+
+                ++done;
+            });
+        }
+
+        try 
+        {
+            pool.Wait();
+            ASSERT(false);
+        } 
+
+        catch (const std::runtime_error& e) 
+        {
+            ASSERT_EQUAL(std::string(e.what()), std::string("task failed"));
+        }
+
+        // Остальные задачи выполнены, а исключение брошено один раз
+        ASSERT_EQUAL(done.load(), 90);
+        pool.Submit([&done] { ++done; });
+        pool.Wait();
+        ASSERT_EQUAL(done.load(), 91);
+    }
+
+    void TestIncrementalCycleDetection() 
+    {
+        // Цепочка, заполненная снизу вверх, требует переупорядочивания меток
+        Sheet sheet;
+        const int depth = 200;
+
+        for (int row = depth - 1; row > 0; --row) 
+        {
+            sheet.SetCell({ row, 0 }, "=" + Position{ row - 1, 0 }.ToString() + "+1");
+        }
+
+        sheet.SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell({ depth - 1, 0 })->GetValue()), static_cast<double>(depth));
+        ASSERT_EQUAL(sheet.RecalculateAll(), 0u);
+
+        bool caught = false;
+        try 
+        {
+            sheet.SetCell("A1"_pos, "=A" + std::to_string(depth) + "+B1");
+        } 
+        
+        catch (const CircularDependencyException&) 
+        {
+            caught = true;
+        }
+
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+        // Неудачная установка не оставляет ссылок и пустых ячеек
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+        ASSERT(!sheet.GetCell({ depth - 1, 0 })->IsReferenced());
+
+        // Случайные формулы сверяются с проверкой цикла полным обходом
+        const int size = 5;
+        std::mt19937 generator(7);
+        std::uniform_int_distribution<int> coordinate(0, size - 1);
+        std::map<Position, std::vector<Position>> references;
+        std::map<Position, std::string> texts;
+        Sheet random_sheet;
+
+        auto reaches = [&references](Position from, Position target) 
+        {
+            std::vector<Position> stack{ from };
+            std::set<Position> visited;
+
+            while (!stack.empty()) 
+            {
+                Position pos = stack.back();
+                stack.pop_back();
+
+                if (pos == target) 
+                {
+                    return true;
+                }
+
+                if (visited.insert(pos).second) 
+                {
+                    stack.insert(stack.end(), references[pos].begin(), references[pos].end());
+                }
+            }
+
+            return false;
+        };
+
+        for (int step = 0; step < 3000; ++step) 
+        {
+            Position pos{ coordinate(generator), coordinate(generator) };
+            std::vector<Position> refs;
+            std::string text = std::to_string(step);
+
+            if (step % 4 != 0) 
+            {
+                text = "=1";
+
+                for (int i = step % 3; i >= 0; --i) 
+                {
+                    refs.push_back({ coordinate(generator), coordinate(generator) });
+                    text += "+" + refs.back().ToString();
+                }
+            }
+
+            bool expected_cycle = std::any_of(refs.begin(), refs.end(), [&](Position ref) { return reaches(ref, pos); });
+            bool cycle = false;
+
+            try 
+            {
+                random_sheet.SetCell(pos, text);
+            } 
+            
+            catch (const CircularDependencyException&) 
+            {
+                cycle = true;
+            }
+
+            ASSERT_EQUAL(cycle, expected_cycle);
+
+            if (!cycle) 
+            {
+                references[pos] = refs;
+                texts[pos] = text;
+            }
+        }
+
+        for (const auto& [pos, text] : texts) 
+        {
+            ASSERT_EQUAL(random_sheet.GetCell(pos)->GetText(), text);
+        }
+    }
+
+    void TestHandWrittenParser() 
+    {
+        // Описание дерева и программы, по которому сравниваются результаты двух парсеров
+        auto describe = [](const FormulaAST& ast) 
+        {
+            std::ostringstream out;
+            out.precision(17);
+            ast.Print(out);
+            out << '|';
+            ast.PrintFormula(out);
+            out << '|';
+            ast.PrintCells(out);
+            out << '|';
+            
+            for (const auto& instruction : ast.GetProgram().code) 
+            {
+                out << static_cast<int>(instruction.op) << ':' << instruction.arg << ' ';
+            }
+
+            out << '|' << ast.GetProgram().constants;
+
+            return out.str();
+        };
+
+        // Возвращает описание формулы либо пустую строку, если разбор завершился ошибкой
+        auto parse = [&describe](const std::string& text, bool antlr) 
+        {
+            try 
+            {
+                return describe(antlr ? ParseFormulaASTWithAntlr(text) : ParseFormulaAST(text));
+            } 
+            
+            catch (const FormulaException&) 
+            {
+                return std::string{};
+            }
+        };
+
+        for (const std::string text : { "1+2*3", "-1*2", "--A1", "+(1+2)/3", "1-2-3", "8/4/2", " ( A1 ) ", 
+                                        "1e5", "1.5E-3", ".5", "1.", "1e", "1E+", "1EA1", "A1E5", "A0", "ZZZZZ1", 
+                                        "1e999", "1e-999", "2*", "(1", "1)", "", "a1", "1..2", "12.5e+10*B3" }) 
+        {
+            ASSERT_EQUAL(parse(text, false), parse(text, true));
+        }
+
+        ASSERT_EQUAL(parse("-1*2", false), "(* (- 1) 2)|-1*2||0:0 6:0 0:1 4:0 |{1, 2}");
+        // Слишком малое число читается как ноль, как и потоком
+        ASSERT_EQUAL(ParseFormulaAST("1e-999+1.5e-3").GetProgram().constants, (std::vector{ 0.0, 1.5e-3 }));
+
+        // Случайные строки из символов грамматики и случайные корректные выражения
+        std::mt19937 generator(11);
+        const std::string alphabet = "0123456789.eE+-*/() ABZ";
+        std::uniform_int_distribution<std::size_t> symbol(0, alphabet.size() - 1);
+        std::uniform_int_distribution<int> length(1, 12);
+
+        std::function<std::string(int)> expression = [&](int depth) -> std::string 
+        {
+            switch (depth > 0 ? generator() % 6 : generator() % 2) 
+            {
+                case 0:
+                    return std::to_string(generator() % 1000) + (generator() % 2 ? ".25" : "");
+
+                case 1:
+                    return Position{ static_cast<int>(generator() % 100), static_cast<int>(generator() % 30) }.ToString();
+
+                case 2:
+                    return (generator() % 2 ? "-" : "+") + expression(depth - 1);
+
+                case 3:
+                    return "(" + expression(depth - 1) + ")";
+
+                default:
+                    return expression(depth - 1) + "+-*/"[generator() % 4] + expression(depth - 1);
+            }
+        };
+
+        for (int i = 0; i < 3000; ++i) 
+        {
+            std::string text;
+
+            for (int j = length(generator); j > 0; --j) 
+            {
+                text += alphabet[symbol(generator)];
+            }
+
+            ASSERT_EQUAL(parse(text, false), parse(text, true));
+
+            text = expression(5);
+            std::string description = parse(text, false);
+            ASSERT(!description.empty());
+            ASSERT_EQUAL(description, parse(text, true));
+        }
+    }
+
+    void TestFormulaInterning() 
+    {
+        Sheet sheet;
+        const int rows = 100;
+
+        for (int row = 0; row < rows; ++row) 
+        {
+            const std::string number = std::to_string(row + 1);
+            sheet.SetCell({ row, 0 }, number);
+            sheet.SetCell({ row, 1 }, "2");
+            sheet.SetCell({ row, 2 }, "=A" + number + " * B" + number + "+1");
+        }
+
+        // Все формулы столбца разобраны один раз
+        ASSERT_EQUAL(sheet.GetFormulaTable().GetParsedCount(), 1u);
+
+        for (int row = 0; row < rows; ++row) 
+        {
+            const std::string number = std::to_string(row + 1);
+            const Cell* cell = sheet.GetCell({ row, 2 });
+            ASSERT_EQUAL(cell->GetText(), "=A" + number + "*B" + number + "+1");
+            ASSERT_EQUAL(cell->GetReferencedCells(), (std::vector<Position>{ { row, 0 }, { row, 1 } }));
+            ASSERT_EQUAL(std::get<double>(cell->GetValue()), 2.0 * (row + 1) + 1);
+        }
+
+        // Другая относительная запись или другие числа - другое дерево
+        sheet.SetCell("D1"_pos, "=A1*B1+1");
+        sheet.SetCell("D2"_pos, "=A1*B2+1");
+        sheet.SetCell("D3"_pos, "=A3*B3+2");
+        ASSERT_EQUAL(sheet.GetFormulaTable().GetParsedCount(), 4u);
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "=A1*B2+1");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("D2"_pos)->GetValue()), 3.0);
+
+        // Ошибки разбора не зависят от таблицы
+        for (const std::string text : { "=A1+", "=ZZZZZ1", "=1e999" }) 
+        {
+            bool caught = false;
+            try 
+            {
+                sheet.SetCell("E1"_pos, text);
+            } 
+            
+            catch (const FormulaException&) 
+            {
+                caught = true;
+            }
+
+            ASSERT(caught);
+        }
+
+        // Относительная ссылка может выйти за границу таблицы только у другой ячейки
+        sheet.SetCell("E2"_pos, "=A1");
+        sheet.SetCell("E3"_pos, "=A2");
+        ASSERT_EQUAL(sheet.GetFormulaTable().GetParsedCount(), 5u);
+        ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetText(), "=A2");
+    }
+
+    void TestSetCells() 
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=B1");
+        sheet.SetCell("B1"_pos, "3");
+
+        // Формулы ссылаются на ячейки, установленные позже в том же пакете
+        auto errors = sheet.SetCells({ { "D1"_pos, "=C1*2" }, { "C1"_pos, "=B1+1" }, { "E1"_pos, "=1+" }, 
+                                       { Position{ -1, 0 }, "1" }, { "F1"_pos, "=F1" }, { "G1"_pos, "=H1" }, 
+                                       { "H1"_pos, "=G1" }, { "B2"_pos, "text" }, { "B2"_pos, "5" }, 
+                                       { "I1"_pos, "=Z100" } });
+
+        auto category = [](const std::exception_ptr& error) 
+        {
+            try 
+            {
+                std::rethrow_exception(error);
+            } 
+            
+            catch (const InvalidPositionException&) 
+            {
+                return "position";
+            } 
+            
+            catch (const FormulaException&) 
+            {
+                return "formula";
+            } 
+            
+            catch (const CircularDependencyException&) 
+            {
+                return "cycle";
+            }
+        };
+
+        std::map<Position, std::string> failed;
+
+        for (const auto& [pos, error] : errors) 
+        {
+            failed[pos] = category(error);
+        }
+
+        ASSERT_EQUAL(failed, (std::map<Position, std::string>{ { Position{ -1, 0 }, "position" }, { "E1"_pos, "formula" }, 
+                                                               { "F1"_pos, "cycle" }, { "G1"_pos, "cycle" }, { "H1"_pos, "cycle" } }));
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 8.0);
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "5");
+        ASSERT(sheet.GetCell("G1"_pos)->GetText().empty());
+        ASSERT(sheet.GetCell("Z100"_pos) != nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 2, 9 }));
+
+        // Откат ячеек цикла может замкнуть цикл через их прежнее содержимое
+        errors = sheet.SetCells({ { "A1"_pos, "=J1" }, { "J1"_pos, "=A1" }, { "B1"_pos, "=A1" } });
+        ASSERT_EQUAL(errors.size(), 3u);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=B1");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "3");
+
+        // Метки порядка после пакета остаются корректными для одиночных установок
+        sheet.SetCells({ { "K3"_pos, "=K2+1" }, { "K2"_pos, "=K1+1" }, { "K1"_pos, "=D1" } });
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("K3"_pos)->GetValue()), 10.0);
+        bool caught = false;
+        try 
+        {
+            sheet.SetCell("C1"_pos, "=K3");
+        } 
+        
+        catch (const CircularDependencyException&) 
+        {
+            caught = true;
+        }
+
+        ASSERT(caught);
+        sheet.SetCell("B1"_pos, "4");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("K3"_pos)->GetValue()), 12.0);
+
+        // Случайные пакеты с циклами, после каждого - одиночные установки,
+        // сверяемые с проверкой цикла полным обходом
+        const int size = 6;
+        std::mt19937 generator(5);
+        std::uniform_int_distribution<int> coordinate(0, size - 1);
+        Sheet random_sheet;
+
+        auto random_formula = [&]() 
+        {
+            std::string text = "=1";
+
+            for (int i = generator() % 3; i >= 0; --i) 
+            {
+                text += "+" + Position{ coordinate(generator), coordinate(generator) }.ToString();
+            }
+
+            return text;
+        };
+
+        auto reaches = [&random_sheet](Position from, Position target) 
+        {
+            std::vector<Position> stack{ from };
+            std::set<Position> visited;
+
+            while (!stack.empty()) 
+            {
+                Position pos = stack.back();
+                stack.pop_back();
+
+                if (pos == target) 
+                {
+                    return true;
+                }
+
+                const Cell* cell = random_sheet.GetCell(pos);
+
+                if (cell && visited.insert(pos).second) 
+                {
+                    for (Position ref : cell->GetReferencedCells()) 
+                    {
+                        stack.push_back(ref);
+                    }
+                }
+            }
+
+            return false;
+        };
+
+        for (int round = 0; round < 50; ++round) 
+        {
+            std::vector<std::pair<Position, std::string>> batch;
+
+            for (int i = 0; i < 8; ++i) 
+            {
+                batch.emplace_back(Position{ coordinate(generator), coordinate(generator) }, random_formula());
+            }
+
+            random_sheet.SetCells(batch);
+
+            for (int i = 0; i < 10; ++i) 
+            {
+                Position pos{ coordinate(generator), coordinate(generator) };
+                std::string text = random_formula();
+                bool expected_cycle = false;
+
+                for (Position ref : ParseFormula(text.substr(1))->GetReferencedCells()) 
+                {
+                    expected_cycle = expected_cycle || reaches(ref, pos);
+                }
+
+                bool cycle = false;
+
+                try 
+                {
+                    random_sheet.SetCell(pos, text);
+                } 
+                
+                catch (const CircularDependencyException&) 
+                {
+                    cycle = true;
+                }
+
+                ASSERT_EQUAL(cycle, expected_cycle);
+            }
+        }
+    }
+
+    void TestParallelParsing() 
+    {
+        // Формулы разных видов, с ошибками разбора, циклами и повторами позиций
+        std::mt19937 generator(11);
+        std::uniform_int_distribution<int> coordinate(0, 59);
+        std::vector<std::pair<Position, std::string>> cells;
+
+        for (int i = 0; i < 5000; ++i) 
+        {
+            const Position pos{ coordinate(generator), coordinate(generator) };
+            const std::string ref = Position{ coordinate(generator), coordinate(generator) }.ToString();
+
+            switch (generator() % 6) 
+            {
+                case 0:
+                    cells.emplace_back(pos, std::to_string(i % 100));
+                    break;
+
+                case 1:
+                    cells.emplace_back(pos, "=" + ref + "+");
+                    break;
+
+                case 2:
+                    cells.emplace_back(pos, "=(" + ref + "-" + std::to_string(i) + ")/" + ref);
+                    break;
+
+                default:
+                    cells.emplace_back(pos, "=" + ref + "*1.5+" + Position{ pos.row, (pos.col + 1) % 60 }.ToString());
+                    break;
+            }
+        }
+
+        auto load = [&cells](Sheet& sheet) 
+        {
+            std::vector<std::string> errors;
+
+            for (const auto& [pos, error] : sheet.SetCells(cells)) 
+            {
+                try 
+                {
+                    std::rethrow_exception(error);
+                } 
+
+                catch (const FormulaException&) 
+                {
+                    errors.push_back(pos.ToString() + " formula");
+                } 
+
+                catch (const CircularDependencyException&) 
+                {
+                    errors.push_back(pos.ToString() + " cycle");
+                }
+            }
+
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            sheet.PrintValues(out);
+
+            return std::make_pair(errors, out.str());
+        };
+
+        Sheet serial;
+        Sheet parallel;
+        parallel.SetThreadCount(4);
+        const auto expected = load(serial);
+        ASSERT(!expected.first.empty());
+        ASSERT(load(parallel) == expected);
+        ASSERT_EQUAL(serial.GetFormulaTable().GetParsedCount(), parallel.GetFormulaTable().GetParsedCount());
+        ASSERT_EQUAL(serial.GetFormulaTable().Size(), parallel.GetFormulaTable().Size());
+    }
+
+    void TestTableLoadAndSave() 
+    {
+        auto texts = [](const Sheet& sheet) 
+        {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+
+        auto values = [](const Sheet& sheet, std::streamsize precision) 
+        {
+            std::ostringstream out;
+            out.precision(precision);
+            sheet.PrintValues(out);
+            return out.str();
+        };
+
+        // Кавычки, разделители и переводы строк внутри полей, CRLF, пустые поля
+        std::istringstream csv("1,\"a,b\",=A1/3\r\n\n,\"say \"\"hi\"\"\",\"two\nlines\"\n'=x,,=C1*2\n=1/0");
+        Sheet sheet;
+        ASSERT(LoadTable(sheet, csv, TableFormat::Csv).empty());
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "a,b");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A1/3");
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "say \"hi\"");
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "two\nlines");
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "'=x");
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetText(), "=C1*2");
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "=1/0");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 3 }));
+
+        // TSV совпадает с печатью листа, в том числе с точностью потока
+        for (std::streamsize precision : { 6, 3, 12 }) 
+        {
+            std::ostringstream out;
+            out.precision(precision);
+            SaveValues(sheet, out, TableFormat::Tsv);
+            ASSERT_EQUAL(out.str(), values(sheet, precision));
+        }
+
+        std::ostringstream tsv;
+        SaveTexts(sheet, tsv, TableFormat::Tsv);
+        ASSERT_EQUAL(tsv.str(), texts(sheet));
+
+        // Ошибки установки собираются из всех пакетов, остальные ячейки загружаются
+        std::istringstream broken("=A1+\t=A1\n=A2\n");
+        Sheet broken_sheet;
+        const auto errors = LoadTable(broken_sheet, broken, TableFormat::Tsv);
+        ASSERT_EQUAL(errors.size(), 2u);
+        ASSERT(errors[0].pos == "A1"_pos && errors[1].pos == "A2"_pos);
+        ASSERT_EQUAL(broken_sheet.GetCell("B1"_pos)->GetText(), "=A1");
+
+        // Данные больше буфера чтения и поле, которое не помещается в буфер целиком
+        std::mt19937 generator(3);
+        Sheet large;
+        std::vector<std::pair<Position, std::string>> cells;
+
+        for (int row = 0; row < 3000; ++row) 
+        {
+            for (int col = 0; col < 12; ++col) 
+            {
+                std::string text(generator() % 60, 'x');
+
+                for (char& c : text) 
+                {
+                    c = ",\"\n\ra bc"[generator() % 8];
+                }
+
+                cells.emplace_back(Position{ row, col }, text);
+            }
+        }
+
+        cells.emplace_back(Position{ 1500, 3 }, std::string(3 << 20, '"'));
+        large.SetCells(cells);
+
+        std::stringstream saved;
+        SaveTexts(large, saved, TableFormat::Csv);
+        ASSERT(saved.str().size() > (4u << 20));
+        Sheet loaded;
+        ASSERT(LoadTable(loaded, saved, TableFormat::Csv).empty());
+        ASSERT_EQUAL(texts(loaded), texts(large));
+    }
+
+    void TestSheetSnapshot() 
+    {
+        auto print = [](const Sheet& sheet) 
+        {
+            std::ostringstream out;
+            out.precision(17);
+            sheet.PrintTexts(out);
+            sheet.PrintValues(out);
+            return out.str();
+        };
+
+        auto save = [](const Sheet& sheet) 
+        {
+            std::ostringstream out;
+            SheetSnapshot::Save(sheet, out);
+            return out.str();
+        };
+
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "2.5");
+        sheet.SetCell("A2"_pos, "'=escaped");
+        sheet.SetCell("A3"_pos, "text");
+        sheet.SetCell("B1"_pos, "=+A1*(1+2)/-A1");
+        sheet.SetCell("B2"_pos, "=1+(2+3)");
+        sheet.SetCell("B3"_pos, "=A3+1");
+        sheet.SetCell("B4"_pos, "=1/0");
+        sheet.SetCell("C5"_pos, "=D9");
+
+        // Заполнение вниз: одно дерево на весь столбец
+        for (int row = 0; row < 50; ++row) 
+        {
+            const std::string number = std::to_string(row + 1);
+            sheet.SetCell({ row, 4 }, "=A" + number + "*" + number + "+" + (row > 0 ? "E" + std::to_string(row) : "1"));
+        }
+
+        // Часть формул вычислена, часть нет
+        sheet.GetCell("B1"_pos)->GetValue();
+        sheet.GetCell("E30"_pos)->GetValue();
+        std::size_t dirty = 0;
+
+        for (int row = 0; row < sheet.GetPrintableSize().rows; ++row) 
+        {
+            for (int col = 0; col < sheet.GetPrintableSize().cols; ++col) 
+            {
+                const Cell* cell = sheet.GetCell({ row, col });
+                dirty += cell && cell->IsDirty();
+            }
+        }
+
+        const std::string snapshot = save(sheet);
+        Sheet loaded;
+        SheetSnapshot::Load(loaded, snapshot);
+        ASSERT_EQUAL(loaded.GetPrintableSize(), sheet.GetPrintableSize());
+        ASSERT_EQUAL(loaded.GetFormulaTable().GetParsedCount(), 0u);
+
+        // Значения из кэша не пересчитываются
+        ASSERT(dirty > 0);
+        loaded.ResetCacheStatistics();
+        ASSERT_EQUAL(print(loaded), print(sheet));
+        ASSERT_EQUAL(loaded.GetCacheStatistics().misses, dirty);
+
+        // Снимок загруженного листа совпадает с исходным побайтно
+        ASSERT_EQUAL(save(loaded), save(sheet));
+
+        // Связи и метки порядка восстановлены: изменения распространяются, циклы находятся
+        for (Sheet* target : { &sheet, &loaded }) 
+        {
+            target->SetCell("A1"_pos, "4");
+            target->SetCell("D9"_pos, "=E50*2");
+            target->SetCell("F1"_pos, "=C5");
+        }
+
+        ASSERT_EQUAL(print(loaded), print(sheet));
+        bool caught = false;
+
+        try 
+        {
+            loaded.SetCell("A1"_pos, "=E50");
+        } 
+
+        catch (const CircularDependencyException&) 
+        {
+            caught = true;
+        }
+
+        ASSERT(caught);
+
+        // Повреждённые данные
+        auto load_fails = [](std::string data) 
+        {
+            Sheet target;
+
+            try 
+            {
+                SheetSnapshot::Load(target, data);
+            } 
+
+            catch (const SnapshotError&) 
+            {
+                return true;
+            }
+
+            return false;
+        };
+
+        ASSERT(load_fails(""));
+        ASSERT(load_fails(snapshot.substr(0, snapshot.size() / 2)));
+        std::string wrong_magic = snapshot;
+        wrong_magic[0] = 'X';
+        ASSERT(load_fails(wrong_magic));
+        std::string wrong_version = snapshot;
+        ++wrong_version[8];
+        ASSERT(load_fails(wrong_version));
+
+        // Снимок без одной из связей формулы: формула не узнала бы о правках входа
+        Sheet linked;
+        linked.SetCell("A1"_pos, "1");
+        linked.SetCell("A2"_pos, "2");
+        linked.SetCell("B1"_pos, "=A1+A2");
+        std::string dropped_edge = save(linked);
+        // Заголовок - 88 байт, за ним одна программа формулы (24 байта) и записи ячеек по 48 байт
+        const std::size_t cells_begin = 88 + 24;
+        const std::size_t kind_offset = 24;
+        const std::size_t inputs_size_offset = 40;
+        bool dropped = false;
+
+        for (std::size_t record = cells_begin; record + 48 <= cells_begin + 3 * 48; record += 48) 
+        {
+            std::uint32_t inputs_size = 0;
+            std::memcpy(&inputs_size, dropped_edge.data() + record + inputs_size_offset, sizeof(inputs_size));
+
+            if (dropped_edge[record + kind_offset] == 2 && inputs_size == 2) 
+            {
+                --inputs_size;
+                std::memcpy(dropped_edge.data() + record + inputs_size_offset, &inputs_size, sizeof(inputs_size));
+                dropped = true;
+            }
+        }
+
+        ASSERT(dropped);
+        ASSERT(!load_fails(save(linked)));
+        ASSERT(load_fails(dropped_edge));
+
+        // Неудачная загрузка оставляет лист пустым: ячейки с несвязанными входами не остаются
+        Sheet failed;
+        failed.SetNumericColumnsEnabled(true);
+        caught = false;
+
+        try 
+        {
+            SheetSnapshot::Load(failed, dropped_edge);
+        } 
+
+        catch (const SnapshotError&) 
+        {
+            caught = true;
+        }
+
+        ASSERT(caught);
+        ASSERT_EQUAL(failed.GetPrintableSize(), (Size{ 0, 0 }));
+        ASSERT(failed.GetCell("A1"_pos) == nullptr);
+        ASSERT(failed.GetCell("B1"_pos) == nullptr);
+        ASSERT(!failed.GetNumericColumns()->IsNumber("A1"_pos));
+
+        // и пригодным для работы
+        failed.SetCell("B1"_pos, "=A1+A2");
+        failed.SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(failed.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+        failed.RecalculateAll();
+        ASSERT(failed.GetNumericColumns()->IsNumber("B1"_pos));
+        ASSERT_EQUAL(failed.GetPrintableSize(), (Size{ 1, 2 }));
+
+        // Смещение ссылки за пределами листа. В листе без текста ссылки - последний
+        // раздел снимка, их число записано в заголовке по смещению 72
+        std::string far_reference = save(linked);
+        std::uint64_t reference_count = 0;
+        std::memcpy(&reference_count, far_reference.data() + 72, sizeof(reference_count));
+        // Формула в столбце B: сложение столбцов переполнило бы int
+        const std::int32_t far_col = std::numeric_limits<std::int32_t>::max();
+        std::memcpy(far_reference.data() + far_reference.size() - reference_count * 8 + 4, &far_col, sizeof(far_col));
+        ASSERT(load_fails(far_reference));
+    }
+
+    void TestPrintNumberFormat() 
+    {
+        // AppendNumber выводит числа так же, как поток с теми же настройками
+        const double numbers[] = { 0.0, -0.0, 1.0, -2.5, 1.0 / 3, 123456789.0, 1e-7, 1e21, 1e300, -5e-324, 
+                                   std::numeric_limits<double>::max(), std::numeric_limits<double>::infinity() };
+        const std::ios_base::fmtflags formats[] = { std::ios_base::fmtflags(), std::ios_base::fixed, std::ios_base::scientific, 
+                                                    std::ios_base::fixed | std::ios_base::scientific, std::ios_base::showpoint, 
+                                                    std::ios_base::uppercase | std::ios_base::scientific };
+
+        for (double number : numbers) 
+        {
+            for (std::ios_base::fmtflags format : formats) 
+            {
+                for (std::streamsize precision : { 0, 1, 6, 17 }) 
+                {
+                    std::ostringstream expected;
+                    expected.flags(format);
+                    expected.precision(precision);
+                    expected << number;
+
+                    std::string actual = "x";
+                    AppendNumber(actual, number, expected);
+                    ASSERT_EQUAL(actual, "x" + expected.str());
+                }
+            }
+        }
+
+        // Печать листа совпадает с выводом значений и текстов через потоки
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=1/3");
+        sheet.SetCell("B1"_pos, "'=escaped");
+        sheet.SetCell("C1"_pos, "=1/0");
+        sheet.SetCell("A2"_pos, "=B1+1");
+        sheet.SetCell("C2"_pos, "12.5");
+        sheet.SetCell("B3"_pos, "=(A1+C2)*2");
+
+        for (std::streamsize precision : { 6, 2, 15 }) 
+        {
+            std::ostringstream values;
+            std::ostringstream expected_values;
+            std::ostringstream expected_texts;
+            values.precision(precision);
+            expected_values.precision(precision);
+            sheet.PrintValues(values);
+
+            for (int row = 0; row < 3; ++row) 
+            {
+                for (int col = 0; col < 3; ++col) 
+                {
+                    expected_values << (col > 0 ? "\t" : "");
+                    expected_texts << (col > 0 ? "\t" : "");
+
+                    if (const Cell* cell = sheet.GetCell({ row, col })) 
+                    {
+                        expected_values << cell->GetValue();
+                        expected_texts << cell->GetText();
+                    }
+                }
+
+                expected_values << "\n";
+                expected_texts << "\n";
+            }
+
+            ASSERT_EQUAL(values.str(), expected_values.str());
+
+            std::ostringstream texts;
+            sheet.PrintTexts(texts);
+            ASSERT_EQUAL(texts.str(), expected_texts.str());
+        }
+    }
+
+    void TestFormulaTextCache() 
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=((1))+2*(3)");
+        sheet.SetCell("A2"_pos, "=A1*2");
+        sheet.SetCell("B2"_pos, "=B1*2");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=1+2*3");
+        // Ячейки с общим деревом печатают свои ссылки
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=B1*2");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(14.0));
+
+        // Канонический текст совпадает с установленным, и ячейка не меняется
+        sheet.SetCell("A1"_pos, "=1+2*3");
+        ASSERT(!sheet.GetCell("A2"_pos)->IsDirty());
+
+        std::string appended = "x";
+        sheet.GetCell("A1"_pos)->AppendText(appended);
+        ASSERT_EQUAL(appended, "x=1+2*3");
+
+        sheet.SetCell("A1"_pos, "=1+2*4");
+        ASSERT(sheet.GetCell("A2"_pos)->IsDirty());
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(18.0));
+    }
+
+    void TestNumericColumns() 
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1.5");
+        sheet.SetCell("A2"_pos, "text");
+        sheet.SetCell("A3"_pos, "=A1*2");
+        ASSERT(sheet.GetNumericColumns() == nullptr);
+
+        // При включении хранилище заполняется готовыми значениями
+        sheet.SetNumericColumnsEnabled(true);
+        const NumericColumns& columns = *sheet.GetNumericColumns();
+        ASSERT(columns.IsNumber("A1"_pos));
+        ASSERT(!columns.IsNumber("A2"_pos));
+        ASSERT(!columns.IsNumber("A3"_pos));
+        ASSERT(!columns.IsNumber("Z100"_pos));
+        ASSERT_EQUAL(sheet.RecalculateAll(), 1u);
+        ASSERT_EQUAL(columns.Get("A3"_pos), 3.0);
+        ASSERT_EQUAL(columns.Sum(0, 0, Position::MAX_ROWS), 4.5);
+        ASSERT_EQUAL(columns.Count(0, 0, Position::MAX_ROWS), 2u);
+        ASSERT_EQUAL(columns.Count(0, 1, 2), 0u);
+
+        // Значение зависимой формулы обновляется при её проверке
+        sheet.SetCell("A1"_pos, "=1/0");
+        ASSERT(!columns.IsNumber("A1"_pos));
+        ASSERT(!columns.IsNumber("A3"_pos));
+        ASSERT_EQUAL(columns.Get("A3"_pos), 0.0);
+        ASSERT_EQUAL(sheet.RecalculateAll(), 2u);
+        ASSERT(!columns.IsNumber("A3"_pos));
+        sheet.SetCell("A1"_pos, "10");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(20.0));
+        ASSERT_EQUAL(columns.Get("A3"_pos), 20.0);
+
+        sheet.ClearCell("A1"_pos);
+        ASSERT(!columns.IsNumber("A1"_pos));
+        ASSERT_EQUAL(columns.Get("A1"_pos), 0.0);
+
+        // Отменённая из-за цикла запись пакета оставляет прежнее значение
+        sheet.SetCell("A1"_pos, "4");
+        ASSERT_EQUAL(sheet.SetCells({ { "B1"_pos, "=B2" }, { "B2"_pos, "=B1" }, { "A1"_pos, "5" } }).size(), 2u);
+        ASSERT_EQUAL(columns.Get("A1"_pos), 5.0);
+        ASSERT(!columns.IsNumber("B1"_pos));
+
+        // Параллельный пересчёт длинных столбцов
+        std::vector<std::pair<Position, std::string>> cells;
+
+        for (int row = 0; row < 3000; ++row) 
+        {
+            cells.emplace_back(Position{ row, 2 }, std::to_string(row));
+            cells.emplace_back(Position{ row, 3 }, "=C" + std::to_string(row + 1) + "*2");
+        }
+
+        sheet.SetThreadCount(4);
+        ASSERT(sheet.SetCells(std::move(cells)).empty());
+        ASSERT_EQUAL(columns.Count(3, 0, 3000), 0u);
+        sheet.RecalculateAll();
+        ASSERT_EQUAL(columns.Count(3, 0, 3000), 3000u);
+        ASSERT_EQUAL(columns.Sum(3, 0, 3000), 2.0 * 2999 * 3000 / 2);
+        ASSERT_EQUAL(columns.Sum(2, 100, 200), 14950.0);
+
+        std::size_t visited = 0;
+        columns.ForEachNumber(3, 10, 20, [&visited](int row, double value) 
+        {
+            ASSERT_EQUAL(value, 2.0 * row);
+            ++visited;
+        });
+        ASSERT_EQUAL(visited, 10u);
+
+        // Правка листа делает числа формул со входами устаревшими до проверки,
+        // в том числе числа формул, не зависящих от изменённой ячейки
+        sheet.SetCell("C10"_pos, "-1");
+        ASSERT_EQUAL(columns.Get("D10"_pos), 0.0);
+        ASSERT_EQUAL(columns.Count(3, 0, 3000), 0u);
+        ASSERT_EQUAL(columns.Sum(3, 0, 3000), 0.0);
+        ASSERT_EQUAL(columns.Count(2, 0, 3000), 3000u);
+        ASSERT_EQUAL(sheet.GetCell("D11"_pos)->GetValue(), CellInterface::Value(20.0));
+        ASSERT_EQUAL(columns.Count(3, 0, 3000), 1u);
+        ASSERT_EQUAL(columns.Sum(3, 0, 3000), 20.0);
+        sheet.RecalculateAll();
+        ASSERT_EQUAL(columns.Get("D10"_pos), -2.0);
+        ASSERT_EQUAL(columns.Count(3, 0, 3000), 3000u);
+        ASSERT_EQUAL(columns.Sum(3, 0, 3000), 2.0 * 2999 * 3000 / 2 - 20.0);
+
+        // Снимок, загруженный в лист с хранилищем, заполняет его значениями из кэша
+        std::ostringstream snapshot;
+        SheetSnapshot::Save(sheet, snapshot);
+        Sheet loaded;
+        loaded.SetNumericColumnsEnabled(true);
+        SheetSnapshot::Load(loaded, snapshot.str());
+        ASSERT_EQUAL(loaded.GetNumericColumns()->Sum(3, 0, 3000), columns.Sum(3, 0, 3000));
+
+        sheet.SetNumericColumnsEnabled(false);
+        ASSERT(sheet.GetNumericColumns() == nullptr);
+        sheet.SetCell("A1"_pos, "6");
+    }
+
+    void TestEpochValidation() 
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*0");
+        sheet.SetCell("C1"_pos, "=B1+1");
+        sheet.SetCell("D1"_pos, "=A1+1");
+        ASSERT_EQUAL(sheet.RecalculateAll(), 3u);
+        sheet.ResetCacheStatistics();
+
+        // Правка не обходит зависимые ячейки: устаревшими их делает номер правки
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT(sheet.GetCell("B1"_pos)->IsDirty());
+        ASSERT(sheet.GetCell("C1"_pos)->IsDirty());
+        ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 0u);
+
+        // Значение B1 не изменилось, поэтому C1 не вычисляется заново
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 1u);
+        ASSERT(!sheet.GetCell("C1"_pos)->IsDirty());
+        ASSERT(sheet.GetCell("D1"_pos)->IsDirty());
+        ASSERT_EQUAL(sheet.RecalculateAll(), 1u);
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+        // Правки без чтения ничего не вычисляют
+        for (int i = 0; i < 1000; ++i) 
+        {
+            sheet.SetCell("A1"_pos, std::to_string(i));
+        }
+
+        ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 2u);
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(1000.0));
+        ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 3u);
+
+        // Проверка формулы проверяет все её устаревшие входы, даже те, до которых
+        // вычисление не доходит из-за ошибки в другом входе
+        sheet.SetCell("G1"_pos, "=1/0");
+        sheet.SetCell("H1"_pos, "=A1*2");
+        sheet.RecalculateAll();
+        sheet.SetCell("A1"_pos, "5");
+        sheet.SetCell("I1"_pos, "=G1+H1");
+        ASSERT_EQUAL(sheet.GetCell("I1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+        ASSERT(!sheet.GetCell("H1"_pos)->IsDirty());
+        ASSERT_EQUAL(sheet.RecalculateAll(), 2u);
+        ASSERT_EQUAL(sheet.GetCell("H1"_pos)->GetValue(), CellInterface::Value(10.0));
+        sheet.ClearCell("G1"_pos);
+        sheet.ClearCell("H1"_pos);
+        sheet.ClearCell("I1"_pos);
+
+        // Ноль со знаком минус печатается иначе, поэтому считается изменением
+        sheet.SetCell("A1"_pos, "0");
+        sheet.SetCell("E1"_pos, "=A1*-1");
+        sheet.SetCell("F1"_pos, "=E1");
+        std::ostringstream before;
+        sheet.PrintValues(before);
+        sheet.SetCell("A1"_pos, "-0");
+        std::ostringstream after;
+        sheet.PrintValues(after);
+        ASSERT_EQUAL(before.str(), "0\t0\t1\t1\t-0\t-0\n");
+        ASSERT_EQUAL(after.str(), "-0\t-0\t1\t1\t0\t0\n");
+    }
+
+    void TestRecalculateChangedCells() 
+    {
+        // Две независимые цепочки A1 -> B1 -> C1 и A2 -> B2 -> C2, сходящиеся в D1
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.SetCell("C1"_pos, "=B1*2");
+        sheet.SetCell("A2"_pos, "10");
+        sheet.SetCell("B2"_pos, "=A2+1");
+        sheet.SetCell("C2"_pos, "=B2*2");
+        sheet.SetCell("D1"_pos, "=C1+C2");
+        ASSERT_EQUAL(sheet.RecalculateAll(), 5u);
+        ASSERT_EQUAL(sheet.RecalculateAll(), 0u);
+
+        // Пересчёт проходит только по ячейкам, зависящим от изменённой. Вход C2
+        // отмечается проверенным, а B2 остаётся не проверенным на текущей правке
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet.RecalculateAll(), 3u);
+        ASSERT(!sheet.GetCell("C2"_pos)->IsDirty());
+        ASSERT(sheet.GetCell("B2"_pos)->IsDirty());
+        ASSERT_EQUAL(sheet.RecalculateAll(), 0u);
+        sheet.ResetCacheStatistics();
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(28.0));
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(11.0));
+        ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 0u);
+
+        // Прочитанная после правки формула не вычисляется повторно
+        sheet.SetCell("A2"_pos, "20");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(42.0));
+        ASSERT_EQUAL(sheet.RecalculateAll(), 1u);
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(48.0));
+
+        // Снимок после частичного пересчёта сохраняет значения всех формул
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(sheet.RecalculateAll(), 3u);
+        std::ostringstream snapshot;
+        SheetSnapshot::Save(sheet, snapshot);
+        Sheet loaded;
+        SheetSnapshot::Load(loaded, snapshot.str());
+        ASSERT_EQUAL(loaded.RecalculateAll(), 0u);
+        std::ostringstream values;
+        loaded.PrintValues(values);
+        ASSERT_EQUAL(values.str(), "3\t4\t8\t50\n20\t21\t42\t\n");
+        ASSERT_EQUAL(loaded.GetCacheStatistics().misses, 0u);
+
+        // Правок больше, чем ячеек: пересчёт проверяет все ячейки
+        sheet.SetCell("E1"_pos, "=F1+F2");
+        sheet.RecalculateAll();
+
+        for (int i = 0; i < 100; ++i) 
+        {
+            sheet.SetCell({ i % 2, 5 }, std::to_string(i));
+        }
+
+        ASSERT_EQUAL(sheet.RecalculateAll(), 1u);
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(197.0));
+        ASSERT_EQUAL(sheet.RecalculateAll(), 0u);
+        sheet.SetCell("A2"_pos, "0");
+        ASSERT_EQUAL(sheet.RecalculateAll(), 3u);
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(10.0));
+    }
+
+    void TestDeepDependencyChains() 
+    {
+        // Цепочка через всю высоту листа в нескольких столбцах: A2 = A1 + 1, ...,
+        // B1 = A16384 + 1, ... Глубина вычисления не ограничена стеком
+        const int cols = 4;
+        const int length = Position::MAX_ROWS * cols;
+
+        auto previous = [](Position pos) 
+        {
+            return pos.row > 0 ? Position{ pos.row - 1, pos.col } : Position{ Position::MAX_ROWS - 1, pos.col - 1 };
+        };
+
+        auto formula = [&previous](Position pos) 
+        {
+            return "=" + previous(pos).ToString() + "+1";
+        };
+
+        const Position first{ 0, 0 };
+        const Position last{ Position::MAX_ROWS - 1, cols - 1 };
+
+        // Ячейки задаются от конца цепочки, каждая правка проверяется на циклы
+        Sheet sheet;
+
+        for (int col = cols - 1; col >= 0; --col) 
+        {
+            for (int row = Position::MAX_ROWS - 1; row >= 0; --row) 
+            {
+                const Position pos{ row, col };
+                sheet.SetCell(pos, pos == first ? "1" : formula(pos));
+            }
+        }
+
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(static_cast<double>(length)));
+
+        sheet.SetCell(first, "10");
+        ASSERT(sheet.GetCell(last)->IsDirty());
+        ASSERT(sheet.GetCell(last)->GetNumericValue() == CellInterface::NumericValue(length + 9.0));
+        ASSERT_EQUAL(sheet.GetCell(Position{ 0, 1 })->GetValue(), CellInterface::Value(Position::MAX_ROWS + 10.0));
+
+        // Ошибка в начале цепочки доходит до её конца
+        sheet.SetCell(first, "=1/0");
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+
+        // Цепочка, заданная одним пакетом от начала, пересчитывается целиком
+        Sheet batch_sheet;
+        std::vector<std::pair<Position, std::string>> cells;
+        cells.reserve(length);
+
+        for (int col = 0; col < cols; ++col) 
+        {
+            for (int row = 0; row < Position::MAX_ROWS; ++row) 
+            {
+                const Position pos{ row, col };
+                cells.emplace_back(pos, pos == first ? "1" : formula(pos));
+            }
+        }
+
+        ASSERT(batch_sheet.SetCells(std::move(cells)).empty());
+        ASSERT_EQUAL(batch_sheet.RecalculateAll(), static_cast<std::size_t>(length - 1));
+        ASSERT_EQUAL(batch_sheet.GetCell(last)->GetValue(), CellInterface::Value(static_cast<double>(length)));
+
+        // Цикл через всю цепочку находится без рекурсии, лист не меняется
+        batch_sheet.SetCell(first, "2");
+        bool caught = false;
+
+        try 
+        {
+            batch_sheet.SetCell(first, "=" + last.ToString());
+        } 
+        
+        catch (const CircularDependencyException&) 
+        {
+            caught = true;
+        }
+
+        ASSERT(caught);
+        ASSERT_EQUAL(batch_sheet.GetCell(last)->GetValue(), CellInterface::Value(length + 1.0));
+    }
+
+    void TestDependencyGraphEdges() 
+    {
+        Sheet sheet;
+        const int count = 100;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("C1"_pos, "10");
+
+        // У A1 и C1 по count зависимых: связи не помещаются в сам список
+        for (int row = 0; row < count; ++row) 
+        {
+            sheet.SetCell(Position{ row, 1 }, "=A1+C1");
+        }
+
+        // Удаление связей из середины списков вперемешку с добавлением
+        std::set<Position> a1_dependents;
+        std::set<Position> c1_dependents;
+
+        for (int row = 0; row < count; ++row) 
+        {
+            const Position pos{ row, 1 };
+
+            if (row % 5 == 0) 
+            {
+                sheet.ClearCell(pos);
+            }
+
+            else if (row % 3 == 0) 
+            {
+                sheet.SetCell(pos, "=C1*2");
+                c1_dependents.insert(pos);
+            }
+
+            else if (row % 7 == 0) 
+            {
+                sheet.SetCell(pos, "=A1-1");
+                a1_dependents.insert(pos);
+            }
+
+            else 
+            {
+                a1_dependents.insert(pos);
+                c1_dependents.insert(pos);
+            }
+        }
+
+        auto dependents = [&sheet](Position pos) 
+        {
+            std::set<Position> result;
+
+            for (const Cell* cell : sheet.GetCell(pos)->GetReferencingCells()) 
+            {
+                for (int row = 0; row < count; ++row) 
+                {
+                    if (sheet.GetCell(Position{ row, 1 }) == cell) 
+                    {
+                        result.insert(Position{ row, 1 });
+                    }
+                }
+            }
+
+            return result;
+        };
+
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetReferencingCells().Size(), a1_dependents.size());
+        ASSERT(dependents("A1"_pos) == a1_dependents);
+        ASSERT(dependents("C1"_pos) == c1_dependents);
+
+        // Оставшиеся связи ведут к нужным ячейкам: правки входов доходят до всех зависимых
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("C1"_pos, "20");
+
+        for (int row = 0; row < count; ++row) 
+        {
+            const Position pos{ row, 1 };
+
+            if (row % 5 == 0) 
+            {
+                ASSERT(sheet.GetCell(pos) == nullptr);
+                continue;
+            }
+
+            const double expected = row % 3 == 0 ? 40.0 : row % 7 == 0 ? 1.0 : 22.0;
+            ASSERT(sheet.GetCell(pos)->GetNumericValue() == CellInterface::NumericValue(expected));
+        }
+
+        // Ячейка, ссылающаяся сама на себя, и повторные ссылки на одну ячейку
+        bool caught = false;
+
+        try 
+        {
+            sheet.SetCell("B2"_pos, "=B2+A1");
+        } 
+        
+        catch (const CircularDependencyException&) 
+        {
+            caught = true;
+        }
+
+        ASSERT(caught);
+        sheet.SetCell("B2"_pos, "=A1*A1+A1");
+        ASSERT(sheet.GetCell("B2"_pos)->GetValue() == CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetReferencingCells().Size(), a1_dependents.size());
+    }
+
+    void TestBoundCellReferences() 
+    {
+        // Формула читает входы по адресам, найденным при установке. Ячейка
+        // входа остаётся той же при любой смене её содержимого
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=A1*2+C3");
+        ASSERT(sheet.GetCell("A1"_pos) != nullptr);
+        ASSERT(sheet.GetCell("B1"_pos)->GetNumericValue() == CellInterface::NumericValue(0.0));
+
+        const Cell* input = sheet.GetCell("A1"_pos);
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT(sheet.GetCell("B1"_pos)->GetNumericValue() == CellInterface::NumericValue(6.0));
+        sheet.SetCell("A1"_pos, "=C3+4");
+        sheet.SetCell("C3"_pos, "1");
+        ASSERT(sheet.GetCell("B1"_pos)->GetNumericValue() == CellInterface::NumericValue(11.0));
+        sheet.SetCell("A1"_pos, "text");
+        ASSERT(sheet.GetCell("B1"_pos)->GetNumericValue() == CellInterface::NumericValue(FormulaError::Category::Value));
+
+        // Очищенная ячейка, на которую есть ссылка, не удаляется
+        sheet.ClearCell("A1"_pos);
+        ASSERT(sheet.GetCell("A1"_pos) == input);
+        ASSERT(sheet.GetCell("B1"_pos)->GetNumericValue() == CellInterface::NumericValue(1.0));
+
+        // Новая формула связывается с новыми входами, старые ячейки можно удалить
+        sheet.SetCell("B1"_pos, "=D4-1");
+        sheet.ClearCell("A1"_pos);
+        ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+        sheet.SetCell("D4"_pos, "5");
+        ASSERT(sheet.GetCell("B1"_pos)->GetNumericValue() == CellInterface::NumericValue(4.0));
+
+        // Пакет и снимок связывают формулы так же, как установка по одной ячейке
+        sheet.SetCells({ { "E1"_pos, "=E2*E3" }, { "E2"_pos, "=D4" }, { "E3"_pos, "2" } });
+        ASSERT(sheet.GetCell("E1"_pos)->GetNumericValue() == CellInterface::NumericValue(10.0));
+
+        std::ostringstream snapshot;
+        SheetSnapshot::Save(sheet, snapshot);
+        Sheet loaded;
+        SheetSnapshot::Load(loaded, snapshot.str());
+        loaded.SetCell("D4"_pos, "6");
+        ASSERT(loaded.GetCell("E1"_pos)->GetNumericValue() == CellInterface::NumericValue(12.0));
+        ASSERT(loaded.GetCell("B1"_pos)->GetNumericValue() == CellInterface::NumericValue(5.0));
+    }
+
+    void TestFormulaProgram() 
+    {
+        using ASTImpl::OpCode;
+
+        auto ast = ParseFormulaAST("(B2+1)*-A1/B2");
+        const auto& program = ast.GetProgram();
+
+        std::vector<OpCode> ops;
+        
+        for (const auto& instruction : program.code) 
+        {
+            ops.push_back(instruction.op);
+        }
+
+        ASSERT(ops == (std::vector{ OpCode::PushCell, OpCode::PushNumber, OpCode::Add, OpCode::PushCell,
+                                    OpCode::Negate, OpCode::Multiply, OpCode::PushCell, OpCode::Divide }));
+        ASSERT_EQUAL(program.cells, (std::vector{"A1"_pos, "B2"_pos}));
+        ASSERT_EQUAL(program.constants, std::vector{1.0});
+        ASSERT_EQUAL(program.max_stack_depth, 2u);
+
+        std::ostringstream formula;
+        ast.PrintFormula(formula);
+        ASSERT_EQUAL(formula.str(), "(B2+1)*-A1/B2");
+
+        auto args = [](Position pos) 
+        { 
+            return pos == "A1"_pos ? 2.0 : 4.0; 
+        };
+        ASSERT_EQUAL(ast.Execute(args), -2.5);
+
+        // Глубина стека больше локального буфера интерпретатора
+        std::string nested = "1";
+
+        for (int i = 0; i < 40; ++i) 
+        {
+            nested = "1+(" + nested + ")";
+        }
+
+        ASSERT_EQUAL(ParseFormulaAST(nested).Execute(args), 41.0);
+    }
 } // end of namespace
 
 int main() 
@@ -419,6 +2063,29 @@ int main()
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestFormulaValueCache);
+    RUN_TEST(tr, TestCellNumericValue);
+    RUN_TEST(tr, TestCellStorage);
+    RUN_TEST(tr, TestPrintableSizeUpdates);
+    RUN_TEST(tr, TestRecalculateAll);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestThreadPoolExceptions);
+    RUN_TEST(tr, TestIncrementalCycleDetection);
+    RUN_TEST(tr, TestHandWrittenParser);
+    RUN_TEST(tr, TestFormulaInterning);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestParallelParsing);
+    RUN_TEST(tr, TestTableLoadAndSave);
+    RUN_TEST(tr, TestSheetSnapshot);
+    RUN_TEST(tr, TestPrintNumberFormat);
+    RUN_TEST(tr, TestFormulaTextCache);
+    RUN_TEST(tr, TestNumericColumns);
+    RUN_TEST(tr, TestEpochValidation);
+    RUN_TEST(tr, TestRecalculateChangedCells);
+    RUN_TEST(tr, TestDeepDependencyChains);
+    RUN_TEST(tr, TestDependencyGraphEdges);
+    RUN_TEST(tr, TestBoundCellReferences);
+    RUN_TEST(tr, TestFormulaProgram);
     
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,237 @@
+#include "numeric_columns.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cassert>
+
+void NumericColumns::Column::Reserve(int row) 
+{
+    if (row < Size()) 
+    {
+        return;
+    }
+
+    // Столбец растёт вдвое, целыми словами маски и не больше высоты таблицы
+    const int words = std::min(std::max(row / WORD_BITS + 1, 2 * Size() / WORD_BITS), 
+                               (Position::MAX_ROWS + WORD_BITS - 1) / WORD_BITS);
+    auto grow = [words, size = Size() / WORD_BITS](std::unique_ptr<std::atomic<std::uint64_t>[]>& mask) 
+    {
+        auto grown = std::make_unique<std::atomic<std::uint64_t>[]>(words);
+
+        for (int word = 0; word < words; ++word) 
+        {
+            grown[word].store(word < size ? mask[word].load(std::memory_order_relaxed) : 0, std::memory_order_relaxed);
+        }
+
+        mask = std::move(grown);
+    };
+
+    grow(numbers);
+    grow(dependents);
+    values.resize(static_cast<std::size_t>(words) * WORD_BITS, 0.0);
+    verified_at.resize(values.size(), 0);
+}
+
+int NumericColumns::Column::Size() const 
+{
+    return static_cast<int>(values.size());
+}
+
+void NumericColumns::Set(Position pos, double value) 
+{
+    if (pos.col >= static_cast<int>(columns_.size())) 
+    {
+        columns_.resize(pos.col + 1);
+    }
+
+    Column& column = columns_[pos.col];
+    column.Reserve(pos.row);
+    column.values[pos.row] = value;
+    const std::uint64_t bit = std::uint64_t{ 1 } << (pos.row % WORD_BITS);
+    column.numbers[pos.row / WORD_BITS].fetch_or(bit, std::memory_order_relaxed);
+    column.dependents[pos.row / WORD_BITS].fetch_and(~bit, std::memory_order_relaxed);
+}
+
+void NumericColumns::SetDependent(Position pos, double value, std::uint64_t verified_at) 
+{
+    if (pos.col >= static_cast<int>(columns_.size())) 
+    {
+        columns_.resize(pos.col + 1);
+    }
+
+    Column& column = columns_[pos.col];
+    column.Reserve(pos.row);
+    column.values[pos.row] = value;
+    column.verified_at[pos.row] = verified_at;
+    const std::uint64_t bit = std::uint64_t{ 1 } << (pos.row % WORD_BITS);
+    column.numbers[pos.row / WORD_BITS].fetch_or(bit, std::memory_order_relaxed);
+    column.dependents[pos.row / WORD_BITS].fetch_or(bit, std::memory_order_relaxed);
+}
+
+void NumericColumns::Reset(Position pos) 
+{
+    if (pos.col >= static_cast<int>(columns_.size())) 
+    {
+        columns_.resize(pos.col + 1);
+    }
+
+    // Строка появляется в столбце уже при сбросе, чтобы последующая запись
+    // числа (например, при параллельном пересчёте) не расширяла столбец
+    Column& column = columns_[pos.col];
+    column.Reserve(pos.row);
+    column.values[pos.row] = 0.0;
+    const std::uint64_t bit = std::uint64_t{ 1 } << (pos.row % WORD_BITS);
+    column.numbers[pos.row / WORD_BITS].fetch_and(~bit, std::memory_order_relaxed);
+    column.dependents[pos.row / WORD_BITS].fetch_and(~bit, std::memory_order_relaxed);
+}
+
+void NumericColumns::SetEpoch(std::uint64_t epoch) 
+{
+    epoch_ = epoch;
+}
+
+void NumericColumns::SetVerified() 
+{
+    verified_epoch_ = epoch_;
+}
+
+bool NumericColumns::IsNumber(Position pos) const 
+{
+    int end_row = pos.row + 1;
+    const Column* column = Clamp(pos.col, pos.row, end_row);
+
+    if (!column || pos.row >= end_row) 
+    {
+        return false;
+    }
+
+    const std::uint64_t bit = std::uint64_t{ 1 } << (pos.row % WORD_BITS);
+
+    if (!(column->numbers[pos.row / WORD_BITS].load(std::memory_order_relaxed) & bit)) 
+    {
+        return false;
+    }
+
+    return verified_epoch_ == epoch_ || !(column->dependents[pos.row / WORD_BITS].load(std::memory_order_relaxed) & bit) 
+        || column->verified_at[pos.row] == epoch_;
+}
+
+double NumericColumns::Get(Position pos) const 
+{
+    return IsNumber(pos) ? columns_[pos.col].values[pos.row] : 0.0;
+}
+
+double NumericColumns::Sum(int col, int begin_row, int end_row) const 
+{
+    const Column* column = Clamp(col, begin_row, end_row);
+    double sum = 0.0;
+
+    if (!column) 
+    {
+        return sum;
+    }
+
+    // Значения строк без чисел равны нулю, поэтому маска нужна, только
+    // если среди чисел могут быть устаревшие числа формул
+    if (verified_epoch_ == epoch_) 
+    {
+        for (int row = begin_row; row < end_row; ++row) 
+        {
+            sum += column->values[row];
+        }
+
+        return sum;
+    }
+
+    for (int word = begin_row / WORD_BITS; word * WORD_BITS < end_row; ++word) 
+    {
+        const int first = word * WORD_BITS;
+        const int begin = std::max(begin_row, first);
+        const int end = std::min(end_row, first + WORD_BITS);
+        const std::uint64_t stale = column->numbers[word].load(std::memory_order_relaxed) & ~ValidNumbers(*column, word);
+
+        for (int row = begin; row < end; ++row) 
+        {
+            if (!(stale >> (row - first) & 1)) 
+            {
+                sum += column->values[row];
+            }
+        }
+    }
+
+    return sum;
+}
+
+std::size_t NumericColumns::Count(int col, int begin_row, int end_row) const 
+{
+    const Column* column = Clamp(col, begin_row, end_row);
+    std::size_t count = 0;
+
+    if (!column) 
+    {
+        return count;
+    }
+
+    for (int word = begin_row / WORD_BITS; word * WORD_BITS < end_row; ++word) 
+    {
+        std::uint64_t bits = ValidNumbers(*column, word);
+        const int first = word * WORD_BITS;
+
+        // Отбрасываем строки слова, не попадающие в диапазон
+        if (begin_row > first) 
+        {
+            bits &= ~std::uint64_t{ 0 } << (begin_row - first);
+        }
+
+        if (end_row < first + WORD_BITS) 
+        {
+            bits &= ~(~std::uint64_t{ 0 } << (end_row - first));
+        }
+
+        count += std::bitset<WORD_BITS>(bits).count();
+    }
+
+    return count;
+}
+
+const NumericColumns::Column* NumericColumns::Clamp(int col, int& begin_row, int& end_row) const 
+{
+    if (col < 0 || col >= static_cast<int>(columns_.size())) 
+    {
+        return nullptr;
+    }
+
+    const Column& column = columns_[col];
+    begin_row = std::max(begin_row, 0);
+    end_row = std::min(end_row, column.Size());
+
+    if (begin_row >= end_row) 
+    {
+        end_row = begin_row;
+    }
+
+    return &column;
+}
+
+std::uint64_t NumericColumns::ValidNumbers(const Column& column, int word) const 
+{
+    std::uint64_t numbers = column.numbers[word].load(std::memory_order_relaxed);
+
+    if (verified_epoch_ == epoch_) 
+    {
+        return numbers;
+    }
+
+    // Проверяются только строки с числами зависящих формул
+    std::uint64_t dependents = numbers & column.dependents[word].load(std::memory_order_relaxed);
+
+    for (int bit = 0; dependents != 0; ++bit, dependents >>= 1) 
+    {
+        if ((dependents & 1) && column.verified_at[word * WORD_BITS + bit] != epoch_) 
+        {
+            numbers &= ~(std::uint64_t{ 1 } << bit);
+        }
+    }
+
+    return numbers;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+// Столбцовое хранилище чисел листа. Для каждого столбца хранится непрерывный
+// массив значений и битовая маска строк, значение которых - число. Ячейки
+// без числа (пустые, текстовые, с ошибкой или с ещё не вычисленной формулой)
+// в маске не отмечены, и их значение в массиве равно нулю, поэтому сумма
+// диапазона читает массив подряд без проверки маски.
+// Число формулы, зависящей от других ячеек, помнит правку листа, на которой
+// оно проверено, и после следующей правки читается как не число, пока формула
+// не проверена снова либо пока весь лист не отмечен проверенным (см. SetVerified).
+// Поэтому правка не обходит зависимые формулы, а чтение не видит устаревших чисел.
+// Set, SetDependent и Reset для разных ячеек можно вызывать из нескольких
+// потоков, если строка уже есть в столбце (столбец растёт при первой записи строки)
+class NumericColumns 
+{
+    public:
+
+        // Записывает число ячейки pos, не зависящее от других ячеек
+        void Set(Position pos, double value);
+        // Записывает число формулы pos, проверенное на правке verified_at
+        void SetDependent(Position pos, double value, std::uint64_t verified_at);
+        // Отмечает, что значение ячейки pos - не число
+        void Reset(Position pos);
+
+        // Начинает правку листа epoch: числа формул, проверенные раньше, устаревают
+        void SetEpoch(std::uint64_t epoch);
+        // Отмечает, что все записанные числа проверены на текущей правке
+        void SetVerified();
+
+        bool IsNumber(Position pos) const;
+        // Число ячейки pos либо 0, если значение ячейки - не число
+        double Get(Position pos) const;
+
+        // Сумма и количество чисел в строках [begin_row, end_row) столбца col
+        double Sum(int col, int begin_row, int end_row) const;
+        std::size_t Count(int col, int begin_row, int end_row) const;
+
+        // Вызывает func(row, value) для каждого числа в строках [begin_row, end_row) столбца col
+        template <typename Func>
+        void ForEachNumber(int col, int begin_row, int end_row, Func func) const;
+
+    private:
+
+        static constexpr int WORD_BITS = 64;
+        static constexpr std::uint64_t NEVER = std::numeric_limits<std::uint64_t>::max();
+
+        struct Column 
+        {
+            // Расширяет столбец так, чтобы в нём была строка row
+            void Reserve(int row);
+            int Size() const;
+
+            // Значения строк; значение строки без числа равно нулю
+            std::vector<double> values;
+            // Маска строк с числами, по WORD_BITS строк в слове
+            std::unique_ptr<std::atomic<std::uint64_t>[]> numbers;
+            // Маска строк с числами формул, зависящих от других ячеек
+            std::unique_ptr<std::atomic<std::uint64_t>[]> dependents;
+            // Правка, на которой проверено число зависящей формулы
+            std::vector<std::uint64_t> verified_at;
+        };
+
+        // Ограничивает диапазон строк размером столбца. Возвращает nullptr, если столбца нет
+        const Column* Clamp(int col, int& begin_row, int& end_row) const;
+        // Маска чисел слова word, из которой убраны устаревшие числа формул
+        std::uint64_t ValidNumbers(const Column& column, int word) const;
+
+        std::vector<Column> columns_;
+        // Текущая правка листа
+        std::uint64_t epoch_ = 0;
+        // Правка, на которой проверены все записанные числа
+        std::uint64_t verified_epoch_ = NEVER;
+};
+
+template <typename Func>
+void NumericColumns::ForEachNumber(int col, int begin_row, int end_row, Func func) const 
+{
+    const Column* column = Clamp(col, begin_row, end_row);
+
+    if (!column) 
+    {
+        return;
+    }
+
+    for (int word = begin_row / WORD_BITS; word * WORD_BITS < end_row; ++word) 
+    {
+        const std::uint64_t numbers = ValidNumbers(*column, word);
+        const int first = word * WORD_BITS;
+
+        for (int row = std::max(begin_row, first); row < std::min(end_row, first + WORD_BITS); ++row) 
+        {
+            if (numbers >> (row - first) & 1) 
+            {
+                func(row, column->values[row]);
+            }
+        }
+    }
+}
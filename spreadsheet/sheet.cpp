@@ -6,8 +6,17 @@
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <unordered_map>
  
 using namespace std::literals;
+
+namespace 
+{
+    // Размер пакета формул, который поток пересчитывает без обращения к пулу
+    constexpr std::size_t RECALCULATION_BATCH_SIZE = 256;
+    // Объём текста, накопив который, печать передаёт буфер в поток
+    constexpr std::size_t PRINT_BUFFER_SIZE = 1 << 16;
+} // end of namespace
  
 Sheet::~Sheet() {}
 
@@ -19,56 +28,98 @@ void Sheet::SetCell(Position pos, std::string text)
         return;
     }
     
-    cells_.resize(std::max(pos.row + 1, static_cast<int>(cells_.size())));
-    cells_[pos.row].resize(std::max(pos.col + 1, static_cast<int>(cells_[pos.row].size())));
-    
-    if (cells_[pos.row][pos.col].get() == nullptr)
+    Cell* cell = cells_.Get(pos);
+
+    if (cell == nullptr)
     {
-        cells_[pos.row][pos.col] = std::make_unique<Cell>(*this);
+        cell = &cells_.Emplace(pos, *this);
     }
     
-    cells_[pos.row][pos.col]->Set(std::move(text));
+    bool was_empty = cell->IsEmpty();
+    cell->Set(std::move(text));
+    UpdatePrintableSize(pos, was_empty, cell->IsEmpty());
 }
 
-// Универсальный геттер для константного и неконстантного GetCell()
-const Cell* Sheet::CellGetter(Position pos) const 
+// Устанавливает содержимое ячеек пакетом
+std::vector<Sheet::CellError> Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells)
 {
-    if (IsPosValid(pos) && IsCellValid(pos.row, pos.col)) 
-    {    
-        if (cells_[pos.row][pos.col]) 
+    std::vector<CellError> errors;
+    std::vector<std::pair<Cell*, std::string>> batch;
+    std::vector<std::pair<Position, bool>> positions;
+    batch.reserve(cells.size());
+    positions.reserve(cells.size());
+
+    for (auto& [pos, text] : cells) 
+    {
+        if (!pos.IsValid()) 
+        {
+            errors.push_back({ pos, std::make_exception_ptr(InvalidPositionException("Invalid position")) });
+            continue;
+        }
+
+        Cell* cell = cells_.Get(pos);
+
+        if (cell == nullptr)
+        {
+            cell = &cells_.Emplace(pos, *this);
+        }
+
+        batch.emplace_back(cell, std::move(text));
+        positions.emplace_back(pos, cell->IsEmpty());
+    }
+
+    auto cell_errors = Cell::SetBatch(batch, thread_count_ > 1 ? &GetThreadPool() : nullptr);
+
+    for (std::size_t i = 0; i < positions.size(); ++i) 
+    {
+        // Запись, перекрытая более поздней записью той же ячейки
+        if (!batch[i].first) 
         {
-            return cells_[pos.row][pos.col].get();
+            continue;
+        }
+
+        const auto [pos, was_empty] = positions[i];
+        UpdatePrintableSize(pos, was_empty, cells_.Get(pos)->IsEmpty());
+
+        if (cell_errors[i]) 
+        {
+            errors.push_back({ pos, cell_errors[i] });
         }
     }
 
-    return nullptr;
+    return errors;
 }
 
 // Возвращает указатель на ячейку (неконстантный метод)
 Cell* Sheet::GetCell(Position pos) 
 {
-    return const_cast<Cell*>(CellGetter(pos));
+    IsPosValid(pos);
+
+    return cells_.Get(pos);
 }
 
 // Возвращает указатель на ячейку (константный метод)
 const Cell* Sheet::GetCell(Position pos) const
 {
-    return CellGetter(pos);
+    IsPosValid(pos);
+
+    return cells_.Get(pos);
 }
 
 // Очищает содержимое ячейки
 void Sheet::ClearCell(Position pos) 
 {    
-    if (IsPosValid(pos) && IsCellValid(pos.row, pos.col)) 
-    {    
-        if (cells_[pos.row][pos.col]) 
+    IsPosValid(pos);
+
+    if (Cell* cell = cells_.Get(pos)) 
+    {
+        bool was_empty = cell->IsEmpty();
+        cell->Clear();
+        UpdatePrintableSize(pos, was_empty, true);
+        
+        if (!cell->IsReferenced()) 
         {
-            cells_[pos.row][pos.col]->Clear();
-            
-            if (!cells_[pos.row][pos.col]->IsReferenced()) 
-            {
-                cells_[pos.row][pos.col].reset();
-            }
+            cells_.Erase(pos);
         }
     }
 }
@@ -84,49 +135,309 @@ bool Sheet::IsPosValid(Position pos) const
     return true;
 }
 
-// Проверяет валидность ячейки
-bool Sheet::IsCellValid(int row, int col) const
-{
-    return row < static_cast<int>(cells_.size()) && col < static_cast<int>(cells_[row].size());
-}
-
 // Возвращает размер области печати (количество строк и столбцов)
 Size Sheet::GetPrintableSize() const 
 {    
-    Size size { 0, 0 };
+    return printable_size_;
+}
+
+// Обновляет счётчики непустых ячеек и границы области печати после изменения ячейки
+void Sheet::UpdatePrintableSize(Position pos, bool was_empty, bool is_empty)
+{
+    if (was_empty == is_empty) 
+    {
+        return;
+    }
+
+    // Уменьшает границу, пока последняя строка (столбец) области печати пуста
+    auto shrink = [](const std::vector<int>& occupancy, int& bound) 
+    {
+        while (bound > 0 && occupancy[bound - 1] == 0) 
+        {
+            --bound;
+        }
+    };
+
+    if (is_empty) 
+    {
+        --row_occupancy_[pos.row];
+        --col_occupancy_[pos.col];
+        shrink(row_occupancy_, printable_size_.rows);
+        shrink(col_occupancy_, printable_size_.cols);
+    } 
     
-    for (int row = 0; row < static_cast<int>(cells_.size()); row++)
+    else 
     {
-        for (int col = static_cast<int>(cells_[row].size()) - 1; col >= 0; col--)
+        if (pos.row >= static_cast<int>(row_occupancy_.size())) 
         {
-            if (cells_[row][col] && !cells_[row][col]->GetText().empty()) 
+            row_occupancy_.resize(pos.row + 1);
+        }
+
+        if (pos.col >= static_cast<int>(col_occupancy_.size())) 
+        {
+            col_occupancy_.resize(pos.col + 1);
+        }
+
+        ++row_occupancy_[pos.row];
+        ++col_occupancy_[pos.col];
+        printable_size_.rows = std::max(printable_size_.rows, pos.row + 1);
+        printable_size_.cols = std::max(printable_size_.cols, pos.col + 1);
+    }
+}
+
+// Проверяет устаревшие формулы в топологическом порядке (алгоритм Кана)
+// и вычисляет те, входы которых изменились
+std::size_t Sheet::RecalculateAll()
+{
+    // Зависимая ячейка вне множества уже проверена на текущей правке,
+    // и её значение не зависит от пересчёта
+    std::unordered_map<Cell*, std::atomic<int>> pending_inputs;
+
+    if (all_cells_changed_) 
+    {
+        cells_.ForEach([&pending_inputs](Position, Cell& cell) 
+        {
+            if (cell.IsDirty()) 
             {
-                size.rows = std::max(size.rows, row + 1);
-                size.cols = std::max(size.cols, col + 1);
+                pending_inputs.emplace(&cell, 0);
+            }
+        });
+    } 
+    
+    else 
+    {
+        std::vector<Cell*> changed;
+        changed.reserve(changed_cells_.size());
+
+        for (Position pos : changed_cells_) 
+        {
+            // Очищенная ячейка без зависимых удаляется из таблицы
+            if (Cell* cell = cells_.Get(pos)) 
+            {
+                changed.push_back(cell);
             }
         }
+
+        for (Cell* cell : Cell::FindStale(changed)) 
+        {
+            pending_inputs.emplace(cell, 0);
+        }
     }
+
+    for (const auto& [cell, count] : pending_inputs) 
+    {
+        for (Cell* dependent : cell->GetReferencingCells()) 
+        {
+            if (auto it = pending_inputs.find(dependent); it != pending_inputs.end()) 
+            {
+                ++it->second;
+            }
+        }
+    }
+
+    std::vector<Cell*> ready;
+
+    for (const auto& [cell, count] : pending_inputs) 
+    {
+        if (count == 0) 
+        {
+            ready.push_back(cell);
+        }
+    }
+
+    ThreadPool* pool = thread_count_ > 1 ? &GetThreadPool() : nullptr;
+    std::atomic<std::size_t> recalculated = 0;
+
+    // Вычисляет пакет ячеек. Ячейки, все входы которых уже вычислены, добавляются
+    // в тот же пакет; слишком большой пакет делится, и половина отдаётся пулу
+    std::function<void(std::vector<Cell*>)> process = [&](std::vector<Cell*> batch) 
+    {
+        std::size_t count = 0;
+
+        while (!batch.empty()) 
+        {
+            if (pool && batch.size() >= 2 * RECALCULATION_BATCH_SIZE) 
+            {
+                std::vector<Cell*> half(batch.begin(), batch.begin() + batch.size() / 2);
+                batch.erase(batch.begin(), batch.begin() + half.size());
+                pool->Submit([&process, half = std::move(half)]() mutable { process(std::move(half)); });
+            }
+
+            Cell* cell = batch.back();
+            batch.pop_back();
+
+            count += cell->Recalculate();
+
+            for (Cell* dependent : cell->GetReferencingCells()) 
+            {
+                auto it = pending_inputs.find(dependent);
+
+                // Последний вычисленный вход делает зависимую ячейку готовой
+                if (it != pending_inputs.end() && it->second.fetch_sub(1, std::memory_order_acq_rel) == 1) 
+                {
+                    batch.push_back(dependent);
+                }
+            }
+        }
+
+        recalculated += count;
+    };
+
+    if (!pool) 
+    {
+        process(std::move(ready));
+    } 
     
-    return size;
+    else 
+    {
+        for (std::size_t begin = 0; begin < ready.size(); begin += RECALCULATION_BATCH_SIZE) 
+        {
+            std::size_t end = std::min(ready.size(), begin + RECALCULATION_BATCH_SIZE);
+            pool->Submit([&process, batch = std::vector<Cell*>(ready.begin() + begin, ready.begin() + end)]() mutable 
+            { 
+                process(std::move(batch)); 
+            });
+        }
+
+        pool->Wait();
+    }
+
+    changed_cells_.clear();
+    all_cells_changed_ = false;
+
+    // Все формулы проверены на текущей правке, поэтому числа хранилища, записанные
+    // раньше, тоже действительны
+    if (numeric_columns_) 
+    {
+        numeric_columns_->SetVerified();
+    }
+
+    return recalculated;
+}
+
+void Sheet::SetThreadCount(std::size_t thread_count)
+{
+    if (thread_count == 0) 
+    {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    if (thread_count != thread_count_) 
+    {
+        thread_count_ = thread_count;
+        thread_pool_.reset();
+    }
+}
+
+std::size_t Sheet::GetThreadCount() const
+{
+    return thread_count_;
+}
+
+ThreadPool& Sheet::GetThreadPool()
+{
+    if (!thread_pool_) 
+    {
+        thread_pool_ = std::make_unique<ThreadPool>(thread_count_);
+    }
+
+    return *thread_pool_;
+}
+
+CacheStatistics Sheet::GetCacheStatistics() const
+{
+    return cache_counters_.Get();
 }
 
-// Выводит значение ячейки
-void Sheet::PrintValue(const Cell* cell, std::ostream& output) const
+CacheCounters& Sheet::GetCacheCounters()
 {
-    auto value = cell->GetValue();
-    std::visit([&output](const auto& obj) { output << obj; }, value);
+    return cache_counters_;
 }
 
-// Выводит текст ячейки
-void Sheet::PrintText(const Cell* cell, std::ostream& output) const
+OrderLabels& Sheet::GetOrderLabels()
 {
-    output << cell->GetText();
+    return order_labels_;
 }
 
-// Выводит содержимое таблицы (текст или значения)
+FormulaTable& Sheet::GetFormulaTable()
+{
+    return formula_table_;
+}
+
+void Sheet::SetNumericColumnsEnabled(bool enabled)
+{
+    if (!enabled) 
+    {
+        numeric_columns_.reset();
+        return;
+    }
+
+    if (numeric_columns_) 
+    {
+        return;
+    }
+
+    numeric_columns_ = std::make_unique<NumericColumns>();
+    numeric_columns_->SetEpoch(epoch_);
+
+    cells_.ForEach([](Position, const Cell& cell) 
+    {
+        cell.UpdateNumericColumns();
+    });
+}
+
+const NumericColumns* Sheet::GetNumericColumns() const
+{
+    return numeric_columns_.get();
+}
+
+NumericColumns* Sheet::GetNumericColumns()
+{
+    return numeric_columns_.get();
+}
+
+std::uint64_t Sheet::AdvanceEpoch()
+{
+    ++epoch_;
+
+    if (numeric_columns_) 
+    {
+        numeric_columns_->SetEpoch(epoch_);
+    }
+
+    return epoch_;
+}
+
+void Sheet::AddChangedCell(Position pos)
+{
+    // Повторная правка той же ячейки не удлиняет список
+    if (all_cells_changed_ || (!changed_cells_.empty() && changed_cells_.back() == pos)) 
+    {
+        return;
+    }
+
+    if (changed_cells_.size() >= cells_.Size()) 
+    {
+        all_cells_changed_ = true;
+        changed_cells_ = {};
+        return;
+    }
+
+    changed_cells_.push_back(pos);
+}
+
+void Sheet::ResetCacheStatistics()
+{
+    cache_counters_.Reset();
+}
+
+// Выводит содержимое таблицы (текст или значения). Строки собираются
+// в одном буфере, который передаётся в поток блоками
 void Sheet::Print(std::ostream& output, bool value) const 
 {
-    Size size = GetPrintableSize();
+    const Size size = GetPrintableSize();
+    std::string buffer;
+    buffer.reserve(2 * PRINT_BUFFER_SIZE);
 
     for (int row = 0; row < size.rows; row++) 
     {
@@ -134,31 +445,36 @@ void Sheet::Print(std::ostream& output, bool value) const
         {
             if (col > 0) 
             {
-                output << "\t";
+                buffer += '\t';
             }
 
-            if (IsCellValid(row, col)) 
+            if (const Cell* cell = cells_.Get({ row, col })) 
             {
-                if (cells_[row][col]) 
+                // Печатаем значение или текст в зависимости от флага value.
+                // Если value == true - печатаем значение
+                if (value) 
                 {
-                    // Печатаем значение или текст в зависимости от флага value.
-                    // Если value == true - печатаем значение
-                    if (value) 
-                    {
-                        PrintValue(cells_[row][col].get(), output);
-                    } 
-                    
-                    // Иначе value == false, значит это text - печатаем текст
-                    else 
-                    {
-                        PrintText(cells_[row][col].get(), output);
-                    }
+                    cell->AppendValue(buffer, output);
+                } 
+                
+                // Иначе value == false, значит это text - печатаем текст
+                else 
+                {
+                    cell->AppendText(buffer);
                 }
             }
         }
         
-        output << "\n";
+        buffer += '\n';
+
+        if (buffer.size() >= PRINT_BUFFER_SIZE) 
+        {
+            output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            buffer.clear();
+        }
     }
+
+    output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
 }
 
 void Sheet::PrintValues(std::ostream& output) const 
@@ -1,9 +1,17 @@
 #pragma once
  
 #include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "numeric_columns.h"
+#include "thread_pool.h"
  
+#include <cstdint>
+#include <exception>
 #include <functional>
+#include <string>
+#include <utility>
+#include <vector>
  
 class Sheet : public SheetInterface 
 {
@@ -16,18 +24,98 @@ class Sheet : public SheetInterface
         Cell* GetCell(Position pos) override;
         void ClearCell(Position pos) override;
         bool IsPosValid(Position pos) const;
-        bool IsCellValid(int row, int col) const;
         Size GetPrintableSize() const override;
+
+        // Ошибка установки ячейки при пакетной загрузке
+        struct CellError 
+        {
+            Position pos;
+            // InvalidPositionException, FormulaException или CircularDependencyException
+            std::exception_ptr error;
+        };
+
+        // Устанавливает содержимое многих ячеек за один проход: все формулы
+        // разбираются (при SetThreadCount больше 1 - параллельно), связи
+        // создаются разом в одном потоке, а проверка на циклы выполняется
+        // один раз для всего пакета. Если позиция встречается несколько раз,
+        // действует последний текст. Ячейки, которые не удалось установить,
+        // сохраняют прежнее содержимое и перечисляются в результате
+        std::vector<CellError> SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+        // Пересчитывает все формулы с устаревшими значениями за один проход в
+        // топологическом порядке: каждая формула вычисляется ровно один раз после
+        // ячеек, на которые она ссылается. Проверяются только формулы, зависящие
+        // от ячеек, изменённых после прошлого вызова. Если потоков больше одного,
+        // независимые формулы вычисляются параллельно. Возвращает количество
+        // вычисленных формул
+        std::size_t RecalculateAll();
+
+        // Количество потоков для пакетной обработки, по умолчанию один.
+        // Ноль означает число аппаратных потоков
+        void SetThreadCount(std::size_t thread_count);
+        std::size_t GetThreadCount() const;
+
+        // Счётчики попаданий и промахов кэша значений формул
+        CacheStatistics GetCacheStatistics() const;
+        void ResetCacheStatistics();
+        // Накопитель статистики, в который пишут ячейки
+        CacheCounters& GetCacheCounters();
+        // Метки топологического порядка ячеек
+        OrderLabels& GetOrderLabels();
+        // Таблица разобранных формул, общих для ячеек с одинаковой относительной записью
+        FormulaTable& GetFormulaTable();
+        // Номер последней правки листа. Правка (установка, очистка ячейки или
+        // пакет SetCells) только увеличивает номер: значения формул проверяются
+        // по нему при чтении
+        std::uint64_t GetEpoch() const 
+        {
+            // Читается при каждом обращении к значению ячейки
+            return epoch_;
+        }
+
+        std::uint64_t AdvanceEpoch();
+        // Запоминает ячейку, изменённую правкой, для следующего RecalculateAll
+        void AddChangedCell(Position pos);
+
+        // Включает столбцовое хранилище чисел (см. NumericColumns) и заполняет
+        // его значениями ячеек; выключение освобождает хранилище. Хранилище
+        // обновляется при установке и очистке ячеек и при проверке формул
+        void SetNumericColumnsEnabled(bool enabled);
+        // Хранилище чисел либо nullptr, если оно выключено. После правки числа
+        // формул со входами читаются из него как не числа, пока формула не
+        // проверена при чтении ячейки или RecalculateAll
+        const NumericColumns* GetNumericColumns() const;
+        NumericColumns* GetNumericColumns();
     
         void PrintValues(std::ostream& output) const override;
         void PrintTexts(std::ostream& output) const override;
     
     private:
+
+        // Снимок восстанавливает ячейки и метки порядка без установки текстов
+        friend class SheetSnapshot;
+
         // Можете дополнить ваш класс нужными полями и методами
-        const Cell* CellGetter(Position pos) const;
         void Print(std::ostream& output, bool value) const;
-        void PrintValue(const Cell* cell, std::ostream& output) const;
-        void PrintText(const Cell* cell, std::ostream& output) const;
+        void UpdatePrintableSize(Position pos, bool was_empty, bool is_empty);
+        ThreadPool& GetThreadPool();
 
-        std::vector<std::vector<std::unique_ptr<Cell>>> cells_;
+        CellStorage cells_;
+        // Количество непустых ячеек в каждой строке и каждом столбце
+        std::vector<int> row_occupancy_;
+        std::vector<int> col_occupancy_;
+        Size printable_size_;
+        CacheCounters cache_counters_;
+        OrderLabels order_labels_;
+        FormulaTable formula_table_;
+        std::size_t thread_count_ = 1;
+        std::uint64_t epoch_ = 0;
+        // Позиции ячеек, изменённых после последнего RecalculateAll. Если записей
+        // больше, чем ячеек в таблице, список не ведётся и пересчёт проверяет все ячейки
+        std::vector<Position> changed_cells_;
+        bool all_cells_changed_ = false;
+        // Создаётся при первой параллельной обработке
+        std::unique_ptr<ThreadPool> thread_pool_;
+        // Создаётся при включении SetNumericColumnsEnabled
+        std::unique_ptr<NumericColumns> numeric_columns_;
 };
\ No newline at end of file
@@ -0,0 +1,317 @@
+#include "sheet_io.h"
+
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+
+using namespace std::literals;
+
+namespace 
+{
+    // Начальный размер буфера чтения. Буфер растёт, только если в него
+    // не помещается одно поле
+    constexpr std::size_t READ_BUFFER_SIZE = 1 << 20;
+    // Количество ячеек, передаваемых в Sheet::SetCells за один вызов
+    constexpr std::size_t LOAD_BATCH_SIZE = 1 << 16;
+    // Объём данных, накопив который, запись передаёт буфер в поток
+    constexpr std::size_t WRITE_BUFFER_SIZE = 1 << 16;
+
+    constexpr char QUOTE = '"';
+
+    char GetDelimiter(TableFormat format) 
+    {
+        return format == TableFormat::Csv ? ',' : '\t';
+    }
+
+    // Поле, выделенное из буфера чтения
+    struct Field 
+    {
+        // Текст поля. У поля в кавычках - без внешних кавычек, но с удвоенными внутренними
+        std::string_view text;
+        bool quoted = false;
+        bool last_in_row = false;
+    };
+
+    // Отбрасывает '\r' перед переводом строки
+    std::string_view TrimCarriageReturn(std::string_view text) 
+    {
+        if (!text.empty() && text.back() == '\r') 
+        {
+            text.remove_suffix(1);
+        }
+
+        return text;
+    }
+
+    // Выделяет из data очередное поле. Возвращает длину поля вместе с
+    // разделителем либо 0, если конец поля ещё не прочитан. at_end означает,
+    // что данных больше не будет
+    std::size_t NextField(std::string_view data, bool at_end, TableFormat format, Field& field) 
+    {
+        const char delimiter = GetDelimiter(format);
+        std::size_t end = 0;
+        field = {};
+
+        if (format == TableFormat::Csv && data[0] == QUOTE) 
+        {
+            // Закрывающая кавычка - та, за которой нет второй кавычки
+            std::size_t quote = 1;
+
+            while (true) 
+            {
+                quote = data.find(QUOTE, quote);
+
+                if (quote == std::string_view::npos || (quote + 1 == data.size() && !at_end)) 
+                {
+                    if (!at_end) 
+                    {
+                        return 0;
+                    }
+
+                    // Незакрытая кавычка: поле продолжается до конца данных
+                    field.text = data.substr(1);
+                    field.quoted = true;
+                    field.last_in_row = true;
+
+                    return data.size();
+                }
+
+                if (quote + 1 < data.size() && data[quote + 1] == QUOTE) 
+                {
+                    quote += 2;
+                    continue;
+                }
+
+                break;
+            }
+
+            field.text = data.substr(1, quote - 1);
+            field.quoted = true;
+            end = quote + 1;
+        }
+
+        // Конец поля: разделитель или перевод строки. Символы между закрывающей
+        // кавычкой и разделителем отбрасываются
+        const char separators[] = { delimiter, '\n' };
+        const std::size_t separator = data.find_first_of(std::string_view(separators, 2), end);
+
+        if (separator == std::string_view::npos) 
+        {
+            if (!at_end) 
+            {
+                return 0;
+            }
+
+            if (!field.quoted) 
+            {
+                field.text = TrimCarriageReturn(data);
+            }
+
+            field.last_in_row = true;
+
+            return data.size();
+        }
+
+        if (!field.quoted) 
+        {
+            field.text = data.substr(0, separator);
+        }
+
+        if (data[separator] == '\n') 
+        {
+            field.text = field.quoted ? field.text : TrimCarriageReturn(field.text);
+            field.last_in_row = true;
+        }
+
+        return separator + 1;
+    }
+
+    // Создаёт текст ячейки из поля, заменяя удвоенные кавычки одиночными
+    std::string MakeText(const Field& field) 
+    {
+        if (!field.quoted) 
+        {
+            return std::string(field.text);
+        }
+
+        std::string text;
+        text.reserve(field.text.size());
+
+        for (std::size_t i = 0; i < field.text.size(); ++i) 
+        {
+            text += field.text[i];
+
+            if (field.text[i] == QUOTE && i + 1 < field.text.size() && field.text[i + 1] == QUOTE) 
+            {
+                ++i;
+            }
+        }
+
+        return text;
+    }
+
+    // Заключает в кавычки поле, дописанное в буфер записи с позиции begin,
+    // если в нём есть запятая, кавычка или перевод строки
+    void QuoteField(std::string& buffer, std::size_t begin, TableFormat format) 
+    {
+        if (format != TableFormat::Csv || buffer.find_first_of(",\"\r\n"sv, begin) == std::string::npos) 
+        {
+            return;
+        }
+
+        const std::string text = buffer.substr(begin);
+        buffer.resize(begin);
+        buffer += QUOTE;
+
+        for (char c : text) 
+        {
+            if (c == QUOTE) 
+            {
+                buffer += QUOTE;
+            }
+
+            buffer += c;
+        }
+
+        buffer += QUOTE;
+    }
+
+    void Save(const Sheet& sheet, std::ostream& output, TableFormat format, bool value) 
+    {
+        const Size size = sheet.GetPrintableSize();
+        const char delimiter = GetDelimiter(format);
+
+        std::string buffer;
+        buffer.reserve(2 * WRITE_BUFFER_SIZE);
+
+        for (int row = 0; row < size.rows; ++row) 
+        {
+            for (int col = 0; col < size.cols; ++col) 
+            {
+                if (col > 0) 
+                {
+                    buffer += delimiter;
+                }
+
+                if (const Cell* cell = sheet.GetCell({ row, col })) 
+                {
+                    const std::size_t begin = buffer.size();
+
+                    if (value) 
+                    {
+                        cell->AppendValue(buffer, output);
+                    }
+
+                    else 
+                    {
+                        cell->AppendText(buffer);
+                    }
+
+                    QuoteField(buffer, begin, format);
+                }
+            }
+
+            buffer += '\n';
+
+            if (buffer.size() >= WRITE_BUFFER_SIZE) 
+            {
+                output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                buffer.clear();
+            }
+        }
+
+        output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    }
+} // end of namespace
+
+std::vector<Sheet::CellError> LoadTable(Sheet& sheet, std::istream& input, TableFormat format) 
+{
+    std::vector<Sheet::CellError> errors;
+    std::vector<std::pair<Position, std::string>> batch;
+    batch.reserve(LOAD_BATCH_SIZE);
+
+    auto flush = [&sheet, &batch, &errors]() 
+    {
+        for (auto& error : sheet.SetCells(std::move(batch))) 
+        {
+            errors.push_back(std::move(error));
+        }
+
+        batch.clear();
+        batch.reserve(LOAD_BATCH_SIZE);
+    };
+
+    std::vector<char> buffer(READ_BUFFER_SIZE);
+    // Непрочитанные данные лежат в buffer[begin, end)
+    std::size_t begin = 0;
+    std::size_t end = 0;
+    bool at_end = false;
+    Position pos{ 0, 0 };
+
+    while (begin < end || !at_end) 
+    {
+        Field field;
+        const std::size_t length = begin < end
+            ? NextField(std::string_view(buffer.data() + begin, end - begin), at_end, format, field)
+            : 0;
+
+        if (length == 0) 
+        {
+            // Поле не дочитано: переносим остаток в начало буфера и читаем дальше
+            std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+
+            if (end == buffer.size()) 
+            {
+                buffer.resize(2 * buffer.size());
+            }
+
+            input.read(buffer.data() + end, static_cast<std::streamsize>(buffer.size() - end));
+            end += static_cast<std::size_t>(input.gcount());
+            at_end = !input;
+
+            continue;
+        }
+
+        begin += length;
+
+        if (!field.text.empty()) 
+        {
+            batch.emplace_back(pos, MakeText(field));
+
+            if (batch.size() == LOAD_BATCH_SIZE) 
+            {
+                flush();
+            }
+        }
+
+        if (field.last_in_row) 
+        {
+            ++pos.row;
+            pos.col = 0;
+        }
+
+        else 
+        {
+            ++pos.col;
+        }
+    }
+
+    flush();
+
+    return errors;
+}
+
+void SaveTexts(const Sheet& sheet, std::ostream& output, TableFormat format) 
+{
+    Save(sheet, output, format, false);
+}
+
+void SaveValues(const Sheet& sheet, std::ostream& output, TableFormat format) 
+{
+    Save(sheet, output, format, true);
+}
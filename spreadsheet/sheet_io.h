@@ -0,0 +1,30 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <iosfwd>
+#include <vector>
+
+// Формат табличного файла: поля строки разделены табуляцией (TSV) либо
+// запятой (CSV). В CSV поле с запятой, кавычкой или переводом строки
+// заключается в кавычки, а кавычка внутри поля удваивается. В TSV поля
+// не экранируются, как и в Sheet::PrintTexts
+enum class TableFormat 
+{
+    Tsv,
+    Csv,
+};
+
+// Загружает тексты ячеек из input: поле col строки row становится текстом
+// ячейки (row, col), пустые поля пропускаются. Файл читается через буфер
+// фиксированного размера, поля выделяются без копирования и передаются
+// в Sheet::SetCells пакетами, поэтому дополнительная память не зависит
+// от размера файла. Возвращает ошибки установки ячеек всех пакетов
+std::vector<Sheet::CellError> LoadTable(Sheet& sheet, std::istream& input, TableFormat format);
+
+// Записывают тексты (значения) печатаемой области листа в output
+// в том же порядке, что и Sheet::PrintTexts (Sheet::PrintValues).
+// Строки собираются в переиспользуемом буфере и пишутся блоками.
+// Значения-числа выводятся с настройками потока output (см. AppendNumber)
+void SaveTexts(const Sheet& sheet, std::ostream& output, TableFormat format);
+void SaveValues(const Sheet& sheet, std::ostream& output, TableFormat format);
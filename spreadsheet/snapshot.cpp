@@ -0,0 +1,646 @@
+#include "snapshot.h"
+#include "FormulaAST.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace 
+{
+    constexpr char MAGIC[8] = { 'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P' };
+    // На машине с другим порядком байтов прочитается другое число
+    constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+    constexpr std::size_t SECTION_ALIGNMENT = 8;
+
+    enum class CellKind : std::uint8_t 
+    {
+        Empty,
+        Text,
+        Formula,
+    };
+
+    // Значение формулы из кэша либо число, которым трактуется текст
+    enum class ValueKind : std::uint8_t 
+    {
+        None,
+        Number,
+        Error,
+    };
+
+    struct Header 
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;
+        std::int64_t lowest_label;
+        std::int64_t highest_label;
+        std::uint64_t formula_count;
+        std::uint64_t cell_count;
+        std::uint64_t input_count;
+        std::uint64_t instruction_count;
+        std::uint64_t constant_count;
+        std::uint64_t reference_count;
+        std::uint64_t char_count;
+    };
+
+    // Программа формулы: диапазоны в пулах инструкций, констант и ссылок
+    struct FormulaRecord 
+    {
+        std::uint32_t code_begin;
+        std::uint32_t code_size;
+        std::uint32_t constants_begin;
+        std::uint32_t constants_size;
+        std::uint32_t cells_begin;
+        std::uint32_t cells_size;
+    };
+
+    struct CellRecord 
+    {
+        std::int32_t row;
+        std::int32_t col;
+        std::int64_t order;
+        double number;
+        CellKind kind;
+        ValueKind value_kind;
+        std::uint8_t error;
+        std::uint8_t reserved;
+        // Для текста - начало в пуле символов, для формулы - номер программы
+        std::uint32_t content;
+        std::uint32_t text_size;
+        // Ячейки, на которые ссылается данная, - диапазон в пуле номеров ячеек
+        std::uint32_t inputs_begin;
+        std::uint32_t inputs_size;
+        std::uint32_t padding;
+    };
+
+    struct InstructionRecord 
+    {
+        std::uint32_t op;
+        std::uint32_t arg;
+    };
+
+    struct ReferenceRecord 
+    {
+        std::int32_t row;
+        std::int32_t col;
+    };
+
+    // Записи не содержат неявного выравнивания, поэтому байты снимка определены полностью
+    static_assert(sizeof(Header) == 88);
+    static_assert(sizeof(FormulaRecord) == 24);
+    static_assert(sizeof(CellRecord) == 48);
+    static_assert(sizeof(InstructionRecord) == 8);
+    static_assert(sizeof(ReferenceRecord) == 8);
+
+    std::size_t AlignSection(std::size_t size) 
+    {
+        return (size + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+    }
+
+    template <typename T>
+    void WriteSection(std::ostream& output, const std::vector<T>& section) 
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        const std::size_t size = section.size() * sizeof(T);
+        output.write(reinterpret_cast<const char*>(section.data()), static_cast<std::streamsize>(size));
+
+        const char padding[SECTION_ALIGNMENT] = {};
+        output.write(padding, static_cast<std::streamsize>(AlignSection(size) - size));
+    }
+
+    // Раздел снимка: массив записей в памяти снимка
+    template <typename T>
+    class Section 
+    {
+        public:
+
+            Section(const char* data, std::size_t size)
+                : data_(data)
+                , size_(size)
+                {}
+
+            std::size_t Size() const 
+            {
+                return size_;
+            }
+
+            T operator[](std::size_t index) const 
+            {
+                T record;
+                std::memcpy(&record, data_ + index * sizeof(T), sizeof(T));
+
+                return record;
+            }
+
+            // Проверяет, что диапазон [begin, begin + size) лежит в разделе
+            void CheckRange(std::uint32_t begin, std::uint32_t size) const 
+            {
+                if (begin > size_ || size > size_ - begin) 
+                {
+                    throw SnapshotError("Snapshot range is out of bounds");
+                }
+            }
+
+            const char* Data() const 
+            {
+                return data_;
+            }
+
+        private:
+
+            const char* data_ = nullptr;
+            std::size_t size_ = 0;
+    };
+
+    // Разбивает данные снимка на разделы, проверяя их размеры
+    class SectionReader 
+    {
+        public:
+
+            explicit SectionReader(std::string_view data)
+                : data_(data)
+                {}
+
+            template <typename T>
+            Section<T> Next(std::uint64_t count) 
+            {
+                if (count > (data_.size() - offset_) / sizeof(T)) 
+                {
+                    throw SnapshotError("Snapshot is truncated");
+                }
+
+                Section<T> section(data_.data() + offset_, static_cast<std::size_t>(count));
+                const std::size_t size = static_cast<std::size_t>(count) * sizeof(T);
+                offset_ = std::min(data_.size(), offset_ + AlignSection(size));
+
+                return section;
+            }
+
+        private:
+
+            std::string_view data_;
+            std::size_t offset_ = 0;
+    };
+
+    FormulaInterface::Value ReadValue(const CellRecord& record) 
+    {
+        if (record.value_kind == ValueKind::Number) 
+        {
+            return record.number;
+        }
+
+        if (record.error > static_cast<std::uint8_t>(FormulaError::Category::Arithmetic)) 
+        {
+            throw SnapshotError("Unknown formula error");
+        }
+
+        return FormulaError(static_cast<FormulaError::Category>(record.error));
+    }
+
+    void WriteValue(const FormulaInterface::Value& value, CellRecord& record) 
+    {
+        if (const double* number = std::get_if<double>(&value)) 
+        {
+            record.value_kind = ValueKind::Number;
+            record.number = *number;
+        }
+
+        else 
+        {
+            record.value_kind = ValueKind::Error;
+            record.error = static_cast<std::uint8_t>(std::get<FormulaError>(value).GetCategory());
+        }
+    }
+} // end of namespace
+
+void SheetSnapshot::Save(const Sheet& sheet, std::ostream& output) 
+{
+    // Номера ячеек нужны раньше, чем записываются связи
+    std::vector<const Cell*> cells;
+    std::unordered_map<const Cell*, std::uint32_t> cell_index;
+    cells.reserve(sheet.cells_.Size());
+    cell_index.reserve(sheet.cells_.Size());
+
+    sheet.cells_.ForEach([&cells, &cell_index](Position, const Cell& cell) 
+    {
+        cell_index.emplace(&cell, static_cast<std::uint32_t>(cells.size()));
+        cells.push_back(&cell);
+    });
+
+    // Значение формулы, не проверенной на текущей правке, устарело, только если
+    // она зависит от ячеек, изменённых после последнего пересчёта
+    std::unordered_set<const Cell*> changed;
+
+    if (!sheet.all_cells_changed_) 
+    {
+        std::vector<const Cell*> queue;
+
+        for (Position pos : sheet.changed_cells_) 
+        {
+            if (const Cell* cell = sheet.cells_.Get(pos); cell && changed.insert(cell).second) 
+            {
+                queue.push_back(cell);
+            }
+        }
+
+        for (std::size_t i = 0; i < queue.size(); ++i) 
+        {
+            for (const Cell* dependent : queue[i]->referenced_to_) 
+            {
+                if (changed.insert(dependent).second) 
+                {
+                    queue.push_back(dependent);
+                }
+            }
+        }
+    }
+
+    auto is_current = [&sheet, &changed](const Cell* cell) 
+    {
+        return !cell->IsDirty() || (!sheet.all_cells_changed_ && !changed.count(cell));
+    };
+
+    std::vector<FormulaRecord> formulas;
+    std::vector<CellRecord> records;
+    std::vector<std::uint32_t> inputs;
+    std::vector<InstructionRecord> instructions;
+    std::vector<double> constants;
+    std::vector<ReferenceRecord> references;
+    std::vector<char> chars;
+    std::unordered_map<const FormulaAST*, std::uint32_t> formula_index;
+    records.reserve(cells.size());
+
+    auto append_chars = [&chars](std::string_view text) 
+    {
+        const auto begin = static_cast<std::uint32_t>(chars.size());
+        chars.insert(chars.end(), text.begin(), text.end());
+
+        return begin;
+    };
+
+    for (const Cell* cell : cells) 
+    {
+        CellRecord record{};
+        record.row = cell->pos_.row;
+        record.col = cell->pos_.col;
+        record.order = cell->order_;
+
+        if (const auto* formula = dynamic_cast<const Cell::FormulaImpl*>(cell->impl_.get())) 
+        {
+            const auto& ast = formula->GetFormula().GetAST();
+            // Ссылки дерева заданы относительно ячейки, так их и восстанавливает загрузка
+            assert(formula->GetFormula().GetOrigin() == cell->pos_);
+            auto [it, inserted] = formula_index.emplace(ast.get(), static_cast<std::uint32_t>(formulas.size()));
+
+            if (inserted) 
+            {
+                const auto& program = ast->GetProgram();
+                FormulaRecord formula_record{};
+                formula_record.code_begin = static_cast<std::uint32_t>(instructions.size());
+                formula_record.code_size = static_cast<std::uint32_t>(program.code.size());
+                formula_record.constants_begin = static_cast<std::uint32_t>(constants.size());
+                formula_record.constants_size = static_cast<std::uint32_t>(program.constants.size());
+                formula_record.cells_begin = static_cast<std::uint32_t>(references.size());
+                formula_record.cells_size = static_cast<std::uint32_t>(program.cells.size());
+
+                for (const auto& instruction : program.code) 
+                {
+                    instructions.push_back({ static_cast<std::uint32_t>(instruction.op), instruction.arg });
+                }
+
+                constants.insert(constants.end(), program.constants.begin(), program.constants.end());
+
+                for (Position reference : program.cells) 
+                {
+                    references.push_back({ reference.row, reference.col });
+                }
+
+                formulas.push_back(formula_record);
+            }
+
+            record.kind = CellKind::Formula;
+            record.content = it->second;
+
+            // Значение, которое может быть устаревшим, не сохраняется
+            if (formula->GetCache() && is_current(cell)) 
+            {
+                WriteValue(*formula->GetCache(), record);
+            }
+        }
+
+        else if (const auto* text = dynamic_cast<const Cell::TextImpl*>(cell->impl_.get())) 
+        {
+            const std::string& content = text->GetText();
+            record.kind = CellKind::Text;
+            record.content = append_chars(content);
+            record.text_size = static_cast<std::uint32_t>(content.size());
+            WriteValue(text->GetNumericValue(), record);
+        }
+
+        else 
+        {
+            record.kind = CellKind::Empty;
+        }
+
+        record.inputs_begin = static_cast<std::uint32_t>(inputs.size());
+        record.inputs_size = static_cast<std::uint32_t>(cell->referenced_by_.Size());
+
+        for (const Cell* input : cell->referenced_by_) 
+        {
+            inputs.push_back(cell_index.at(input));
+        }
+
+        // Порядок связей в списке зависит от истории правок, а снимок - нет
+        std::sort(inputs.end() - record.inputs_size, inputs.end());
+
+        records.push_back(record);
+    }
+
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.lowest_label = sheet.order_labels_.lowest_;
+    header.highest_label = sheet.order_labels_.highest_;
+    header.formula_count = formulas.size();
+    header.cell_count = records.size();
+    header.input_count = inputs.size();
+    header.instruction_count = instructions.size();
+    header.constant_count = constants.size();
+    header.reference_count = references.size();
+    header.char_count = chars.size();
+
+    WriteSection(output, std::vector<Header>{ header });
+    WriteSection(output, formulas);
+    WriteSection(output, records);
+    WriteSection(output, inputs);
+    WriteSection(output, instructions);
+    WriteSection(output, constants);
+    WriteSection(output, references);
+    WriteSection(output, chars);
+}
+
+void SheetSnapshot::Load(Sheet& sheet, std::string_view data) 
+{
+    if (sheet.cells_.Size() != 0) 
+    {
+        throw std::logic_error("Snapshot is loaded into a non-empty sheet");
+    }
+
+    try 
+    {
+        LoadCells(sheet, data);
+    } 
+
+    catch (...) 
+    {
+        // Ячейки уже в листе, а входы формул связываются после чтения всех ячеек,
+        // поэтому частично загруженный лист нельзя читать и он очищается целиком
+        sheet.cells_ = CellStorage();
+        sheet.row_occupancy_.clear();
+        sheet.col_occupancy_.clear();
+        sheet.printable_size_ = Size{};
+        sheet.changed_cells_.clear();
+        sheet.all_cells_changed_ = false;
+
+        if (sheet.numeric_columns_) 
+        {
+            sheet.SetNumericColumnsEnabled(false);
+            sheet.SetNumericColumnsEnabled(true);
+        }
+
+        throw;
+    }
+}
+
+void SheetSnapshot::LoadCells(Sheet& sheet, std::string_view data) 
+{
+    SectionReader reader(data);
+    const Header header = reader.Next<Header>(1)[0];
+
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) 
+    {
+        throw SnapshotError("Not a sheet snapshot");
+    }
+
+    if (header.byte_order != BYTE_ORDER_MARK) 
+    {
+        throw SnapshotError("Snapshot has a different byte order");
+    }
+
+    if (header.version != VERSION) 
+    {
+        throw SnapshotError("Unsupported snapshot version " + std::to_string(header.version));
+    }
+
+    const auto formulas = reader.Next<FormulaRecord>(header.formula_count);
+    const auto records = reader.Next<CellRecord>(header.cell_count);
+    const auto inputs = reader.Next<std::uint32_t>(header.input_count);
+    const auto instructions = reader.Next<InstructionRecord>(header.instruction_count);
+    const auto constants = reader.Next<double>(header.constant_count);
+    const auto references = reader.Next<ReferenceRecord>(header.reference_count);
+    const auto chars = reader.Next<char>(header.char_count);
+
+    // Деревья строятся по программам один раз на группу ячеек. В таблицу FormulaTable
+    // они не попадают: её ключ - относительная запись исходного текста, а по
+    // канонической записи его не восстановить (1+(2+3) печатается как 1+2+3)
+    std::vector<std::shared_ptr<const FormulaAST>> asts;
+    asts.reserve(formulas.Size());
+
+    for (std::size_t i = 0; i < formulas.Size(); ++i) 
+    {
+        const FormulaRecord record = formulas[i];
+        instructions.CheckRange(record.code_begin, record.code_size);
+        constants.CheckRange(record.constants_begin, record.constants_size);
+        references.CheckRange(record.cells_begin, record.cells_size);
+
+        ASTImpl::Program program;
+        program.code.reserve(record.code_size);
+
+        for (std::uint32_t j = 0; j < record.code_size; ++j) 
+        {
+            const InstructionRecord instruction = instructions[record.code_begin + j];
+
+            if (instruction.op > static_cast<std::uint32_t>(ASTImpl::OpCode::Plus)) 
+            {
+                throw SnapshotError("Unknown instruction");
+            }
+
+            program.code.push_back({ static_cast<ASTImpl::OpCode>(instruction.op), instruction.arg });
+        }
+
+        program.constants.resize(record.constants_size);
+
+        if (record.constants_size > 0) 
+        {
+            std::memcpy(program.constants.data(), constants.Data() + record.constants_begin * sizeof(double),
+                        record.constants_size * sizeof(double));
+        }
+
+        program.cells.reserve(record.cells_size);
+
+        for (std::uint32_t j = 0; j < record.cells_size; ++j) 
+        {
+            const ReferenceRecord reference = references[record.cells_begin + j];
+
+            // Смещение вне листа переполнит int при сложении с позицией ячейки
+            if (reference.row <= -Position::MAX_ROWS || reference.row >= Position::MAX_ROWS 
+                || reference.col <= -Position::MAX_COLS || reference.col >= Position::MAX_COLS) 
+            {
+                throw SnapshotError("Cell reference is out of range");
+            }
+
+            program.cells.push_back({ reference.row, reference.col });
+        }
+
+        try 
+        {
+            asts.push_back(std::make_shared<const FormulaAST>(std::move(program)));
+        }
+
+        catch (const ParsingError& e) 
+        {
+            throw SnapshotError(e.what());
+        }
+    }
+
+    std::vector<Cell*> cells;
+    cells.reserve(records.Size());
+    // Загрузка - одна правка листа; значения из снимка проверены на ней
+    const std::uint64_t epoch = sheet.AdvanceEpoch();
+
+    for (std::size_t i = 0; i < records.Size(); ++i) 
+    {
+        const CellRecord record = records[i];
+        const Position pos{ record.row, record.col };
+
+        if (!pos.IsValid() || sheet.cells_.Get(pos)) 
+        {
+            throw SnapshotError("Invalid or repeated cell position");
+        }
+
+        if (record.order < header.lowest_label || record.order > header.highest_label) 
+        {
+            throw SnapshotError("Cell order label is out of range");
+        }
+
+        std::unique_ptr<Cell::Impl> impl;
+
+        switch (record.kind) 
+        {
+            case CellKind::Empty:
+                impl = std::make_unique<Cell::EmptyImpl>();
+                break;
+
+            case CellKind::Text:
+                chars.CheckRange(record.content, record.text_size);
+
+                if (record.text_size == 0 || record.value_kind == ValueKind::None) 
+                {
+                    throw SnapshotError("Malformed text cell");
+                }
+
+                impl = std::make_unique<Cell::TextImpl>(std::string(chars.Data() + record.content, record.text_size),
+                                                        ReadValue(record));
+                break;
+
+            case CellKind::Formula: 
+            {
+                if (record.content >= asts.size()) 
+                {
+                    throw SnapshotError("Formula index is out of range");
+                }
+
+                std::optional<FormulaInterface::Value> cache;
+
+                if (record.value_kind != ValueKind::None) 
+                {
+                    cache = ReadValue(record);
+                }
+
+                impl = std::make_unique<Cell::FormulaImpl>(MakeFormula(asts[record.content], pos), 
+                                                           sheet.cache_counters_, std::move(cache));
+                break;
+            }
+
+            default:
+                throw SnapshotError("Unknown cell kind");
+        }
+
+        Cell& cell = sheet.cells_.Emplace(pos, sheet);
+        cell.impl_ = std::move(impl);
+        cell.order_ = record.order;
+        cell.changed_at_ = epoch;
+        cell.verified_at_ = epoch;
+        cell.UpdateNumericColumns();
+        sheet.UpdatePrintableSize(pos, true, cell.IsEmpty());
+
+        // Формула без значения из снимка вычисляется при следующем пересчёте
+        if (!cell.impl_->IsCacheValid()) 
+        {
+            sheet.AddChangedCell(pos);
+        }
+
+        cells.push_back(&cell);
+    }
+
+    // Связь допустима, только если метки упорядочены: тогда граф из снимка не содержит циклов.
+    // Входы ячейки должны в точности совпадать со ссылками её формулы, иначе
+    // формула прочитает ячейку, правки которой не отмечены связью
+    std::vector<Position> input_positions;
+
+    for (std::size_t i = 0; i < records.Size(); ++i) 
+    {
+        const CellRecord record = records[i];
+        inputs.CheckRange(record.inputs_begin, record.inputs_size);
+        Cell* cell = cells[i];
+        input_positions.clear();
+
+        for (std::uint32_t j = 0; j < record.inputs_size; ++j) 
+        {
+            const std::uint32_t index = inputs[record.inputs_begin + j];
+
+            // Входы записаны по возрастанию, поэтому повтор связи - тоже повреждение
+            if (index >= cells.size() || cells[index]->order_ >= cell->order_ 
+                || (j > 0 && index <= inputs[record.inputs_begin + j - 1])) 
+            {
+                throw SnapshotError("Invalid dependency");
+            }
+
+            input_positions.push_back(cells[index]->pos_);
+        }
+
+        std::sort(input_positions.begin(), input_positions.end());
+        const std::vector<Position> referenced = cell->impl_->GetReferencedCells();
+
+        if (input_positions != referenced) 
+        {
+            throw SnapshotError("Invalid dependency");
+        }
+
+        if (!cell->impl_->BindInputs(sheet)) 
+        {
+            throw SnapshotError("Missing referenced cell");
+        }
+
+        // Связи строятся по тем же ссылкам формулы, по которым найдены её входы,
+        // как и в UpdateDependence, а список из снимка только проверяется
+        cell->referenced_by_.Reserve(referenced.size());
+
+        for (const Position pos : referenced) 
+        {
+            Cell::Link(cell, sheet.cells_.Get(pos));
+        }
+    }
+
+    sheet.order_labels_.lowest_ = header.lowest_label;
+    sheet.order_labels_.highest_ = header.highest_label;
+}
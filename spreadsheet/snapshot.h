@@ -0,0 +1,45 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <stdexcept>
+#include <string_view>
+
+// Исключение, выбрасываемое при загрузке повреждённого снимка или снимка
+// неподдерживаемой версии
+class SnapshotError : public std::runtime_error 
+{
+    public:
+
+        using std::runtime_error::runtime_error;
+};
+
+// Двоичный снимок листа. Снимок хранит тексты ячеек, скомпилированные
+// программы формул (по одной на группу ячеек с общим деревом), связи между
+// ячейками, метки топологического порядка и значения из кэша. Разделы снимка
+// - массивы записей фиксированного размера, выровненные на 8 байт, поэтому
+// снимок можно читать прямо из отображённого в память файла. Числа
+// записываются в порядке байтов машины, который сверяется при загрузке
+class SheetSnapshot 
+{
+    public:
+
+        static constexpr std::uint32_t VERSION = 1;
+
+        // Записывает снимок листа в output
+        static void Save(const Sheet& sheet, std::ostream& output);
+
+        // Восстанавливает ячейки из снимка data в пустой лист sheet. Формулы
+        // не разбираются: деревья строятся по программам, метки порядка берутся
+        // из снимка, поэтому проверка на циклы не нужна. Связи строятся по ссылкам
+        // формул и сверяются со связями из снимка. Бросает
+        // SnapshotError, если данные повреждены; лист при этом остаётся пустым
+        static void Load(Sheet& sheet, std::string_view data);
+
+    private:
+
+        // Читает снимок в лист; при исключении лист может остаться заполненным частично
+        static void LoadCells(Sheet& sheet, std::string_view data);
+};
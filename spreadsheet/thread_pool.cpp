@@ -0,0 +1,161 @@
+#include "thread_pool.h"
+
+#include <cassert>
+#include <utility>
+
+namespace 
+{
+    // Пул и номер очереди рабочего потока, который выполняет текущий код
+    thread_local const ThreadPool* current_pool = nullptr;
+    thread_local std::size_t current_queue = 0;
+} // end of namespace
+
+ThreadPool::ThreadPool(std::size_t thread_count) 
+{
+    assert(thread_count > 0);
+
+    for (std::size_t i = 0; i < thread_count; ++i) 
+    {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+
+    for (std::size_t i = 0; i < thread_count; ++i) 
+    {
+        threads_.emplace_back([this, i] { Run(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() 
+{
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+
+    work_available_.notify_all();
+
+    for (auto& thread : threads_) 
+    {
+        thread.join();
+    }
+}
+
+std::size_t ThreadPool::GetThreadCount() const 
+{
+    return threads_.size();
+}
+
+void ThreadPool::Submit(std::function<void()> task) 
+{
+    // Задачи из рабочего потока остаются в его очереди, внешние распределяются по кругу
+    std::size_t index = current_pool == this ? current_queue : next_queue_++ % queues_.size();
+    ++pending_;
+
+    // Счётчик увеличивается под блокировкой очереди, поэтому TryPop не уменьшит
+    // его раньше, а под mutex_ - поэтому ждущий поток не пропустит сигнал
+    {
+        std::lock_guard lock(mutex_);
+        std::lock_guard queue_lock(queues_[index]->mutex);
+        queues_[index]->tasks.push_back(std::move(task));
+        ++queued_;
+    }
+
+    work_available_.notify_one();
+}
+
+void ThreadPool::Wait() 
+{
+    assert(current_pool != this);
+
+    std::unique_lock lock(mutex_);
+    all_done_.wait(lock, [this] { return pending_ == 0; });
+
+    if (error_) 
+    {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+// Берёт задачу с конца своей очереди либо из начала чужой
+bool ThreadPool::TryPop(std::size_t index, std::function<void()>& task) 
+{
+    for (std::size_t offset = 0; offset < queues_.size(); ++offset) 
+    {
+        auto& queue = *queues_[(index + offset) % queues_.size()];
+        std::lock_guard lock(queue.mutex);
+
+        if (queue.tasks.empty()) 
+        {
+            continue;
+        }
+
+        if (offset == 0) 
+        {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } 
+        
+        else 
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+
+        --queued_;
+        return true;
+    }
+
+    return false;
+}
+
+// Выполняет задачу и отмечает её завершение, даже если она бросила исключение
+void ThreadPool::Execute(std::function<void()>& task) 
+{
+    try 
+    {
+        task();
+    } 
+    
+    catch (...) 
+    {
+        std::lock_guard lock(mutex_);
+
+        if (!error_) 
+        {
+            error_ = std::current_exception();
+        }
+    }
+
+    task = nullptr;
+
+    if (--pending_ == 0) 
+    {
+        std::lock_guard lock(mutex_);
+        all_done_.notify_all();
+    }
+}
+
+void ThreadPool::Run(std::size_t index) 
+{
+    current_pool = this;
+    current_queue = index;
+
+    std::function<void()> task;
+
+    while (true) 
+    {
+        if (TryPop(index, task)) 
+        {
+            Execute(task);
+            continue;
+        }
+
+        std::unique_lock lock(mutex_);
+        work_available_.wait(lock, [this] { return stop_ || queued_ > 0; });
+
+        if (stop_ && queued_ == 0) 
+        {
+            return;
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с перехватом задач (work stealing).
+// У каждого потока своя очередь: задачи, поставленные из рабочего потока,
+// попадают в его очередь и берутся с конца, что сохраняет локальность данных.
+// Поток без работы забирает задачи из начала чужих очередей.
+class ThreadPool 
+{
+    public:
+
+        explicit ThreadPool(std::size_t thread_count);
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        std::size_t GetThreadCount() const;
+
+        // Ставит задачу в очередь. Может вызываться из задач пула
+        void Submit(std::function<void()> task);
+        // Ждёт завершения всех поставленных задач, включая порождённые ими.
+        // Если задачи бросали исключения, бросает первое из них.
+        // Нельзя вызывать из задач пула
+        void Wait();
+
+    private:
+
+        struct Queue 
+        {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        void Run(std::size_t index);
+        bool TryPop(std::size_t index, std::function<void()>& task);
+        void Execute(std::function<void()>& task);
+
+        std::vector<std::unique_ptr<Queue>> queues_;
+        std::vector<std::thread> threads_;
+
+        std::mutex mutex_;
+        // Сигнализирует о появлении задач в очередях
+        std::condition_variable work_available_;
+        // Сигнализирует о завершении всех задач
+        std::condition_variable all_done_;
+        // Задачи, лежащие в очередях
+        std::atomic<std::size_t> queued_ = 0;
+        // Задачи, поставленные и ещё не завершённые
+        std::atomic<std::size_t> pending_ = 0;
+        std::atomic<std::size_t> next_queue_ = 0;
+        // Первое исключение задач с последнего Wait
+        std::exception_ptr error_;
+        bool stop_ = false;
+};